@@ -567,12 +567,12 @@ anon_oid(anon_tf_t *tfp, snmp_oid_t *v)
     }
 
 #if 0
-    smiNode = smiGetNodeByOID(v->len, v->value);
+    smiNode = smiGetNodeByOID(v->len, SNMP_OID_VALUE(v));
     if (! smiNode) {
 	goto nukeOid;
     }
 
-    smiUnpack(smiNode, v->value, v->len, &vals, &valslen);
+    smiUnpack(smiNode, SNMP_OID_VALUE(v), v->len, &vals, &valslen);
     for (i = 0; i < valslen; i++) {
 	printf("x");
     }
@@ -580,7 +580,7 @@ anon_oid(anon_tf_t *tfp, snmp_oid_t *v)
 #endif
 
  nukeOid:
-    memset(v->value, 0, v->len * sizeof(uint32_t));
+    memset(SNMP_OID_VALUE(v), 0, v->len * sizeof(uint32_t));
     v->len = 0;
     v->attr.flags &= ~SNMP_FLAG_VALUE;
 }
@@ -591,10 +591,10 @@ anon_pdu(snmp_pdu_t *pdu)
     snmp_varbind_t *vb;
     anon_tf_t *tfp = NULL;
     
-    for (vb = pdu->varbindings.varbind; vb; vb = vb->next) {
+    SNMP_VBL_FOREACH(&pdu->varbindings, vb) {
 	SmiNode *smiNode = NULL;
 	SmiType *smiType = NULL;
-	smiNode = smiGetNodeByOID(vb->name.len, vb->name.value);
+	smiNode = smiGetNodeByOID(vb->name.len, SNMP_OID_VALUE(&vb->name));
 	if (smiNode) {
 	    smiType = smiGetNodeType(smiNode);
 	}
@@ -627,6 +627,9 @@ anon_pdu(snmp_pdu_t *pdu)
 	    break;
 	}
     }
+
+    /* the names might have changed */
+    snmp_vbl_sign(&pdu->varbindings);
 }
 
 /*
@@ -0,0 +1,139 @@
+/*
+ * arena.c --
+ *
+ * A simple arena (bump) allocator. All the small objects hanging off
+ * a decoded packet (varbinds, OIDs, octet strings) are allocated from
+ * the packet's arena and released together by a single reset, which
+ * is much cheaper than freeing them one by one.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+#include "snmp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_MIN		(1024)
+#define ARENA_CHUNK_MAX		(64 * 1024)
+#define ARENA_ALIGN		(sizeof(void *) > 8 ? sizeof(void *) : 8)
+
+typedef struct _arena_chunk {
+    struct _arena_chunk *next;
+    size_t	size;		/* usable bytes in data[] */
+    size_t	used;
+    union {
+	uint64_t u64;
+	void	*ptr;
+	double	d;
+    } data[1];
+} arena_chunk_t;
+
+struct _snmp_arena {
+    arena_chunk_t *head;	/* first chunk, retained across resets */
+    arena_chunk_t *cur;		/* chunk we currently allocate from */
+};
+
+static arena_chunk_t*
+chunk_new(size_t size)
+{
+    arena_chunk_t *c;
+
+    c = malloc(sizeof(arena_chunk_t) + size);
+    if (! c) {
+	abort();
+    }
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+snmp_arena_t*
+snmp_arena_new(void)
+{
+    snmp_arena_t *arena;
+
+    arena = malloc(sizeof(snmp_arena_t));
+    if (! arena) {
+	abort();
+    }
+    arena->head = arena->cur = chunk_new(ARENA_CHUNK_MIN);
+    return arena;
+}
+
+/*
+ * Allocate size bytes of zeroed memory from the arena. Chunks that
+ * were filled before the last reset are reused before new chunks are
+ * allocated. New chunks double in size up to ARENA_CHUNK_MAX so that
+ * arenas of long-lived packet copies stay small.
+ */
+
+void*
+snmp_arena_alloc(snmp_arena_t *arena, size_t size)
+{
+    arena_chunk_t *c;
+    void *p;
+
+    assert(arena);
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    for (c = arena->cur; c->used + size > c->size; c = c->next) {
+	if (! c->next) {
+	    size_t csize = c->size < ARENA_CHUNK_MAX / 2
+		? 2 * c->size : ARENA_CHUNK_MAX;
+	    c->next = chunk_new(size > csize ? size : csize);
+	}
+	c->next->used = 0;
+    }
+    arena->cur = c;
+
+    p = (char *) c->data + c->used;
+    c->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+void*
+snmp_arena_memdup(snmp_arena_t *arena, const void *src, size_t len)
+{
+    void *dst;
+
+    dst = snmp_arena_alloc(arena, len);
+    if (len) {
+	memcpy(dst, src, len);
+    }
+    return dst;
+}
+
+/*
+ * Release everything allocated from the arena. The chunks are kept
+ * for reuse, so this is O(1).
+ */
+
+void
+snmp_arena_reset(snmp_arena_t *arena)
+{
+    assert(arena);
+
+    arena->cur = arena->head;
+    arena->head->used = 0;
+}
+
+void
+snmp_arena_delete(snmp_arena_t *arena)
+{
+    arena_chunk_t *c, *n;
+
+    if (! arena) {
+	return;
+    }
+    for (c = arena->head; c; c = n) {
+	n = c->next;
+	free(c);
+    }
+    free(arena);
+}
@@ -24,19 +24,6 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-static inline void*
-xmalloc(size_t size)
-{
-    void *p;
-
-    p = malloc(size);
-    if (! p) {
-	abort();
-    }
-    memset(p, 0, size);
-    return p;
-}
-
 /*
  * tokenizes s using delim, modifies s
  * return also empty strings for successive token, as opposed to strtok
@@ -58,46 +45,6 @@ mytok(char **s, char* delim)
     return c;
 }
 
-/*
- * Deallocate memory for a parsed SNMP packet.
- */
-
-static void
-snmp_free(snmp_packet_t *pkt)
-{
-    snmp_varbind_t *varbind, *last_varbind;
-
-    varbind = pkt->snmp.scoped_pdu.pdu.varbindings.varbind;
-
-    while (varbind) {
-	if (varbind->name.value) {
-	    free(varbind->name.value);
-	}
-	switch (varbind->type) {
-	case SNMP_TYPE_OID:
-	    if (varbind->value.oid.value) {
-		free(varbind->value.oid.value);
-	    }
-	    break;
-	case SNMP_TYPE_OCTS:
-	    if (varbind->value.octs.value) {
-		free(varbind->value.octs.value);
-	    }
-	    break;
-	case SNMP_TYPE_OPAQUE:
-	    if (varbind->value.octs.value) {
-		free(varbind->value.octs.value);
-	    }
-	    break;
-	default:
-	    break;
-	}
-	last_varbind = varbind;
-	varbind = varbind->next;
-	free(last_varbind);
-    }
-}
-
 static void
 csv_read_int32(char *s, snmp_int32_t *v)
 {
@@ -200,26 +147,27 @@ csv_read_oid_count(const char* s) {
 }
 
 static void
-csv_read_oid(char *s, snmp_oid_t *v) {
+csv_read_oid(snmp_arena_t *arena, char *s, snmp_oid_t *v) {
     int i;
     char *end;
     int count = 0;
+    uint32_t *value;
 
     count = csv_read_oid_count(s);
     if (s && count > 0) {
-	v->value = xmalloc(sizeof(uint32_t)*count);
+	value = snmp_oid_alloc(arena, v, count);
 	v->len = count;
 
-	v->value[0] = (uint32_t) strtoul((const char *) s, &end, 10);
+	value[0] = (uint32_t) strtoul((const char *) s, &end, 10);
 	if (*end == '\0' || *end == '.') {
-	    if (!(v->value[0] >= 0 && v->value[0] <= 2)) {
+	    if (!(value[0] >= 0 && value[0] <= 2)) {
 		fprintf(stderr, "%s: warning: oid first value %d should be"
-			"in  0..2\n", progname, v->value[0]);
+			"in  0..2\n", progname, value[0]);
 	    }
 	}
 	for(i=1;i<count && *end == '.';i++) {
 	    s = end+1;
-	    v->value[i] = (uint32_t) strtoul((const char *) s, &end, 10);
+	    value[i] = (uint32_t) strtoul((const char *) s, &end, 10);
 	}
 	
 	if (*end == '\0' && *s != '\0') {
@@ -228,67 +176,15 @@ csv_read_oid(char *s, snmp_oid_t *v) {
     }
 }
 
-/* helper function for dehexify */
-static int
-char_to_i(char c){
-    int n = c;
-    if (n >= '0' && n <= '9') {
-	n -= '0';
-    } else if (n >= 'a' && n <= 'f') {
-	n -= 'a' - 10;
-    } else if (n >= 'A' && n <= 'F') {
-	n -= 'A' - 10;
-    } else {
-	n = -1;
-    }
-    return n;
-}
-
-/*
- * convert octet string into string (i.e. csv -> pcap)
- * fills in length
- * returned buffer is NOT null-terminated and may contain \0 at any position
- * user has to deallocate returned buffer
- */
-static unsigned char*
-dehexify(const char *str, unsigned *length) {
-    static size_t size = 0; /* buffer size, i.e. length of output 
-			     * which is strlen(str)/2
-			     */
-    static unsigned char *buffer = NULL;
-    int i;
-    int tmp, tmp2;
-    
-    if (strlen(str)%2 != 0 || strlen(str) == 0) {
-	/* octet string implies pairs of hex numbers */
-	return NULL;
-    }
-    size = strlen(str)/2;
-    assert(size);
-    buffer = xmalloc(size);
-    for (i = 0; i < size; i++) {
-	tmp = char_to_i(str[2*i]);
-	tmp2 = char_to_i(str[2*i+1]);
-	if (tmp < 0 || tmp2 < 0) {
-	    /* encountered invalid character */
-	    free(buffer);
-	    return NULL;
-	}
-	buffer[i] = tmp*16 + tmp2;
-    }
-    *length = size;
-    return buffer;
-}
-
 static void
-csv_read_octs(char* s, snmp_octs_t* v)
+csv_read_octs(snmp_arena_t *arena, char* s, snmp_octs_t* v)
 {
-    v->value = dehexify(s, &v->len);
+    v->value = snmp_hex_dup(arena, s, &v->len);
     if (v->value) v->attr.flags |= SNMP_FLAG_VALUE;
 }
 
 static void
-csv_read_varbind(char **s, snmp_varbind_t *v)
+csv_read_varbind(snmp_arena_t *arena, char **s, snmp_varbind_t *v)
 {
     char *oid;
     char *type;
@@ -297,7 +193,7 @@ csv_read_varbind(char **s, snmp_varbind_t *v)
     //fprintf(stdout, "s: %s\n", *s);
     oid = mytok(s, ",");
     if (! oid) return;
-    csv_read_oid(oid, &v->name);
+    csv_read_oid(arena, oid, &v->name);
 
     type = mytok(s, ",");
     if (! type) return;
@@ -335,15 +231,15 @@ csv_read_varbind(char **s, snmp_varbind_t *v)
     } else if (strcmp(type, "octet-string") == 0) {
 	v->type = SNMP_TYPE_OCTS;
 	v->attr.flags |= SNMP_FLAG_VALUE;
-	csv_read_octs(value, &v->value.octs);
+	csv_read_octs(arena, value, &v->value.octs);
     } else if (strcmp(type, "object-identifier") == 0) {
 	v->type = SNMP_TYPE_OID;
 	v->attr.flags |= SNMP_FLAG_VALUE;
-	csv_read_oid(value, &v->value.oid);
+	csv_read_oid(arena, value, &v->value.oid);
     } else if (strcmp(type, "opaque") == 0) {
 	v->type = SNMP_TYPE_OPAQUE;
 	v->attr.flags |= SNMP_FLAG_VALUE;
-	csv_read_octs(value, &v->value.octs);
+	csv_read_octs(arena, value, &v->value.octs);
     } else if (strcmp(type, "no-such-object") == 0) {
 	v->type = SNMP_TYPE_NO_SUCH_OBJ;
 	v->attr.flags |= SNMP_FLAG_VALUE;
@@ -361,9 +257,9 @@ csv_read_varbind(char **s, snmp_varbind_t *v)
 }
 
 static void
-parse(char *line, snmp_callback func, void *user_data)
+parse(snmp_packet_t *pkt, char *line, snmp_callback func, void *user_data)
 {
-    snmp_packet_t _pkt, *pkt = &_pkt;
+    snmp_arena_t *arena = pkt->arena;
     char *token;
     snmp_int32_t i32;
     int len;
@@ -372,8 +268,6 @@ parse(char *line, snmp_callback func, void *user_data)
     int i;
     char *c;
 
-    memset(pkt, 0, sizeof(snmp_packet_t));
-
     /* cut string at first newline (marks the end of a CSV record */
     for (c=line; *c; c++) {
 	if (*c == '\n') {
@@ -461,28 +355,21 @@ parse(char *line, snmp_callback func, void *user_data)
     }
 
     snmp_var_bindings_t *varbindlist;
-    snmp_varbind_t *p, *q = NULL;
     varbindlist = &pkt->snmp.scoped_pdu.pdu.varbindings;
     
     varbindlist->attr.flags |= SNMP_FLAG_VALUE; /* even if zero varbinds */
     
     for (i=0; i<varbind_count; i++) {
-	p = xmalloc(sizeof(snmp_varbind_t));
-	if (! varbindlist->varbind) {
-	    varbindlist->varbind = p;
-	} else {
-	    q->next = p;
-	}
-	q = p;
-	csv_read_varbind(&line, p);
+	csv_read_varbind(arena, &line, snmp_vbl_append(arena, varbindlist));
     }
+    snmp_vbl_sign(varbindlist);
 
     if (func) {
 	func(pkt, user_data);
     }
 
     cleanup:
-    snmp_free(pkt);
+    return;
 }
 
 void
@@ -508,11 +395,14 @@ void
 snmp_csv_read_stream(FILE *stream, snmp_callback func, void *user_data)
 {
     char buffer[123456];
+    snmp_packet_t *pkt = NULL;
 
     assert(stream);
 
     while (fgets(buffer, sizeof(buffer), stream)) {
-	parse(buffer, func, user_data);
+	pkt = snmp_pkt_recycle(pkt);
+	parse(pkt, buffer, func, user_data);
     }
+    snmp_pkt_delete(pkt);
 }
 
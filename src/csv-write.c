@@ -25,102 +25,109 @@
 static const char sep = ',';
 
 static void
-csv_write_null(FILE *stream, snmp_null_t *v, const char *tag)
+csv_write_tag(snmp_sink_t *sink, int show, const char *tag)
+{
+    snmp_sink_putc(sink, sep);
+    if (show) {
+	snmp_sink_puts(sink, tag);
+    }
+}
+
+static void
+csv_write_null(snmp_sink_t *sink, snmp_null_t *v, const char *tag)
 {
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	fprintf(stream, "%c%s", sep, tag ? tag : "");
+	snmp_sink_putc(sink, sep);
+	snmp_sink_puts(sink, tag ? tag : "");
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_int32(FILE *stream, snmp_int32_t *v)
+csv_write_int32(snmp_sink_t *sink, snmp_int32_t *v)
 {
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	fprintf(stream, "%c%"PRId32, sep, v->value);
+	snmp_sink_putc(sink, sep);
+	snmp_sink_int64(sink, v->value);
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_uint32(FILE *stream, snmp_uint32_t *v)
+csv_write_uint32(snmp_sink_t *sink, snmp_uint32_t *v)
 {
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	fprintf(stream, "%c%"PRIu32, sep, v->value);
+	snmp_sink_putc(sink, sep);
+	snmp_sink_uint64(sink, v->value);
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_uint64(FILE *stream, snmp_uint64_t *v)
+csv_write_uint64(snmp_sink_t *sink, snmp_uint64_t *v)
 {
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	fprintf(stream, "%c%"PRIu64, sep, v->value);
+	snmp_sink_putc(sink, sep);
+	snmp_sink_uint64(sink, v->value);
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_ipaddr(FILE *stream, snmp_ipaddr_t *v)
+csv_write_ipaddr(snmp_sink_t *sink, snmp_ipaddr_t *v)
 {
-    char buffer[INET_ADDRSTRLEN];
-
-    if (v->attr.flags & SNMP_FLAG_VALUE
-	&& inet_ntop(AF_INET, &v->value, buffer, sizeof(buffer))) {
-	fprintf(stream, "%c%s", sep, buffer);
+    if (v->attr.flags & SNMP_FLAG_VALUE) {
+	snmp_sink_putc(sink, sep);
+	snmp_sink_ipv4(sink, &v->value);
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_ip6addr(FILE *stream, snmp_ip6addr_t *v)
+csv_write_ip6addr(snmp_sink_t *sink, snmp_ip6addr_t *v)
 {
     char buffer[INET6_ADDRSTRLEN];
 
     if (v->attr.flags & SNMP_FLAG_VALUE
 	&& inet_ntop(AF_INET6, &v->value, buffer, sizeof(buffer))) {
-	fprintf(stream, "%c%s", sep, buffer);
+	snmp_sink_putc(sink, sep);
+	snmp_sink_puts(sink, buffer);
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_octs(FILE *stream, snmp_octs_t *v)
+csv_write_octs(snmp_sink_t *sink, snmp_octs_t *v)
 {
-    int i;
-    
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	fprintf(stream, "%c", sep);
-	for (i = 0; i < v->len; i++) {
-	    fprintf(stream, "%.2x", v->value[i]);
-	}
+	snmp_sink_putc(sink, sep);
+	snmp_sink_hex(sink, v->value, v->len);
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_oid(FILE *stream, snmp_oid_t *v)
+csv_write_oid(snmp_sink_t *sink, snmp_oid_t *v)
 {
-    int i;
-    
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	for (i = 0; i < v->len; i++) {
-	    fprintf(stream, "%c%"PRIu32, (i == 0) ? sep : '.', v->value[i]);
+	if (v->len) {
+	    snmp_sink_putc(sink, sep);
+	    snmp_sink_oid(sink, SNMP_OID_VALUE(v), v->len);
 	}
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_type(FILE *stream, snmp_pdu_t *v)
+csv_write_type(snmp_sink_t *sink, snmp_pdu_t *v)
 {
     const char *name = NULL;
     
@@ -154,176 +161,177 @@ csv_write_type(FILE *stream, snmp_pdu_t *v)
 	    name = "report";
 	    break;
 	}
-	fprintf(stream, "%c%s", sep, name ? name : "");
+	snmp_sink_putc(sink, sep);
+	snmp_sink_puts(sink, name ? name : "");
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_varbind(FILE *stream, snmp_varbind_t *varbind)
+csv_write_varbind(snmp_sink_t *sink, snmp_varbind_t *varbind)
 {
     int show;
 
-    csv_write_oid(stream, &varbind->name);
+    csv_write_oid(sink, &varbind->name);
     if (varbind->attr.flags & SNMP_FLAG_VALUE) {
 	switch(varbind->type) {
 	case SNMP_TYPE_NULL:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "null" : "");
-	    csv_write_null(stream, &varbind->value.null, NULL);
+	    csv_write_tag(sink, show, "null");
+	    csv_write_null(sink, &varbind->value.null, NULL);
 	    break;
 	case SNMP_TYPE_INT32:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "integer32" : "");
-	    csv_write_int32(stream, &varbind->value.i32);
+	    csv_write_tag(sink, show, "integer32");
+	    csv_write_int32(sink, &varbind->value.i32);
 	    break;
 	case SNMP_TYPE_UINT32:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "unsigned32" : "");
-	    csv_write_uint32(stream, &varbind->value.u32);
+	    csv_write_tag(sink, show, "unsigned32");
+	    csv_write_uint32(sink, &varbind->value.u32);
 	    break;
 	case SNMP_TYPE_COUNTER32:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "counter32" : "");
-	    csv_write_uint32(stream, &varbind->value.u32);
+	    csv_write_tag(sink, show, "counter32");
+	    csv_write_uint32(sink, &varbind->value.u32);
 	    break;
 	case SNMP_TYPE_TIMETICKS:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "timeticks" : "");
-	    csv_write_uint32(stream, &varbind->value.u32);
+	    csv_write_tag(sink, show, "timeticks");
+	    csv_write_uint32(sink, &varbind->value.u32);
 	    break;
 	case SNMP_TYPE_COUNTER64:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "counter64" : "");
-	    csv_write_uint64(stream, &varbind->value.u64);
+	    csv_write_tag(sink, show, "counter64");
+	    csv_write_uint64(sink, &varbind->value.u64);
 	    break;
 	case SNMP_TYPE_IPADDR:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "ipaddress" : "");
-	    csv_write_ipaddr(stream, &varbind->value.ip);
+	    csv_write_tag(sink, show, "ipaddress");
+	    csv_write_ipaddr(sink, &varbind->value.ip);
 	    break;
 	case SNMP_TYPE_OCTS:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "octet-string" : "");
-	    csv_write_octs(stream, &varbind->value.octs);
+	    csv_write_tag(sink, show, "octet-string");
+	    csv_write_octs(sink, &varbind->value.octs);
 	    break;
 	case SNMP_TYPE_OID:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "object-identifier" : "");
-	    csv_write_oid(stream, &varbind->value.oid);
+	    csv_write_tag(sink, show, "object-identifier");
+	    csv_write_oid(sink, &varbind->value.oid);
 	    break;
 	case SNMP_TYPE_OPAQUE:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "opaque" : "");
-	    csv_write_octs(stream, &varbind->value.octs);
+	    csv_write_tag(sink, show, "opaque");
+	    csv_write_octs(sink, &varbind->value.octs);
 	    break;
 	case SNMP_TYPE_NO_SUCH_OBJ:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "no-such-object" : "");
-	    csv_write_null(stream, &varbind->value.null, NULL);
+	    csv_write_tag(sink, show, "no-such-object");
+	    csv_write_null(sink, &varbind->value.null, NULL);
 	    break;
 	case SNMP_TYPE_NO_SUCH_INST:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "no-such-instance" : "");
-	    csv_write_null(stream, &varbind->value.null, NULL);
+	    csv_write_tag(sink, show, "no-such-instance");
+	    csv_write_null(sink, &varbind->value.null, NULL);
 	    break;
 	case SNMP_TYPE_END_MIB_VIEW:
 	    show = (varbind->attr.flags & SNMP_FLAG_VALUE);
-	    fprintf(stream, "%c%s", sep, show ? "end-of-mib-view" : "");
-	    csv_write_null(stream, &varbind->value.null, NULL);
+	    csv_write_tag(sink, show, "end-of-mib-view");
+	    csv_write_null(sink, &varbind->value.null, NULL);
 	    break;
 	default:
-	    fprintf(stream, "%c%c", sep, sep);
+	    snmp_sink_putc(sink, sep);
+	    snmp_sink_putc(sink, sep);
 	    break;
 	}
     } else {
-	fprintf(stream, "%c%c", sep, sep);
+	snmp_sink_putc(sink, sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 static void
-csv_write_varbind_list(FILE *stream, snmp_var_bindings_t *varbindlist)
+csv_write_varbind_list(snmp_sink_t *sink, snmp_var_bindings_t *varbindlist)
 {
     snmp_varbind_t *vb;
 
     if (varbindlist->attr.flags & SNMP_FLAG_VALUE) {
-	for (vb = varbindlist->varbind; vb; vb = vb->next) {
-	    csv_write_varbind(stream, vb);
+	SNMP_VBL_FOREACH(varbindlist, vb) {
+	    csv_write_varbind(sink, vb);
 	}
     }
 }
 
 static void
-csv_write_varbind_list_count(FILE *stream, snmp_var_bindings_t *varbindlist)
+csv_write_varbind_list_count(snmp_sink_t *sink, snmp_var_bindings_t *varbindlist)
 {
-    snmp_varbind_t *vb;
-    int c = 0;
-
     if (varbindlist->attr.flags & SNMP_FLAG_VALUE) {
-	for (vb = varbindlist->varbind; vb; vb = vb->next, c++) ;
-	fprintf(stream, "%c%d", sep, c);
+	snmp_sink_putc(sink, sep);
+	snmp_sink_uint64(sink, varbindlist->count);
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 }
 
 void
-snmp_csv_write_stream_pkt(FILE *stream, snmp_packet_t *pkt)
+snmp_csv_write_stream_pkt(snmp_sink_t *sink, snmp_packet_t *pkt)
 {
     if (! pkt) return;
 
-    fprintf(stream, "%u.%06u", pkt->time_sec.value, pkt->time_usec.value);
+    snmp_sink_time(sink, pkt->time_sec.value, pkt->time_usec.value);
 
     if (pkt->src_addr.attr.flags & SNMP_FLAG_VALUE) {
-	csv_write_ipaddr(stream, &pkt->src_addr);
+	csv_write_ipaddr(sink, &pkt->src_addr);
     } else {
-	csv_write_ip6addr(stream, &pkt->src_addr6);
+	csv_write_ip6addr(sink, &pkt->src_addr6);
     }
-    csv_write_uint32(stream, &pkt->src_port);
+    csv_write_uint32(sink, &pkt->src_port);
     if (pkt->dst_addr.attr.flags & SNMP_FLAG_VALUE) {
-	csv_write_ipaddr(stream, &pkt->dst_addr);
+	csv_write_ipaddr(sink, &pkt->dst_addr);
     } else {
-	csv_write_ip6addr(stream, &pkt->dst_addr6);
+	csv_write_ip6addr(sink, &pkt->dst_addr6);
     }
-    csv_write_uint32(stream, &pkt->dst_port);
+    csv_write_uint32(sink, &pkt->dst_port);
 
     if (pkt->snmp.attr.flags & SNMP_FLAG_BLEN) {
-	fprintf(stream, "%c%d", sep, pkt->snmp.attr.blen);
+	snmp_sink_putc(sink, sep);
+	snmp_sink_int64(sink, pkt->snmp.attr.blen);
     } else {
-	fprintf(stream, "%c", sep);
+	snmp_sink_putc(sink, sep);
     }
 
     if (pkt->snmp.attr.flags & SNMP_FLAG_VALUE) {
-	csv_write_int32(stream, &pkt->snmp.version);
+	csv_write_int32(sink, &pkt->snmp.version);
 	
-	csv_write_type(stream, &pkt->snmp.scoped_pdu.pdu);
+	csv_write_type(sink, &pkt->snmp.scoped_pdu.pdu);
 	
-	csv_write_int32(stream, &pkt->snmp.scoped_pdu.pdu.req_id);
+	csv_write_int32(sink, &pkt->snmp.scoped_pdu.pdu.req_id);
 	
-	csv_write_int32(stream, &pkt->snmp.scoped_pdu.pdu.err_status);
+	csv_write_int32(sink, &pkt->snmp.scoped_pdu.pdu.err_status);
 	
-	csv_write_int32(stream, &pkt->snmp.scoped_pdu.pdu.err_index);
+	csv_write_int32(sink, &pkt->snmp.scoped_pdu.pdu.err_index);
 	
-	csv_write_varbind_list_count(stream,
+	csv_write_varbind_list_count(sink,
 				     &pkt->snmp.scoped_pdu.pdu.varbindings);
 	
-	csv_write_varbind_list(stream, &pkt->snmp.scoped_pdu.pdu.varbindings);
+	csv_write_varbind_list(sink, &pkt->snmp.scoped_pdu.pdu.varbindings);
     } else {
-	fprintf(stream, "%c%c%c%c%c", sep, sep, sep, sep, sep);
+	snmp_sink_write(sink, ",,,,,", 5);
     }
 
-    fprintf(stream, "\n");
+    snmp_sink_putc(sink, '\n');
 }
 
 void
-snmp_csv_write_stream_new(FILE *stream)
+snmp_csv_write_stream_new(snmp_sink_t *sink)
 {
     /* this is at the moment an empty entry point */
 }
 
 void
-snmp_csv_write_stream_end(FILE *stream)
+snmp_csv_write_stream_end(snmp_sink_t *sink)
 {
     /* this is at the moment an empty entry point */
 }
@@ -241,8 +241,8 @@ filter_octs(snmp_filter_t *filter, int flt, snmp_octs_t *v)
 static inline void
 filter_oid(snmp_filter_t *filter, int flt, snmp_oid_t *v)
 {
-    if (filter->hide[flt] && v->value) {
-	memset(v->value, 0, v->len * sizeof(uint32_t));
+    if (filter->hide[flt] && v->len) {
+	memset(SNMP_OID_VALUE(v), 0, v->len * sizeof(uint32_t));
 	v->len = 0;
     }
     filter_attr(filter, flt, &v->attr);
@@ -313,7 +313,7 @@ filter_pdu(snmp_filter_t *filter, snmp_pdu_t *pdu)
     filter_int32(filter, FLT_TIME_STAMP, &pdu->time_stamp);
     filter_attr(filter, FLT_VARBINDLIST, &pdu->varbindings.attr);
 
-    for (vb = pdu->varbindings.varbind; vb; vb = vb->next) {
+    SNMP_VBL_FOREACH(&pdu->varbindings, vb) {
 	filter_attr(filter, FLT_VARBIND, &vb->attr);
 	filter_oid(filter, FLT_NAME, &vb->name);
 	switch (vb->type) {
@@ -361,6 +361,9 @@ filter_pdu(snmp_filter_t *filter, snmp_pdu_t *pdu)
 	    break;
 	}
     }
+
+    /* the names might have changed */
+    snmp_vbl_sign(&pdu->varbindings);
 }
 
 static inline void
@@ -14,6 +14,7 @@
 #include "snmp.h"
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
@@ -25,6 +26,9 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <fcntl.h>
+
+#include <pthread.h>
 
 #define SNMP_FLOW_NONE		0x00
 #define SNMP_FLOW_COMMAND	0x01
@@ -62,59 +66,253 @@ static struct _slice_type_names {
     { .type = 0,		  .name = 0         },
 };
 
-#if 0
+/*
+ * Flows and slices are both partitions of the input which are written
+ * to their own files. The output side of a partition (the file name,
+ * the open stream and the position in the LRU list of open streams)
+ * is kept in a snmp_part_t embedded into flows and slices. If an idle
+ * timeout is set, partitions are also kept in a list ordered by the
+ * capture time of their last packet so that idle partitions can be
+ * found at the tail. Messages waiting in the write batch are chained
+ * to the partition they belong to.
+ */
+
 typedef struct _snmp_flow_elem {
     snmp_packet_t	   *pkt;
     struct _snmp_flow_elem *next;
 } snmp_flow_elem;
-#endif
+
+typedef struct _snmp_part {
+    const char		*kind;		/* "flow" or "slice" */
+    char		*name;		/* NULL if not written to a file */
+    uint64_t		cnt;		/* number of packets written */
+    snmp_sink_t		*sink;		/* NULL if currently closed */
+    struct _snmp_part	*lru_prev;	/* towards more recently used */
+    struct _snmp_part	*lru_next;	/* towards less recently used */
+    uint32_t		last;		/* capture time of the last packet */
+    struct _snmp_part	*idle_prev;	/* towards more recently active */
+    struct _snmp_part	*idle_next;	/* towards less recently active */
+    snmp_flow_elem	*run_head;	/* batched messages, oldest first */
+    snmp_flow_elem	*run_tail;
+} snmp_part_t;
+
+typedef struct {
+    snmp_part_t		*head;		/* most recently active */
+    snmp_part_t		*tail;		/* least recently active */
+} snmp_part_list_t;
+
+/*
+ * We keep an LRU cache of open flow and slice streams to reduce the
+ * number of open() close() system calls while staying within the
+ * file descriptor limit.
+ */
+
+typedef struct {
+    snmp_part_t		*head;		/* most recently used */
+    snmp_part_t		*tail;		/* least recently used */
+    int			count;
+    int			size;
+} snmp_part_lru_t;
+
+#define SNMP_PART_SINK_SIZE	(8 * 1024)	/* buffer per open file */
+#define SNMP_PART_ZIP_FILES	256		/* open compressed files */
+
+/*
+ * The write batch collects a window of messages before they are
+ * written. The messages are chained to their partitions and the
+ * partitions are remembered in the order in which their first message
+ * arrived, so that each partition's run can be written with a single
+ * open stream while the order within a partition is kept.
+ */
+
+typedef struct {
+    snmp_flow_elem	*elems;		/* out->batch elements */
+    snmp_part_t		**parts;	/* out->batch partitions */
+    unsigned		count;		/* messages in the batch */
+    unsigned		nparts;		/* partitions in the batch */
+    size_t		bytes;		/* estimated size of the batch */
+} snmp_batch_t;
+
+#define SNMP_PART_OWNER(part, type) \
+	((type *) ((char *) (part) - offsetof(type, part)))
+
+/*
+ * Flows are identified by the flow type and the manager and agent
+ * addresses. IPv4 and IPv6 addresses share the same key format, the
+ * family keeps them apart.
+ */
+
+typedef struct {
+    int			type;
+    int			family;		/* 4 or 6 */
+    u_char		src[16];
+    u_char		dst[16];
+} snmp_flow_key_t;
 
 typedef struct _snmp_flow {
     unsigned		id;
     int			type;
-    char		*name;
+    snmp_part_t		part;
+    snmp_flow_key_t	key;
     snmp_ipaddr_t       src_addr;
     snmp_ip6addr_t      src_addr6;
     snmp_uint32_t	src_port;
     snmp_ipaddr_t       dst_addr;
     snmp_ip6addr_t      dst_addr6;
     snmp_uint32_t	dst_port;
-    uint64_t		cnt;
-    FILE		*stream;
-    struct _snmp_flow	*next;
 } snmp_flow_t;
 
-static snmp_flow_t *flow_list = NULL;
+/*
+ * Open addressing hash table (linear probing) to find flows. The
+ * hash is kept with the flow pointer to avoid touching flows whose
+ * hash does not match. The table is at most half full.
+ */
+
+typedef struct {
+    uint32_t		hash;
+    snmp_flow_t		*flow;
+} snmp_flow_slot_t;
+
+typedef struct {
+    snmp_flow_slot_t	*slots;
+    size_t		size;		/* power of two */
+    size_t		count;
+} snmp_flow_table_t;
+
+#define SNMP_FLOW_TABLE_MIN_SIZE	1024
+
 
 typedef struct _snmp_slice {
     unsigned		id;
     int                 type;
-    char                *name;
+    snmp_part_t		part;
     snmp_ipaddr_t       src_addr;
     snmp_ip6addr_t      src_addr6;
     snmp_uint32_t	src_port;
     snmp_ipaddr_t       dst_addr;
     snmp_ip6addr_t      dst_addr6;
     snmp_uint32_t	dst_port;
-    uint64_t		cnt;
-    FILE		*stream;
     struct _snmp_slice	*next;
+    struct _snmp_slice	*prev;
     snmp_packet_t	*pkt;
     snmp_packet_t	*last_response;
 } snmp_slice_t;
 
-static snmp_slice_t *slice_list = NULL;
+
+/*
+ * The cache of recently seen requests is kept in a hash table keyed
+ * by the request id and the transport addresses so that responses can
+ * be matched in constant time. For expiration, the elements are also
+ * kept in a timer wheel with one slot per second of capture time.
+ * Slots are drained as time advances, so expiring requests costs time
+ * proportional to the number of expired requests.
+ */
+
+/*
+ * Matching a response only needs the request id and the transport
+ * addresses of the request, so the cache keeps a small fixed-size
+ * record instead of a copy of the request packet. Requests without
+ * a complete key can never be matched and are not cached at all.
+ */
 
 typedef struct _snmp_cache_elem {
-    snmp_packet_t *pkt;
-    struct _snmp_cache_elem *next;
-    struct _snmp_cache_elem *kids;
+    int32_t		req_id;
+    in_addr_t		src_addr;
+    in_addr_t		dst_addr;
+    uint32_t		src_port;
+    uint32_t		dst_port;
+    int			type;		/* pdu type or 0 if unknown */
+    struct _snmp_cache_elem *next;	/* timer wheel slot chain */
+    struct _snmp_cache_elem *hnext;	/* hash bucket chain */
+    struct _snmp_cache_elem **hprev;
 } snmp_cache_elem_t;
 
-static snmp_cache_elem_t *snmp_cache_list = NULL;
+typedef struct {
+    snmp_cache_elem_t **buckets;
+    size_t		size;		/* number of buckets */
+    size_t		count;		/* number of elements */
+    snmp_cache_elem_t	**wheel;	/* one slot per second */
+    unsigned		slots;		/* number of slots in the wheel */
+    unsigned		window;		/* seconds we keep requests */
+    uint32_t		now;		/* oldest second not yet expired */
+} snmp_cache_t;
+
+#define SNMP_CACHE_MIN_SIZE	1024
+#define SNMP_CACHE_WINDOW	300
+
+/*
+ * All the state of the flow and slice writers is kept in a shard.
+ * Without -J, there is a single shard driven by the reading thread.
+ * Otherwise, messages are distributed over several shards by their
+ * address pair (see snmp_shard_hash()) and every shard runs in its own
+ * thread. All messages of a flow or slice end up in the same shard, so
+ * their order is preserved.
+ */
+
+#define SNMP_SHARD_QUEUE	4096	/* messages queued per shard */
+#define SNMP_SHARD_BATCH	64	/* messages passed on at once */
+
+typedef struct {
+    snmp_packet_t	*pkt;
+    uint64_t		seq;		/* position in the input */
+} snmp_shard_msg_t;
+
+/*
+ * Slices are numbered in the order in which they are created. With
+ * several shards, this order is only known when all shards are done.
+ * Until then, the slice files carry temporary names and every shard
+ * records which message created which slice.
+ */
 
-static unsigned flow_id = 0;
-static unsigned slice_id = 0;
+typedef struct {
+    uint64_t		seq;		/* message that created the slice */
+    char		*name;		/* temporary name, may be NULL */
+} snmp_slice_rec_t;
+
+typedef struct _snmp_shard {
+    unsigned		index;
+    unsigned		count;		/* total number of shards */
+    snmp_flow_table_t	flow_table;
+    snmp_slice_t	*slice_list;
+    snmp_cache_t	cache;		/* recently seen requests */
+    snmp_part_lru_t	lru;		/* open streams */
+    snmp_part_list_t	idle_list;	/* partitions by activity */
+    snmp_batch_t	batch;		/* messages not yet written */
+    uint64_t		cnt;		/* messages processed */
+    unsigned		flow_id;
+    unsigned		slice_id;
+    snmp_slice_rec_t	*slice_recs;
+    size_t		slice_nrecs;
+    size_t		slice_recs_size;
+    uint64_t		seq;		/* message being processed */
+    pthread_mutex_t	*out_lock;	/* protects out->sink if shared */
+    struct _snmp_shards	*shards;
+
+    /* Everything below is only used if the shard has its own thread. */
+
+    pthread_t		thread;
+    pthread_mutex_t	lock;
+    pthread_cond_t	nonempty;
+    pthread_cond_t	nonfull;
+    snmp_shard_msg_t	queue[SNMP_SHARD_QUEUE];
+    unsigned		qhead;
+    unsigned		qcount;
+    int			shutdown;
+    snmp_shard_msg_t	inbox[SNMP_SHARD_BATCH]; /* filled by the reader */
+    unsigned		icount;
+} snmp_shard_t;
+
+typedef void (*snmp_shard_func)(snmp_shard_t *sh, snmp_write_t *out,
+				snmp_packet_t *pkt);
+
+typedef struct _snmp_shards {
+    snmp_shard_t	*shard;
+    unsigned		count;
+    snmp_write_t	*out;
+    snmp_shard_func	func;		/* processes one message */
+    uint64_t		seq;		/* messages dispatched */
+    pthread_mutex_t	out_lock;
+} snmp_shards_t;
 
 static inline void*
 xmalloc(size_t size)
@@ -290,8 +488,6 @@ snmp_uint32_equal(snmp_uint32_t *a, snmp_uint32_t *b)
 static inline int
 snmp_oid_equal(snmp_oid_t *a, snmp_oid_t *b)
 {
-    int i;
-    
     if (! a->attr.flags & SNMP_FLAG_VALUE
 	|| ! b->attr.flags & SNMP_FLAG_VALUE) {
 	return 0;
@@ -301,18 +497,15 @@ snmp_oid_equal(snmp_oid_t *a, snmp_oid_t *b)
 	return 0;
     }
 
-    for (i = 0; i < a->len; i++) {
-	if (a->value[i] != b->value[i]) {
-	    return 0;
-	}
-    }
-
-    return 1;
+    return memcmp(SNMP_OID_VALUE(a), SNMP_OID_VALUE(b),
+		  a->len * sizeof(uint32_t)) == 0;
 }
 
 /*
  * Compare two varbind lists whether they contain the same varbind
- * names. Note that we allow the positions of the names to be
+ * names. The signatures of the lists are checked first so that the
+ * names only have to be compared if the signatures allow a match.
+ * Note that we allow the positions of the names to be
  * different!
  */
 
@@ -321,6 +514,8 @@ snmp_vbl_cmp_names(snmp_packet_t *a, snmp_packet_t *b)
 {
     snmp_varbind_t *vb1, *vb2;
     snmp_var_bindings_t *vbl1, *vbl2;
+    char buf[64], *used = buf;
+    int found = 1;
 
     if (!a || !b) {
 	return 0;
@@ -329,29 +524,41 @@ snmp_vbl_cmp_names(snmp_packet_t *a, snmp_packet_t *b)
     vbl1 = &a->snmp.scoped_pdu.pdu.varbindings;
     vbl2 = &b->snmp.scoped_pdu.pdu.varbindings;
 
-    for (vb1 = vbl1->varbind; vb1; vb1 = vb1->next) {
-	for (vb2 = vbl2->varbind; vb2; vb2 = vb2->next) {
-	    if (vb2->attr.flags & SNMP_FLAG_USER) {
+    if (vbl1->count > vbl2->count || (vbl1->sig & ~vbl2->sig)) {
+	return 0;
+    }
+
+    /*
+     * Remember the names of b that were already matched in a local
+     * array; the packets may be shared with other shards and must
+     * not be modified here.
+     */
+
+    if (vbl2->count > sizeof(buf)) {
+	used = xmalloc(vbl2->count);
+    }
+    memset(used, 0, vbl2->count);
+
+    SNMP_VBL_FOREACH(vbl1, vb1) {
+	found = 0;
+	SNMP_VBL_FOREACH(vbl2, vb2) {
+	    if (used[vb2 - vbl2->varbind]) {
 		continue;
 	    }
 	    if (snmp_oid_equal(&vb1->name, &vb2->name)) {
-		vb2->attr.flags |= SNMP_FLAG_USER;
+		used[vb2 - vbl2->varbind] = 1;
+		found = 1;
 		break;
 	    }
 	}
-	if (! vb2) break;
-    }
-
-    /* clear the user flags in the name attr.flags */
-    for (vb2 = vbl2->varbind; vb2; vb2 = vb2->next) {
-	vb2->attr.flags &= ~SNMP_FLAG_USER;
+	if (! found) break;
     }
 
-    if (vb1) {
-	return 0;
+    if (used != buf) {
+	free(used);
     }
 
-    return 1;
+    return found;
 }
 
 
@@ -374,11 +581,12 @@ snmp_vbl_lnk_names(snmp_packet_t *a, snmp_packet_t *b)
     vbl1 = &a->snmp.scoped_pdu.pdu.varbindings;
     vbl2 = &b->snmp.scoped_pdu.pdu.varbindings;
 
-    for (vb1 = vbl1->varbind; vb1; vb1 = vb1->next) {
-	for (vb2 = vbl2->varbind; vb2; vb2 = vb2->next) {
-	    if (vb2->attr.flags & SNMP_FLAG_USER) {
-		continue;
-	    }
+    if (! (vbl1->sig & vbl2->sig)) {
+	return 0;
+    }
+
+    SNMP_VBL_FOREACH(vbl1, vb1) {
+	SNMP_VBL_FOREACH(vbl2, vb2) {
 	    if (snmp_oid_equal(&vb1->name, &vb2->name)) {
 		return 1;
 	    }
@@ -390,96 +598,218 @@ snmp_vbl_lnk_names(snmp_packet_t *a, snmp_packet_t *b)
 
 
 /*
- * Compare two time stamps. This function returns a value less than 0
- * if a < b, the value 0 if a == b, and a value > 0 if a > b.
+ * Hash the request id and the transport addresses of a request. A
+ * response is hashed with its source and destination swapped so that
+ * it lands in the bucket of the matching request.
  */
 
-static inline int
-snmp_timestamp_compare(uint32_t a_sec, uint32_t a_usec,
-		       uint32_t b_sec, uint32_t b_usec)
+static inline size_t
+snmp_cache_hash(snmp_cache_t *cache, int32_t req_id,
+		in_addr_t saddr, uint32_t sport,
+		in_addr_t daddr, uint32_t dport)
 {
-    if (a_sec < b_sec) {
-	return -1;
-    }
+    uint32_t h = 2166136261u;
+
+    h = (h ^ (uint32_t) req_id) * 16777619u;
+    h = (h ^ (uint32_t) saddr) * 16777619u;
+    h = (h ^ sport) * 16777619u;
+    h = (h ^ (uint32_t) daddr) * 16777619u;
+    h = (h ^ dport) * 16777619u;
+    return h & (cache->size - 1);
+}
 
-    if (a_sec > b_sec) {
-	return 1;
+/*
+ * Double the number of hash buckets. Elements are appended to their
+ * new bucket in the order of their old bucket, so newer elements stay
+ * in front of older elements within a bucket.
+ */
+
+static void
+snmp_cache_grow(snmp_cache_t *cache)
+{
+    snmp_cache_elem_t **old = cache->buckets, ***tail, *p, *q;
+    size_t i, h, size = cache->size;
+
+    cache->size = size ? 2 * size : SNMP_CACHE_MIN_SIZE;
+    cache->buckets = xmalloc(cache->size * sizeof(snmp_cache_elem_t *));
+    tail = xmalloc(cache->size * sizeof(snmp_cache_elem_t **));
+    for (h = 0; h < cache->size; h++) {
+	tail[h] = &cache->buckets[h];
     }
-    
-    if (a_sec == b_sec) {
-	if (a_usec < b_usec) {
-	    return -1;
+
+    for (i = 0; i < size; i++) {
+	for (p = old[i]; p; p = q) {
+	    q = p->hnext;
+	    h = snmp_cache_hash(cache, p->req_id, p->src_addr, p->src_port,
+				p->dst_addr, p->dst_port);
+	    p->hnext = NULL;
+	    p->hprev = tail[h];
+	    *tail[h] = p;
+	    tail[h] = &p->hnext;
 	}
-	if (a_usec < b_usec) {
-	    return 1;
+    }
+
+    free(tail);
+    free(old);
+}
+
+/*
+ * Remove all elements from a timer wheel slot.
+ */
+
+static void
+snmp_cache_drain(snmp_cache_t *cache, unsigned slot)
+{
+    snmp_cache_elem_t *p, *q;
+
+    for (p = cache->wheel[slot]; p; p = q) {
+	q = p->next;
+	*p->hprev = p->hnext;
+	if (p->hnext) {
+	    p->hnext->hprev = p->hprev;
 	}
+	cache->count--;
+	free(p);
     }
+    cache->wheel[slot] = NULL;
+}
 
-    return 0;
+/*
+ * Remove all elements that were added before the given second.
+ */
+
+static void
+snmp_cache_advance(snmp_cache_t *cache, uint32_t sec)
+{
+    uint32_t n;
+
+    if (sec <= cache->now) {
+	return;
+    }
+    n = sec - cache->now;
+    if (n > cache->slots) {
+	n = cache->slots;
+    }
+    while (n-- > 0) {
+	snmp_cache_drain(cache, (sec - 1 - n) % cache->slots);
+    }
+    cache->now = sec;
 }
 
 /*
- * Add a new packet to the cache of recently seen packets.
+ * Remove all elements from the cache that are older than the window
+ * relative to the given time stamp. Expiration works with a one
+ * second granularity.
  */
 
-static snmp_cache_elem_t*
-snmp_cache_add(snmp_cache_elem_t *list, snmp_packet_t *pkt)
+static void
+snmp_cache_expire(snmp_cache_t *cache, uint32_t ts_sec)
 {
-    snmp_cache_elem_t *p;
+    if (cache->wheel && ts_sec > cache->window) {
+	snmp_cache_advance(cache, ts_sec - cache->window);
+    }
+}
 
-    p = xmalloc(sizeof(snmp_cache_elem_t));
-    p->pkt = snmp_pkt_copy(pkt);
-    p->next = list;
-    return p;
+static void
+snmp_cache_init(snmp_cache_t *cache, unsigned window, uint32_t ts_sec)
+{
+    cache->window = window ? window : SNMP_CACHE_WINDOW;
+    cache->slots = cache->window + 2;
+    cache->wheel = xmalloc(cache->slots * sizeof(snmp_cache_elem_t *));
+    cache->now = ts_sec > cache->window ? ts_sec - cache->window : 0;
 }
 
 /*
- * Remove all elements from the cache list that are older than the
- * given time stamp. Since we add new packets at the front of the
- * list, we basically have to traverse the list until we find old
- * packets and then we can discard the tail. Perhaps a smarter data
- * structure should be used to scale to very bursty SNMP traces...
+ * Add a new packet to the cache of recently seen packets. Packets
+ * with a time stamp before the oldest slot of the wheel are put into
+ * the oldest slot.
  */
 
-static snmp_cache_elem_t*
-snmp_cache_expire(snmp_cache_elem_t *list,
-		  uint32_t ts_sec, uint32_t ts_usec)
+static void
+snmp_cache_add(snmp_cache_t *cache, snmp_packet_t *pkt)
 {
-    snmp_cache_elem_t *p = list, *l = NULL, *x;
-    
-    while (p) {
-	if (snmp_timestamp_compare(p->pkt->time_sec.value,
-				   p->pkt->time_usec.value,
-				   ts_sec, ts_usec) < 0) {
-	    x = p;
-	    if (l) {
-		l->next = p->next;
-	    } else {
-		list = p->next;
-	    }
-	    p = p->next;
-	    if (x->pkt) {
-		snmp_pkt_delete(x->pkt);
-		x->pkt = NULL;
-	    }
-	    free(x);
-	} else {
-	    l = p; p = p->next;
-	}
+    snmp_pdu_t *pdu = &pkt->snmp.scoped_pdu.pdu;
+    snmp_cache_elem_t *p;
+    uint32_t sec = pkt->time_sec.value;
+    unsigned slot;
+    size_t h;
+
+    if (! (pdu->req_id.attr.flags & SNMP_FLAG_VALUE
+	   && pkt->src_addr.attr.flags & SNMP_FLAG_VALUE
+	   && pkt->src_port.attr.flags & SNMP_FLAG_VALUE
+	   && pkt->dst_addr.attr.flags & SNMP_FLAG_VALUE
+	   && pkt->dst_port.attr.flags & SNMP_FLAG_VALUE)) {
+	return;
+    }
+
+    if (cache->count >= cache->size) {
+	snmp_cache_grow(cache);
+    }
+
+    if (sec < cache->now) {
+	sec = cache->now;
+    } else if (sec - cache->now >= cache->slots) {
+	snmp_cache_advance(cache, sec - cache->slots + 1);
+    }
+    slot = sec % cache->slots;
+
+    p = xmalloc(sizeof(snmp_cache_elem_t));
+    p->req_id = pdu->req_id.value;
+    p->src_addr = pkt->src_addr.value;
+    p->dst_addr = pkt->dst_addr.value;
+    p->src_port = pkt->src_port.value;
+    p->dst_port = pkt->dst_port.value;
+    p->type = (pdu->attr.flags & SNMP_FLAG_VALUE) ? pdu->type : 0;
+    p->next = cache->wheel[slot];
+    cache->wheel[slot] = p;
+    cache->count++;
+
+    h = snmp_cache_hash(cache, p->req_id, p->src_addr, p->src_port,
+			p->dst_addr, p->dst_port);
+    p->hnext = cache->buckets[h];
+    if (p->hnext) {
+	p->hnext->hprev = &p->hnext;
     }
+    p->hprev = &cache->buckets[h];
+    cache->buckets[h] = p;
+}
+
+static void
+snmp_cache_reset(snmp_cache_t *cache)
+{
+    unsigned i;
 
-    return list;
+    if (cache->wheel) {
+	for (i = 0; i < cache->slots; i++) {
+	    snmp_cache_drain(cache, i);
+	}
+	free(cache->wheel);
+    }
+    free(cache->buckets);
+    memset(cache, 0, sizeof(*cache));
 }
 
 /*
  * For a given packet pkt, find a suitable matching packet in the
- * cache.
+ * cache. If there are several matching packets, the most recently
+ * added one is returned.
  */
 
 static snmp_cache_elem_t*
-snmp_cache_find(snmp_cache_elem_t *list, snmp_packet_t *pkt)
+snmp_cache_find(snmp_cache_t *cache, snmp_packet_t *pkt)
 {
+    snmp_pdu_t *pdu = &pkt->snmp.scoped_pdu.pdu;
     snmp_cache_elem_t *p;
+    size_t h;
+
+    if (! cache->count
+	|| ! (pdu->req_id.attr.flags & SNMP_FLAG_VALUE
+	      && pkt->src_addr.attr.flags & SNMP_FLAG_VALUE
+	      && pkt->src_port.attr.flags & SNMP_FLAG_VALUE
+	      && pkt->dst_addr.attr.flags & SNMP_FLAG_VALUE
+	      && pkt->dst_port.attr.flags & SNMP_FLAG_VALUE)) {
+	return NULL;
+    }
 
     /*
      * Some agents (most notably older NET-SNMP agents) may send
@@ -487,9 +817,12 @@ snmp_cache_find(snmp_cache_elem_t *list, snmp_packet_t *pkt)
      * devices. Should we relax the rules here???
      */
 
-    for (p = list; p; p = p->next) {
-	if (snmp_int32_equal(&p->pkt->snmp.scoped_pdu.pdu.req_id,
-			     &pkt->snmp.scoped_pdu.pdu.req_id)
+    h = snmp_cache_hash(cache, pdu->req_id.value,
+			pkt->dst_addr.value, pkt->dst_port.value,
+			pkt->src_addr.value, pkt->src_port.value);
+
+    for (p = cache->buckets[h]; p; p = p->hnext) {
+	if (p->req_id == pdu->req_id.value
 	    
 	    /* xxx what about ipv6 addresses ??? */
 	    
@@ -500,10 +833,10 @@ snmp_cache_find(snmp_cache_elem_t *list, snmp_packet_t *pkt)
 	     * have no clue where this is coming from; furthermore
 	     * runtime seems to increase significantly xxx */
 	    
-	    && snmp_ipaddr_equal(&p->pkt->dst_addr, &pkt->src_addr)
-	    && snmp_uint32_equal(&p->pkt->dst_port, &pkt->src_port)
-	    && snmp_ipaddr_equal(&p->pkt->src_addr, &pkt->dst_addr)
-  	    && snmp_uint32_equal(&p->pkt->src_port, &pkt->dst_port)) {
+	    && p->dst_addr == pkt->src_addr.value
+	    && p->dst_port == pkt->src_port.value
+	    && p->src_addr == pkt->dst_addr.value
+	    && p->src_port == pkt->dst_port.value) {
 	    return p;
 	}
     }
@@ -512,15 +845,11 @@ snmp_cache_find(snmp_cache_elem_t *list, snmp_packet_t *pkt)
 }
 
 static inline int
-snmp_flow_type(snmp_packet_t *pkt)
+snmp_flow_pdu_type(int pdu_type)
 {
     int type = SNMP_FLOW_NONE;
-    
-    if (! pkt->snmp.scoped_pdu.pdu.attr.flags & SNMP_FLAG_VALUE) {
-	return SNMP_FLOW_NONE;
-    }
 
-    switch (pkt->snmp.scoped_pdu.pdu.type) {
+    switch (pdu_type) {
     case SNMP_PDU_GET:
     case SNMP_PDU_GETNEXT:
     case SNMP_PDU_GETBULK:
@@ -544,15 +873,21 @@ snmp_flow_type(snmp_packet_t *pkt)
 }
 
 static inline int
-snmp_slice_type(snmp_packet_t *pkt)
+snmp_flow_type(snmp_packet_t *pkt)
 {
-    int type = SNMP_SLICE_NONE;
-    
     if (! pkt->snmp.scoped_pdu.pdu.attr.flags & SNMP_FLAG_VALUE) {
-	return SNMP_SLICE_NONE;
+	return SNMP_FLOW_NONE;
     }
 
-    switch (pkt->snmp.scoped_pdu.pdu.type) {
+    return snmp_flow_pdu_type(pkt->snmp.scoped_pdu.pdu.type);
+}
+
+static inline int
+snmp_slice_pdu_type(int pdu_type)
+{
+    int type = SNMP_SLICE_NONE;
+
+    switch (pdu_type) {
     case SNMP_PDU_GET:
 	type = SNMP_SLICE_GET;
 	break;
@@ -583,16 +918,164 @@ snmp_slice_type(snmp_packet_t *pkt)
     return type;
 }
 
+static inline int
+snmp_slice_type(snmp_packet_t *pkt)
+{
+    if (! pkt->snmp.scoped_pdu.pdu.attr.flags & SNMP_FLAG_VALUE) {
+	return SNMP_SLICE_NONE;
+    }
+
+    return snmp_slice_pdu_type(pkt->snmp.scoped_pdu.pdu.type);
+}
+
+/*
+ * Fill in the flow key for a packet. The source and destination are
+ * swapped if reverse is set. Returns 0 if the packet does not carry
+ * a pair of IPv4 or IPv6 addresses.
+ */
+
+static int
+snmp_flow_key(snmp_packet_t *pkt, int type, int reverse, snmp_flow_key_t *key)
+{
+    memset(key, 0, sizeof(*key));
+    key->type = type;
+    if (pkt->src_addr.attr.flags & SNMP_FLAG_VALUE
+	&& pkt->dst_addr.attr.flags & SNMP_FLAG_VALUE) {
+	key->family = 4;
+	memcpy(key->src, reverse ? &pkt->dst_addr.value : &pkt->src_addr.value, 4);
+	memcpy(key->dst, reverse ? &pkt->src_addr.value : &pkt->dst_addr.value, 4);
+	return 1;
+    }
+    if (pkt->src_addr6.attr.flags & SNMP_FLAG_VALUE
+	&& pkt->dst_addr6.attr.flags & SNMP_FLAG_VALUE) {
+	key->family = 6;
+	memcpy(key->src, reverse ? &pkt->dst_addr6.value : &pkt->src_addr6.value, 16);
+	memcpy(key->dst, reverse ? &pkt->src_addr6.value : &pkt->dst_addr6.value, 16);
+	return 1;
+    }
+    return 0;
+}
+
+static inline uint32_t
+snmp_flow_hash(snmp_flow_key_t *key)
+{
+    const u_char *p = (const u_char *) key;
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++) {
+	h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static snmp_flow_t*
+flow_table_lookup(snmp_flow_table_t *table, snmp_flow_key_t *key)
+{
+    snmp_flow_slot_t *e;
+    uint32_t h;
+    size_t i;
+
+    if (! table->count) {
+	return NULL;
+    }
+
+    h = snmp_flow_hash(key);
+    for (i = h & (table->size - 1); ; i = (i + 1) & (table->size - 1)) {
+	e = &table->slots[i];
+	if (! e->flow) {
+	    return NULL;
+	}
+	if (e->hash == h && memcmp(&e->flow->key, key, sizeof(*key)) == 0) {
+	    return e->flow;
+	}
+    }
+}
+
+/*
+ * Insert a flow into the hash table. A flow with the same key that is
+ * already in the table is replaced since the most recently created
+ * flow wins.
+ */
+
+static void
+flow_table_insert(snmp_flow_table_t *table, snmp_flow_t *flow)
+{
+    snmp_flow_slot_t *e;
+    uint32_t h;
+    size_t i;
+
+    if (2 * (table->count + 1) > table->size) {
+	snmp_flow_slot_t *old = table->slots;
+	size_t j, size = table->size;
+
+	table->size = size ? 2 * size : SNMP_FLOW_TABLE_MIN_SIZE;
+	table->slots = xmalloc(table->size * sizeof(snmp_flow_slot_t));
+	for (j = 0; j < size; j++) {
+	    if (! old[j].flow) continue;
+	    for (i = old[j].hash & (table->size - 1); table->slots[i].flow;
+		 i = (i + 1) & (table->size - 1)) ;
+	    table->slots[i] = old[j];
+	}
+	free(old);
+    }
+
+    h = snmp_flow_hash(&flow->key);
+    for (i = h & (table->size - 1); ; i = (i + 1) & (table->size - 1)) {
+	e = &table->slots[i];
+	if (! e->flow) {
+	    table->count++;
+	    break;
+	}
+	if (e->hash == h
+	    && memcmp(&e->flow->key, &flow->key, sizeof(flow->key)) == 0) {
+	    break;
+	}
+    }
+    e->hash = h;
+    e->flow = flow;
+}
+
+/*
+ * Remove a flow from the hash table. The following entries of the
+ * probe sequence are shifted back into the hole so that lookups never
+ * stop early at an empty slot.
+ */
+
+static void
+flow_table_remove(snmp_flow_table_t *table, snmp_flow_t *flow)
+{
+    size_t i, j, k, mask = table->size - 1;
+
+    for (i = snmp_flow_hash(&flow->key) & mask; table->slots[i].flow != flow;
+	 i = (i + 1) & mask) {
+	if (! table->slots[i].flow) {
+	    return;
+	}
+    }
+
+    for (j = (i + 1) & mask; table->slots[j].flow; j = (j + 1) & mask) {
+	k = table->slots[j].hash & mask;
+	if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+	    table->slots[i] = table->slots[j];
+	    i = j;
+	}
+    }
+    table->slots[i].flow = NULL;
+    table->count--;
+}
+
 /*
  * Find a flow, potentially creating new flows if a flow does not yet
  * exist.
  */
 
 static snmp_flow_t*
-snmp_flow_find(snmp_packet_t *pkt)
+snmp_flow_find(snmp_shard_t *sh, snmp_write_t *out, snmp_packet_t *pkt)
 {
     snmp_flow_t *p;
     snmp_cache_elem_t *e;
+    snmp_flow_key_t key;
     int flow_type;
     int reverse = 0;
 
@@ -607,9 +1090,9 @@ snmp_flow_find(snmp_packet_t *pkt)
      */
 
     if (flow_type == SNMP_FLOW_NONE) {
-	e = snmp_cache_find(snmp_cache_list, pkt);
-	if (e && e->pkt->snmp.scoped_pdu.pdu.attr.flags & SNMP_FLAG_VALUE) {
-	    flow_type = snmp_flow_type(e->pkt);
+	e = snmp_cache_find(&sh->cache, pkt);
+	if (e && e->type) {
+	    flow_type = snmp_flow_pdu_type(e->type);
 	    reverse = 1;
 	}
     }
@@ -623,26 +1106,15 @@ snmp_flow_find(snmp_packet_t *pkt)
      * one if there is no appropriate flow entry yet.
      */
 
-    for (p = flow_list; p; p = p->next) {
-	if (p->type == flow_type
-	    && snmp_ipaddr_equal(&p->src_addr,
-				 reverse ? &pkt->dst_addr : &pkt->src_addr)
-	    && snmp_ipaddr_equal(&p->dst_addr,
-				 reverse ? &pkt->src_addr : &pkt->dst_addr)) {
-	    break;
-	}
-	if (p->type == flow_type
-	    && snmp_ip6addr_equal(&p->src_addr6,
-				  reverse ? &pkt->dst_addr6 : &pkt->src_addr6)
-	    && snmp_ip6addr_equal(&p->dst_addr6,
-				  reverse ? &pkt->src_addr6 : &pkt->dst_addr6)) {
-	    break;
-	}
+    if (! snmp_flow_key(pkt, flow_type, reverse, &key)) {
+	return NULL;
     }
 
+    p = flow_table_lookup(&sh->flow_table, &key);
+
     if (! p) {
 	p = xmalloc(sizeof(snmp_flow_t));
-	p->id = flow_id++;
+	p->id = sh->flow_id++;
 	p->type = flow_type;
 	if (pkt->src_addr.attr.flags & SNMP_FLAG_VALUE
 	    && pkt->dst_addr.attr.flags & SNMP_FLAG_VALUE) {
@@ -656,21 +1128,59 @@ snmp_flow_find(snmp_packet_t *pkt)
 	}
 	memcpy(&p->src_port, &pkt->src_port, sizeof(p->src_port));
 	memcpy(&p->dst_port, &pkt->dst_port, sizeof(p->dst_port));
-	p->name = snmp_flow_name(p);
-	p->next = flow_list;
-	flow_list = p;
+	p->part.kind = "flow";
+	p->part.name = snmp_flow_name(p);
+	if (p->part.name && out->idle) {
+	    /* flows that can expire come in generations */
+	    size_t len = strlen(p->part.name);
+	    snprintf(p->part.name + len, FLOW_NAME_SIZE - len,
+		     "-%" PRIu32, pkt->time_sec.value);
+	}
+	snmp_flow_key(pkt, flow_type, 0, &p->key);
+	flow_table_insert(&sh->flow_table, p);
     }
     
     return p;
 }
 
+/*
+ * Give a new slice of a shard a temporary name and remember the
+ * message that created it; see snmp_slice_rename().
+ */
+
+static void
+snmp_slice_record(snmp_shard_t *sh, snmp_slice_t *p)
+{
+    snmp_slice_rec_t *rec;
+    size_t len;
+
+    if (sh->slice_nrecs == sh->slice_recs_size) {
+	sh->slice_recs_size = sh->slice_recs_size ? 2 * sh->slice_recs_size : 64;
+	sh->slice_recs = realloc(sh->slice_recs,
+			 sh->slice_recs_size * sizeof(snmp_slice_rec_t));
+	if (! sh->slice_recs) {
+	    abort();
+	}
+    }
+    rec = &sh->slice_recs[sh->slice_nrecs++];
+    rec->seq = sh->seq;
+    rec->name = NULL;
+    if (p->part.name) {
+	len = strlen(p->part.name);
+	snprintf(p->part.name + len, SLICE_NAME_SIZE - len,
+		 "-%u.tmp", sh->index);
+	rec->name = xmalloc(strlen(p->part.name) + 1);
+	strcpy(rec->name, p->part.name);
+    }
+}
+
 /*
  * Find a slice, potentially creating new slices if a slice does not
  * yet exist.
  */
 
 static snmp_slice_t*
-snmp_slice_find(snmp_packet_t *pkt)
+snmp_slice_find(snmp_shard_t *sh, snmp_packet_t *pkt)
 {
     snmp_slice_t *p;
     snmp_cache_elem_t *e = NULL;
@@ -688,9 +1198,9 @@ snmp_slice_find(snmp_packet_t *pkt)
      */
 
     if (slice_type == SNMP_FLOW_NONE) {
-	e = snmp_cache_find(snmp_cache_list, pkt);
-	if (e && e->pkt->snmp.scoped_pdu.pdu.attr.flags & SNMP_FLAG_VALUE) {
-	    slice_type = snmp_slice_type(e->pkt);
+	e = snmp_cache_find(&sh->cache, pkt);
+	if (e && e->type) {
+	    slice_type = snmp_slice_pdu_type(e->type);
 	    reverse = 1;
 	}
     }
@@ -704,7 +1214,7 @@ snmp_slice_find(snmp_packet_t *pkt)
      * one if there is no appropriate slice entry yet.
      */
 
-    for (p = slice_list; p; p = p->next) {
+    for (p = sh->slice_list; p; p = p->next) {
 
 	if (p->type != slice_type) continue;
 
@@ -741,10 +1251,14 @@ snmp_slice_find(snmp_packet_t *pkt)
 	}
 
 #if 0
-	fprintf(stderr, "\n(current, first, last_response):\n");
-	snmp_csv_write_stream_pkt(stderr, pkt);
-	snmp_csv_write_stream_pkt(stderr, p->pkt);
-	snmp_csv_write_stream_pkt(stderr, p->last_response);
+	{
+	    snmp_sink_t *sink = snmp_sink_new_stream(stderr, 0);
+	    snmp_sink_puts(sink, "\n(current, first, last_response):\n");
+	    snmp_csv_write_stream_pkt(sink, pkt);
+	    snmp_csv_write_stream_pkt(sink, p->pkt);
+	    snmp_csv_write_stream_pkt(sink, p->last_response);
+	    snmp_sink_delete(sink);
+	}
 #endif
 	    
 	if (slice_type == SNMP_SLICE_GET ||
@@ -770,7 +1284,7 @@ snmp_slice_find(snmp_packet_t *pkt)
 
     if (! p) {
 	p = xmalloc(sizeof(snmp_slice_t));
-	p->id = slice_id++;
+	p->id = sh->slice_id++;
 	p->type = slice_type;
 	if (pkt->src_addr.attr.flags & SNMP_FLAG_VALUE
 	    && pkt->dst_addr.attr.flags & SNMP_FLAG_VALUE) {
@@ -784,272 +1298,745 @@ snmp_slice_find(snmp_packet_t *pkt)
 	}
 	memcpy(&p->src_port, &pkt->src_port, sizeof(p->src_port));
 	memcpy(&p->dst_port, &pkt->dst_port, sizeof(p->dst_port));
-	p->name = snmp_slice_name(p);
-	p->pkt = snmp_pkt_copy(pkt);
+	p->part.kind = "slice";
+	p->part.name = snmp_slice_name(p);
+	if (sh->count > 1) {
+	    snmp_slice_record(sh, p);
+	}
+	p->pkt = snmp_pkt_ref(pkt);
 	p->last_response = NULL;
-	p->next = slice_list;
-	slice_list = p;
+	p->prev = NULL;
+	p->next = sh->slice_list;
+	if (sh->slice_list) {
+	    sh->slice_list->prev = p;
+	}
+	sh->slice_list = p;
     }
 
     if (e) {
 	if (p->last_response) {
 	    snmp_pkt_delete(p->last_response);
 	}
-	p->last_response = snmp_pkt_copy(pkt);
+	p->last_response = snmp_pkt_ref(pkt);
     }
     
     return p;
 }
 
 /*
- * Helper function to open a flow file with a nice extension.
+ * Helper function to create the file name of a flow or slice with a
+ * nice extension.
  */
 
-static FILE*
-snmp_flow_open_stream(snmp_flow_t *flow, snmp_write_t *out, const char *mode)
-{
 #define MAX_FILENAME_SIZE 4096
-    char filename[MAX_FILENAME_SIZE];
-    FILE *stream;
 
-    snprintf(filename, MAX_FILENAME_SIZE, "%s%s%s%s%s.%s",
+static void
+snmp_part_filename(const char *name, snmp_write_t *out, char *filename)
+{
+    snprintf(filename, MAX_FILENAME_SIZE, "%s%s%s%s%s.%s%s",
 	     out->path ? out->path : "",
 	     out->path ? "/" : "",
 	     out->prefix ? out->prefix : "",
 	     out->prefix ? "-" : "",
-	     flow->name,
-	     out->ext ? out->ext : "");
-    stream = fopen(filename, mode);
-    if (! stream) {
-	fprintf(stderr, "%s: failed to open flow file %s: %s\n",
-		progname, filename, strerror(errno));
+	     name,
+	     out->ext ? out->ext : "",
+	     out->gzip ? ".gz" : "");
+}
+
+/*
+ * Helper function to open a flow or slice file.
+ */
+
+static snmp_sink_t*
+snmp_part_open_sink(snmp_part_t *part, snmp_write_t *out, int flags)
+{
+    char filename[MAX_FILENAME_SIZE];
+    snmp_sink_t *sink;
+    int fd;
+
+    snmp_part_filename(part->name, out, filename);
+    fd = open(filename, O_WRONLY | O_CREAT | flags, 0666);
+    if (fd < 0) {
+	fprintf(stderr, "%s: failed to open %s file %s: %s\n",
+		progname, part->kind, filename, strerror(errno));
+	return NULL;
     }
-    return stream;
+    sink = snmp_sink_new_fd(fd, SNMP_PART_SINK_SIZE);
+    if (out->gzip) {
+	snmp_sink_compress(sink, out->gzip);
+    }
+    return sink;
 }
 
 /*
- * Helper function to close a flow file stream. Any stream errors that
- * might have occured are reported to stderr.
+ * Helper function to close a flow or slice file. Any write errors
+ * that might have occured are reported to stderr.
  */
 
 static void
-snmp_flow_close_stream(snmp_flow_t *flow)
+snmp_part_close_sink(snmp_part_t *part)
 {
-    if (flow && flow->stream) {
-	if (fflush(flow->stream) || ferror(flow->stream)) {
-	    fprintf(stderr, "%s: error on flow stream %s: %s\n",
-		    progname, flow->name, strerror(errno));
+    if (part && part->sink) {
+	if (snmp_sink_close(part->sink)) {
+	    fprintf(stderr, "%s: error on %s stream %s: %s\n",
+		    progname, part->kind, part->name, strerror(errno));
 	}
-	fclose(flow->stream);
-	flow->stream = NULL;
+	part->sink = NULL;
     }
 }
 
 /*
- * Helper function to open a slice file with a nice extension.
+ * The file descriptors we may use are split evenly between the shards.
+ * open() fails once the soft limit is reached, so the soft limit and
+ * not the hard limit determines how many files we can keep open. Every
+ * open compressed file also holds a block of SNMP_ZIP_BLOCK bytes, so
+ * fewer of them are kept open to bound the memory used.
  */
 
-static FILE*
-snmp_slice_open_stream(snmp_slice_t *slice, snmp_write_t *out, const char *mode)
+static void
+open_flow_cache_init(snmp_part_lru_t *lru, snmp_write_t *out,
+		     unsigned shards)
 {
-#define MAX_FILENAME_SIZE 4096
-    char filename[MAX_FILENAME_SIZE];
-    FILE *stream;
+    struct rlimit rl;
 
-    snprintf(filename, MAX_FILENAME_SIZE, "%s%s%s%s%s.%s",
-	     out->path ? out->path : "",
-	     out->path ? "/" : "",
-	     out->prefix ? out->prefix : "",
-	     out->prefix ? "-" : "",
-	     slice->name,
-	     out->ext ? out->ext : "");
-    stream = fopen(filename, mode);
-    if (! stream) {
-	fprintf(stderr, "%s: failed to open slice file %s: %s\n",
-		progname, filename, strerror(errno));
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+	fprintf(stderr,
+		"%s: getrlimit() failed: unable to allocate open flow cache\n",
+		progname);
+	exit(1);
+    }
+    
+    if (rl.rlim_cur == RLIM_INFINITY) {
+	lru->size = 1024;			/* pretend to be like Linux */
+    } else if (rl.rlim_cur >= 8 + shards) {	/* arbitrary safety margin */
+	lru->size = rl.rlim_cur - 8;
+    } else {
+	fprintf(stderr, "%s: not enough open file descriptors left\n",
+		progname);
+	exit(1);
+    }
+    if (out->gzip && lru->size > SNMP_PART_ZIP_FILES) {
+	lru->size = SNMP_PART_ZIP_FILES;
+    }
+    lru->size /= shards;
+    if (lru->size < 1) {
+	lru->size = 1;
+    }
+}
+
+static void
+open_flow_cache_update(snmp_shard_t *sh, snmp_write_t *out,
+		       snmp_packet_t *pkt)
+{
+    if (sh->cnt == 0) {
+	open_flow_cache_init(&sh->lru, out, sh->count);
+	snmp_cache_init(&sh->cache, out->window, pkt->time_sec.value);
+    }
+
+    sh->cnt++;
+
+    snmp_cache_expire(&sh->cache, pkt->time_sec.value);
+}
+
+#if 0
+static void
+open_flow_cache_print(snmp_part_lru_t *lru)
+{
+    snmp_part_t *p;
+    int i = 0;
+
+    for (p = lru->head; p; p = p->lru_next) {
+	fprintf(stderr, "%3d: %s\n", i++, p->name);
     }
-    return stream;
+}
+#endif
+
+static void
+open_flow_cache_unlink(snmp_part_lru_t *lru, snmp_part_t *part)
+{
+    if (part->lru_prev) {
+	part->lru_prev->lru_next = part->lru_next;
+    } else {
+	lru->head = part->lru_next;
+    }
+    if (part->lru_next) {
+	part->lru_next->lru_prev = part->lru_prev;
+    } else {
+	lru->tail = part->lru_prev;
+    }
+    part->lru_prev = part->lru_next = NULL;
+    lru->count--;
+}
+
+/*
+ * Move a partition to the front of the LRU list. If it is not yet in
+ * the list and the list is full, the stream of the least recently
+ * used partition is closed and that partition is dropped from the
+ * list.
+ */
+
+static void
+open_flow_cache_add(snmp_part_lru_t *lru, snmp_part_t *part)
+{
+    /* The current partition is on the top - don't bother any further... */
+
+    if (lru->head == part) {
+	return;
+    }
+
+    if (part->lru_prev) {
+	open_flow_cache_unlink(lru, part);
+    } else if (lru->count == lru->size) {
+	snmp_part_t *last = lru->tail;
+	snmp_part_close_sink(last);
+	open_flow_cache_unlink(lru, last);
+    }
+
+    /* Move the partition to the top... */
+
+    part->lru_prev = NULL;
+    part->lru_next = lru->head;
+    if (lru->head) {
+	lru->head->lru_prev = part;
+    } else {
+	lru->tail = part;
+    }
+    lru->head = part;
+    lru->count++;
 }
 
 /*
- * Helper function to close a slice file stream. Any stream errors that
- * might have occured are reported to stderr.
+ * Write a message which does not belong to any flow or slice to the
+ * output stream. The stream is shared by all shards.
  */
 
 static void
-snmp_slice_close_stream(snmp_slice_t *slice)
+snmp_shard_write_unknown(snmp_shard_t *sh, snmp_write_t *out,
+			 snmp_packet_t *pkt)
 {
-    if (slice && slice->stream) {
-	if (fflush(slice->stream) || ferror(slice->stream)) {
-	    fprintf(stderr, "%s: error on slice stream %s: %s\n",
-		    progname, slice->name, strerror(errno));
+    if (out->sink && out->write_pkt) {
+	if (sh->out_lock) {
+	    pthread_mutex_lock(sh->out_lock);
+	}
+	out->write_pkt(out->sink, pkt);
+	if (sh->out_lock) {
+	    pthread_mutex_unlock(sh->out_lock);
 	}
-	fclose(slice->stream);
-	slice->stream = NULL;
     }
 }
 
 /*
- * We keep an LRU cache of open flows to reduce the number of open()
- * close() system calls.
+ * Make sure the file of a partition is open. The file is created when
+ * the first packet is written and reopened in append mode if it was
+ * closed in the meantime.
  */
 
-static snmp_flow_t **open_flow_cache = NULL;
-static int open_flow_cache_size = 0;
-static int cnt = 0;
+static snmp_sink_t*
+snmp_part_sink(snmp_part_t *part, snmp_write_t *out)
+{
+    if (! part->sink) {
+	part->sink = snmp_part_open_sink(part, out, (part->cnt == 0)
+					 ? O_TRUNC : O_APPEND);
+    }
+    return part->sink;
+}
 
 static void
-open_flow_cache_init()
+snmp_part_write_pkt(snmp_part_t *part, snmp_write_t *out, snmp_packet_t *pkt)
 {
-    struct rlimit rl;
+    if (part->cnt == 0 && out->write_new) {
+	out->write_new(part->sink);
+    }
+    if (out->write_pkt) {
+	out->write_pkt(part->sink, pkt);
+    }
+    part->cnt++;
+}
 
-    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
-	fprintf(stderr,
-		"%s: getrlimit() failed: unable to allocate open flow cache\n",
-		progname);
-	exit(1);
+/*
+ * Estimate the number of bytes a message adds to a batch. Messages
+ * read from captures know their BER length; for the others we guess
+ * from the number of varbinds.
+ */
+
+static size_t
+snmp_batch_size(snmp_packet_t *pkt)
+{
+    if (pkt->snmp.attr.flags & SNMP_FLAG_BLEN) {
+	return pkt->snmp.attr.blen;
     }
-    
-    if (rl.rlim_max == RLIM_INFINITY) {
-	open_flow_cache_size = 1024;		/* pretend to be like Linux */
-    } else if (rl.rlim_max > 8) {		/* arbitrary safety margin */
-	open_flow_cache_size = rl.rlim_max - 8;
+    return 64 + 32 * pkt->snmp.scoped_pdu.pdu.varbindings.count;
+}
+
+/*
+ * Write the batched messages, one partition after the other. Messages
+ * of partitions whose file can not be opened go to the output stream.
+ */
+
+static void
+snmp_batch_flush(snmp_shard_t *sh, snmp_write_t *out)
+{
+    snmp_batch_t *batch = &sh->batch;
+    snmp_part_t *part;
+    snmp_flow_elem *e;
+    unsigned i;
+
+    for (i = 0; i < batch->nparts; i++) {
+	part = batch->parts[i];
+	snmp_part_sink(part, out);
+	for (e = part->run_head; e; e = e->next) {
+	    if (part->sink) {
+		snmp_part_write_pkt(part, out, e->pkt);
+	    } else {
+		snmp_shard_write_unknown(sh, out, e->pkt);
+	    }
+	    snmp_pkt_delete(e->pkt);
+	    e->pkt = NULL;
+	}
+	if (part->sink) {
+	    open_flow_cache_add(&sh->lru, part);
+	}
+	part->run_head = part->run_tail = NULL;
+    }
+    batch->count = 0;
+    batch->nparts = 0;
+    batch->bytes = 0;
+}
+
+/*
+ * Add a message to the run of its partition in the write batch and
+ * write the batch once it is full.
+ */
+
+static void
+snmp_batch_add(snmp_shard_t *sh, snmp_part_t *part, snmp_write_t *out,
+	       snmp_packet_t *pkt)
+{
+    snmp_batch_t *batch = &sh->batch;
+    snmp_flow_elem *e;
+
+    if (! batch->elems) {
+	batch->elems = xmalloc(out->batch * sizeof(snmp_flow_elem));
+	batch->parts = xmalloc(out->batch * sizeof(snmp_part_t *));
+    }
+
+    e = &batch->elems[batch->count++];
+    e->pkt = snmp_pkt_ref(pkt);
+    e->next = NULL;
+    if (part->run_tail) {
+	part->run_tail->next = e;
     } else {
-	fprintf(stderr, "%s: not enough open file descriptors left\n",
-		progname);
-	exit(1);
+	part->run_head = e;
+	batch->parts[batch->nparts++] = part;
+    }
+    part->run_tail = e;
+    batch->bytes += snmp_batch_size(pkt);
+
+    if (batch->count == out->batch
+	|| (out->batch_bytes && batch->bytes >= out->batch_bytes)) {
+	snmp_batch_flush(sh, out);
+    }
+}
+
+static void
+snmp_batch_delete(snmp_batch_t *batch)
+{
+    free(batch->elems);
+    free(batch->parts);
+    memset(batch, 0, sizeof(snmp_batch_t));
+}
+
+/*
+ * Write a packet to the file of a partition, or add it to the write
+ * batch if batching is enabled. Returns 1 if the packet was written
+ * or batched.
+ */
+
+static int
+snmp_part_write(snmp_shard_t *sh, snmp_part_t *part, snmp_write_t *out,
+		snmp_packet_t *pkt)
+{
+    if (! part->name) {
+	return 0;
+    }
+    if (out->batch) {
+	snmp_batch_add(sh, part, out, pkt);
+	return 1;
+    }
+    if (! snmp_part_sink(part, out)) {
+	return 0;
     }
+    snmp_part_write_pkt(part, out, pkt);
+    open_flow_cache_add(&sh->lru, part);
+    return 1;
+}
+
+/*
+ * Finish the file of a partition and release the partition's output
+ * resources.
+ */
 
-    open_flow_cache = xmalloc(sizeof(snmp_flow_t*) * open_flow_cache_size);
+static void
+snmp_part_done(snmp_part_t *part, snmp_write_t *out)
+{
+    if (! part->name) {
+	return;
+    }
+    if (! part->sink) {
+	part->sink = snmp_part_open_sink(part, out, O_APPEND);
+    }
+    if (part->sink) {
+	if (out->write_end) {
+	    out->write_end(part->sink);
+	}
+	snmp_part_close_sink(part);
+    }
+    free(part->name);
+    part->name = NULL;
 }
 
+/*
+ * Functions to maintain the idle list. A partition is moved to the
+ * head of the list whenever it sees a packet.
+ */
+
 static void
-open_flow_cache_update(snmp_packet_t *pkt)
+idle_list_unlink(snmp_part_list_t *list, snmp_part_t *part)
 {
-    if (cnt == 0) {
-	open_flow_cache_init();
+    if (part->idle_prev) {
+	part->idle_prev->idle_next = part->idle_next;
+    } else {
+	list->head = part->idle_next;
     }
+    if (part->idle_next) {
+	part->idle_next->idle_prev = part->idle_prev;
+    } else {
+	list->tail = part->idle_prev;
+    }
+    part->idle_prev = part->idle_next = NULL;
+}
 
-    cnt++;
+static void
+idle_list_touch(snmp_part_list_t *list, snmp_part_t *part, uint32_t ts_sec)
+{
+    if (list->head != part) {
+	if (part->idle_prev) {
+	    idle_list_unlink(list, part);
+	}
+	part->idle_next = list->head;
+	if (list->head) {
+	    list->head->idle_prev = part;
+	} else {
+	    list->tail = part;
+	}
+	list->head = part;
+    }
+    part->last = ts_sec;
+}
+
+/*
+ * Return the least recently active partition if it has been idle for
+ * more than the idle timeout at the given time stamp.
+ */
 
-    if (! (cnt % 1024)) {
-	snmp_cache_list = snmp_cache_expire(snmp_cache_list,
-					    pkt->time_sec.value - 300,
-					    pkt->time_usec.value);
+static snmp_part_t*
+idle_list_expired(snmp_part_list_t *list, snmp_write_t *out, uint32_t ts_sec)
+{
+    snmp_part_t *part = list->tail;
+
+    if (! part || ts_sec <= part->last || ts_sec - part->last <= out->idle) {
+	return NULL;
     }
+    return part;
+}
+
+/*
+ * Finalize the file of an idle partition and take it out of the lists.
+ */
+
+static void
+snmp_part_expire(snmp_shard_t *sh, snmp_part_t *part, snmp_write_t *out)
+{
+    if (part->run_head) {
+	snmp_batch_flush(sh, out);
+    }
+    idle_list_unlink(&sh->idle_list, part);
+    if (part->lru_prev || sh->lru.head == part) {
+	open_flow_cache_unlink(&sh->lru, part);
+    }
+    snmp_part_done(part, out);
 }
 
-#if 0
 static void
-open_flow_cache_print()
+open_flow_cache_reset(snmp_shard_t *sh)
+{
+    snmp_cache_reset(&sh->cache);
+    memset(&sh->lru, 0, sizeof(sh->lru));
+    memset(&sh->idle_list, 0, sizeof(sh->idle_list));
+    sh->cnt = 0;
+}
+
+/*
+ * Hash the address pair of a message. The hash does not depend on the
+ * direction of the message so that requests and responses end up in
+ * the same shard. Messages without an address pair go to shard 0.
+ */
+
+static uint32_t
+snmp_shard_hash(snmp_packet_t *pkt)
 {
+    uint32_t a = 2166136261u, b = 2166136261u, h;
     int i;
 
-    for (i = 0; i < open_flow_cache_size; i++) {
-	fprintf(stderr, "%3d: %s\n", i,
-		open_flow_cache[i] ? open_flow_cache[i]->name : "");
+    if (pkt->src_addr.attr.flags & SNMP_FLAG_VALUE
+	&& pkt->dst_addr.attr.flags & SNMP_FLAG_VALUE) {
+	memcpy(&a, &pkt->src_addr.value, 4);
+	memcpy(&b, &pkt->dst_addr.value, 4);
+    } else if (pkt->src_addr6.attr.flags & SNMP_FLAG_VALUE
+	       && pkt->dst_addr6.attr.flags & SNMP_FLAG_VALUE) {
+	for (i = 0; i < 16; i++) {
+	    a = (a ^ ((u_char *) &pkt->src_addr6.value)[i]) * 16777619u;
+	    b = (b ^ ((u_char *) &pkt->dst_addr6.value)[i]) * 16777619u;
+	}
+    } else {
+	return 0;
+    }
+
+    if (a > b) {
+	h = a, a = b, b = h;
     }
+    h = (a * 2654435761u) ^ b;
+    h = (h ^ (h >> 15)) * 2246822519u;
+    return h ^ (h >> 13);
 }
-#endif
+
+/*
+ * Hand the messages collected by the reading thread over to the
+ * shard's thread. This blocks while the shard's queue is full.
+ */
 
 static void
-open_flow_cache_add(snmp_flow_t *flow)
+snmp_shard_flush(snmp_shard_t *sh)
 {
-    int i, j;
-    snmp_flow_t *tmp;
+    unsigned i;
 
-    for (i = 0; i < open_flow_cache_size; i++) {
-	if (open_flow_cache[i] == flow) {
-	    break;
+    if (! sh->icount) {
+	return;
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    while (SNMP_SHARD_QUEUE - sh->qcount < sh->icount) {
+	pthread_cond_wait(&sh->nonfull, &sh->lock);
+    }
+    for (i = 0; i < sh->icount; i++) {
+	sh->queue[(sh->qhead + sh->qcount + i) % SNMP_SHARD_QUEUE]
+	    = sh->inbox[i];
+    }
+    sh->qcount += sh->icount;
+    pthread_cond_signal(&sh->nonempty);
+    pthread_mutex_unlock(&sh->lock);
+    sh->icount = 0;
+}
+
+/*
+ * The shard threads process their messages in the order in which they
+ * were queued and release them afterwards.
+ */
+
+static void*
+snmp_shard_main(void *arg)
+{
+    snmp_shard_t *sh = (snmp_shard_t *) arg;
+    snmp_shards_t *shards = sh->shards;
+    snmp_shard_msg_t msgs[SNMP_SHARD_QUEUE];
+    unsigned i, n;
+
+    pthread_mutex_lock(&sh->lock);
+    while (1) {
+	while (! sh->qcount && ! sh->shutdown) {
+	    pthread_cond_wait(&sh->nonempty, &sh->lock);
 	}
-	if (!open_flow_cache[i]) {
-	    i = open_flow_cache_size;
+	if (! sh->qcount) {
 	    break;
 	}
+	for (n = 0; n < sh->qcount; n++) {
+	    msgs[n] = sh->queue[(sh->qhead + n) % SNMP_SHARD_QUEUE];
+	}
+	sh->qhead = (sh->qhead + n) % SNMP_SHARD_QUEUE;
+	sh->qcount = 0;
+	pthread_cond_signal(&sh->nonfull);
+	pthread_mutex_unlock(&sh->lock);
+
+	for (i = 0; i < n; i++) {
+	    sh->seq = msgs[i].seq;
+	    shards->func(sh, shards->out, msgs[i].pkt);
+	    snmp_pkt_delete(msgs[i].pkt);
+	}
+
+	pthread_mutex_lock(&sh->lock);
     }
+    pthread_mutex_unlock(&sh->lock);
+    return NULL;
+}
 
-    /* The current flow is on the top - don't bother any further... */
+/*
+ * Create the shards for an output. The number of shards is taken from
+ * the output; threads are only started if there is more than one.
+ */
 
-    if (i == 0) {
-	if (! open_flow_cache[0]) {
-	    open_flow_cache[0] = flow;
+static snmp_shards_t*
+snmp_shards_new(snmp_write_t *out, snmp_shard_func func)
+{
+    snmp_shards_t *shards;
+    snmp_shard_t *sh;
+    unsigned i;
+
+    shards = xmalloc(sizeof(snmp_shards_t));
+    shards->count = out->shards > 1 ? out->shards : 1;
+    shards->shard = xmalloc(shards->count * sizeof(snmp_shard_t));
+    shards->out = out;
+    shards->func = func;
+    pthread_mutex_init(&shards->out_lock, NULL);
+
+    for (i = 0; i < shards->count; i++) {
+	sh = &shards->shard[i];
+	sh->index = i;
+	sh->count = shards->count;
+	sh->shards = shards;
+	if (shards->count == 1) {
+	    continue;
 	}
+	sh->out_lock = &shards->out_lock;
+	pthread_mutex_init(&sh->lock, NULL);
+	pthread_cond_init(&sh->nonempty, NULL);
+	pthread_cond_init(&sh->nonfull, NULL);
+	if (pthread_create(&sh->thread, NULL, snmp_shard_main, sh)) {
+	    fprintf(stderr, "%s: creating shard thread failed\n", progname);
+	    exit(1);
+	}
+    }
+
+    return shards;
+}
+
+/*
+ * Pass a message to the shard responsible for its address pair. With
+ * a single shard, the message is processed right away. Otherwise, the
+ * shard keeps a reference until its thread is done with the message.
+ */
+
+static void
+snmp_shards_dispatch(snmp_shards_t *shards, snmp_packet_t *pkt)
+{
+    snmp_shard_t *sh;
+
+    if (shards->count == 1) {
+	shards->func(shards->shard, shards->out, pkt);
 	return;
     }
 
-    /* Flow not found in the cache, so close the last flow and assign
-       the new flow to it... */
-    
-    if (i == open_flow_cache_size) {
-	i--;
-	if (open_flow_cache[i]) {
-	    snmp_flow_close_stream(open_flow_cache[i]);
-	}
-	open_flow_cache[i] = flow;
+    sh = &shards->shard[snmp_shard_hash(pkt) % shards->count];
+    sh->inbox[sh->icount].pkt = snmp_pkt_ref(pkt);
+    sh->inbox[sh->icount++].seq = shards->seq++;
+    if (sh->icount == SNMP_SHARD_BATCH) {
+	snmp_shard_flush(sh);
     }
+}
+
+/*
+ * Wait until all shard threads have processed their messages and
+ * terminated.
+ */
 
-    /* Move the flow to the top... */
+static void
+snmp_shards_stop(snmp_shards_t *shards)
+{
+    snmp_shard_t *sh;
+    unsigned i;
 
-    tmp = open_flow_cache[i];
-    for (j = i; j > 0; j--) {
-	open_flow_cache[j] = open_flow_cache[j-1];
+    if (shards->count == 1) {
+	return;
+    }
+
+    for (i = 0; i < shards->count; i++) {
+	sh = &shards->shard[i];
+	snmp_shard_flush(sh);
+	pthread_mutex_lock(&sh->lock);
+	sh->shutdown = 1;
+	pthread_cond_signal(&sh->nonempty);
+	pthread_mutex_unlock(&sh->lock);
+    }
+    for (i = 0; i < shards->count; i++) {
+	sh = &shards->shard[i];
+	pthread_join(sh->thread, NULL);
+	pthread_cond_destroy(&sh->nonfull);
+	pthread_cond_destroy(&sh->nonempty);
+	pthread_mutex_destroy(&sh->lock);
     }
-    open_flow_cache[0] = tmp;
 }
 
 static void
-open_flow_cache_reset()
+snmp_shards_delete(snmp_shards_t *shards)
 {
-    if (open_flow_cache) {
-	free(open_flow_cache);
-	open_flow_cache = NULL;
-	open_flow_cache_size = 0;
-	cnt = 0;
-    }
+    pthread_mutex_destroy(&shards->out_lock);
+    free(shards->shard);
+    free(shards);
 }
 
 /*
  * Below are the flow interface functions as defined in snmp.h, namely
  * the initializing function, the per packet write functions, and the
- * finalizing function.
+ * finalizing function. The shards are created when the first message
+ * is written.
  */
 
 void
 snmp_flow_init(snmp_write_t *out)
 {
-    flow_id = 0;
+    out->state = NULL;
 }
 
-void
-snmp_flow_write(snmp_write_t *out, snmp_packet_t *pkt)
+/*
+ * Release flows which have been idle for too long. A later packet with
+ * the same key creates a new flow.
+ */
+
+static void
+snmp_flow_expire(snmp_shard_t *sh, snmp_write_t *out, uint32_t ts_sec)
 {
+    snmp_part_t *part;
     snmp_flow_t *flow;
 
-    open_flow_cache_update(pkt);
+    while ((part = idle_list_expired(&sh->idle_list, out, ts_sec))) {
+	flow = SNMP_PART_OWNER(part, snmp_flow_t);
+	flow_table_remove(&sh->flow_table, flow);
+	snmp_part_expire(sh, part, out);
+	free(flow);
+    }
+}
+
+static void
+snmp_flow_process(snmp_shard_t *sh, snmp_write_t *out, snmp_packet_t *pkt)
+{
+    snmp_flow_t *flow;
+
+    open_flow_cache_update(sh, out, pkt);
+    if (out->idle) {
+	snmp_flow_expire(sh, out, pkt->time_sec.value);
+    }
     
-    flow = snmp_flow_find(pkt);
-    if (flow && flow->name) {
-	if (! flow->stream) {
-	    flow->stream = snmp_flow_open_stream(flow, out,
-						 (flow->cnt == 0) ? "w" : "a");
-	}
-	if (flow->stream) {
-	    if (flow->cnt == 0 && out->write_new) {
-		out->write_new(flow->stream);
-	    }
-	    if (out->write_pkt) {
-		out->write_pkt(flow->stream, pkt);
-	    }
-	    flow->cnt++;
-	    if (pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_RESPONSE
-		&& pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_TRAP1
-		&& pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_TRAP2
-		&& pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_RESPONSE) {
-		snmp_cache_list = snmp_cache_add(snmp_cache_list, pkt);
-	    }
-	    open_flow_cache_add(flow);
-	    return;
+    flow = snmp_flow_find(sh, out, pkt);
+    if (flow && out->idle) {
+	idle_list_touch(&sh->idle_list, &flow->part, pkt->time_sec.value);
+    }
+    if (flow && snmp_part_write(sh, &flow->part, out, pkt)) {
+	if (pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_RESPONSE
+	    && pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_TRAP1
+	    && pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_TRAP2
+	    && pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_RESPONSE) {
+	    snmp_cache_add(&sh->cache, pkt);
 	}
+	return;
     }
 
     /*
@@ -1057,36 +2044,48 @@ snmp_flow_write(snmp_write_t *out, snmp_packet_t *pkt)
      * be coming? xxx
      */
 
-    if (out->stream && out->write_pkt) {
-	out->write_pkt(out->stream, pkt);
+    snmp_shard_write_unknown(sh, out, pkt);
+    snmp_cache_add(&sh->cache, pkt);
+}
+
+void
+snmp_flow_write(snmp_write_t *out, snmp_packet_t *pkt)
+{
+    if (! out->state) {
+	out->state = snmp_shards_new(out, snmp_flow_process);
     }
-    snmp_cache_list = snmp_cache_add(snmp_cache_list, pkt);
+    snmp_shards_dispatch(out->state, pkt);
 }
 
 void
 snmp_flow_done(snmp_write_t *out)
 {
-    snmp_flow_t *p, *q;
+    snmp_shards_t *shards = out->state;
+    snmp_shard_t *sh;
+    unsigned i;
+    size_t j;
 
-    for (p = flow_list; p; ) {
-	if (p->name) {
-	    if (! p->stream) {
-		p->stream = snmp_flow_open_stream(p, out, "a");
-	    }
-	    if (p->stream) {
-		if (out->write_end) {
-		    out->write_end(p->stream);
-		}
-		snmp_flow_close_stream(p);
+    if (! shards) {
+	return;
+    }
+    snmp_shards_stop(shards);
+
+    for (i = 0; i < shards->count; i++) {
+	sh = &shards->shard[i];
+	snmp_batch_flush(sh, out);
+	snmp_batch_delete(&sh->batch);
+	for (j = 0; j < sh->flow_table.size; j++) {
+	    if (sh->flow_table.slots[j].flow) {
+		snmp_part_done(&sh->flow_table.slots[j].flow->part, out);
+		free(sh->flow_table.slots[j].flow);
 	    }
-	    free(p->name);
 	}
-	q = p->next;
-	free(p);
-	p = q;
+	free(sh->flow_table.slots);
+	open_flow_cache_reset(sh);
     }
 
-    open_flow_cache_reset();
+    snmp_shards_delete(shards);
+    out->state = NULL;
 }
 
 /*
@@ -1098,41 +2097,59 @@ snmp_flow_done(snmp_write_t *out)
 void
 snmp_slice_init(snmp_write_t *out)
 {
-    slice_id = 0;
+    out->state = NULL;
 }
 
-void
-snmp_slice_write(snmp_write_t *out, snmp_packet_t *pkt)
+/*
+ * Release slices which have been idle for too long, including the
+ * packets kept for matching.
+ */
+
+static void
+snmp_slice_expire(snmp_shard_t *sh, snmp_write_t *out, uint32_t ts_sec)
 {
+    snmp_part_t *part;
     snmp_slice_t *slice;
 
-    open_flow_cache_update(pkt);
-
-    slice = snmp_slice_find(pkt);
-    if (slice && slice->name) {
-	if (! slice->stream) {
-	    slice->stream = snmp_slice_open_stream(slice, out,
-						   (slice->cnt == 0) ? "w" : "a");
+    while ((part = idle_list_expired(&sh->idle_list, out, ts_sec))) {
+	slice = SNMP_PART_OWNER(part, snmp_slice_t);
+	if (slice->prev) {
+	    slice->prev->next = slice->next;
+	} else {
+	    sh->slice_list = slice->next;
 	}
-	if (slice->stream) {
-	    if (slice->cnt == 0 && out->write_new) {
-		out->write_new(slice->stream);
-	    }
-	    if (out->write_pkt) {
-		out->write_pkt(slice->stream, pkt);
-	    }
-	    slice->cnt++;
-	    if (pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_RESPONSE
-		&& pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_TRAP1
-		&& pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_TRAP2
-		&& pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_RESPONSE) {
-		snmp_cache_list = snmp_cache_add(snmp_cache_list, pkt);
-	    }
-#if 0
-	    open_flow_cache_add(flow);
-#endif
-	    return;
+	if (slice->next) {
+	    slice->next->prev = slice->prev;
+	}
+	snmp_part_expire(sh, part, out);
+	snmp_pkt_delete(slice->pkt);
+	snmp_pkt_delete(slice->last_response);
+	free(slice);
+    }
+}
+
+static void
+snmp_slice_process(snmp_shard_t *sh, snmp_write_t *out, snmp_packet_t *pkt)
+{
+    snmp_slice_t *slice;
+
+    open_flow_cache_update(sh, out, pkt);
+    if (out->idle) {
+	snmp_slice_expire(sh, out, pkt->time_sec.value);
+    }
+
+    slice = snmp_slice_find(sh, pkt);
+    if (slice && out->idle) {
+	idle_list_touch(&sh->idle_list, &slice->part, pkt->time_sec.value);
+    }
+    if (slice && snmp_part_write(sh, &slice->part, out, pkt)) {
+	if (pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_RESPONSE
+	    && pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_TRAP1
+	    && pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_TRAP2
+	    && pkt->snmp.scoped_pdu.pdu.type != SNMP_PDU_RESPONSE) {
+	    snmp_cache_add(&sh->cache, pkt);
 	}
+	return;
     }
 
     /*
@@ -1140,35 +2157,115 @@ snmp_slice_write(snmp_write_t *out, snmp_packet_t *pkt)
      * be coming? xxx
      */
 
-    if (out->stream && out->write_pkt) {
-	out->write_pkt(out->stream, pkt);
+    snmp_shard_write_unknown(sh, out, pkt);
+    snmp_cache_add(&sh->cache, pkt);
+}
+
+void
+snmp_slice_write(snmp_write_t *out, snmp_packet_t *pkt)
+{
+    if (! out->state) {
+	out->state = snmp_shards_new(out, snmp_slice_process);
     }
-    snmp_cache_list = snmp_cache_add(snmp_cache_list, pkt);
+    snmp_shards_dispatch(out->state, pkt);
+}
+
+/*
+ * Number the slices of all shards in the order of the messages that
+ * created them and move their files from the temporary names to the
+ * names they would have been given without shards.
+ */
+
+static int
+snmp_slice_rec_cmp(const void *a, const void *b)
+{
+    const snmp_slice_rec_t *x = a, *y = b;
+
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void
+snmp_slice_rename(snmp_shards_t *shards, snmp_write_t *out)
+{
+    char from[MAX_FILENAME_SIZE], to[MAX_FILENAME_SIZE];
+    char name[SLICE_NAME_SIZE];
+    snmp_slice_rec_t *recs;
+    snmp_shard_t *sh;
+    char *end;
+    size_t i, n = 0;
+    unsigned j;
+
+    for (j = 0; j < shards->count; j++) {
+	n += shards->shard[j].slice_nrecs;
+    }
+    if (! n) {
+	return;
+    }
+    recs = xmalloc(n * sizeof(snmp_slice_rec_t));
+    for (j = 0, n = 0; j < shards->count; j++) {
+	sh = &shards->shard[j];
+	memcpy(recs + n, sh->slice_recs,
+	       sh->slice_nrecs * sizeof(snmp_slice_rec_t));
+	n += sh->slice_nrecs;
+	free(sh->slice_recs);
+	sh->slice_recs = NULL;
+	sh->slice_nrecs = sh->slice_recs_size = 0;
+    }
+    qsort(recs, n, sizeof(snmp_slice_rec_t), snmp_slice_rec_cmp);
+
+    for (i = 0; i < n; i++) {
+	if (! recs[i].name) {
+	    continue;
+	}
+	/* replace the shard local id and the shard index */
+	end = strrchr(recs[i].name, '-');
+	while (end > recs[i].name && end[-1] != '-') {
+	    end--;
+	}
+	snprintf(name, sizeof(name), "%.*s%u",
+		 (int) (end - recs[i].name), recs[i].name, (unsigned) i);
+	snmp_part_filename(recs[i].name, out, from);
+	snmp_part_filename(name, out, to);
+	if (rename(from, to) < 0) {
+	    fprintf(stderr, "%s: failed to rename slice file %s: %s\n",
+		    progname, from, strerror(errno));
+	}
+	free(recs[i].name);
+    }
+    free(recs);
 }
 
 void
 snmp_slice_done(snmp_write_t *out)
 {
+    snmp_shards_t *shards = out->state;
+    snmp_shard_t *sh;
     snmp_slice_t *p, *q;
+    unsigned i;
 
-    for (p = slice_list; p; ) {
-	if (p->name) {
-	    if (! p->stream) {
-		p->stream = snmp_slice_open_stream(p, out, "a");
-	    }
-	    if (p->stream) {
-		if (out->write_end) {
-		    out->write_end(p->stream);
-		}
-		snmp_slice_close_stream(p);
-	    }
-	    free(p->name);
+    if (! shards) {
+	return;
+    }
+    snmp_shards_stop(shards);
+
+    for (i = 0; i < shards->count; i++) {
+	sh = &shards->shard[i];
+	snmp_batch_flush(sh, out);
+	snmp_batch_delete(&sh->batch);
+	for (p = sh->slice_list; p; ) {
+	    snmp_part_done(&p->part, out);
 	    snmp_pkt_delete(p->pkt);
+	    snmp_pkt_delete(p->last_response);
+	    q = p->next;
+	    free(p);
+	    p = q;
 	}
-	q = p->next;
-	free(p);
-	p = q;
+	open_flow_cache_reset(sh);
+    }
+    if (shards->count > 1) {
+	snmp_slice_rename(shards, out);
     }
 
-    open_flow_cache_reset();
+    snmp_shards_delete(shards);
+    out->state = NULL;
 }
@@ -0,0 +1,190 @@
+/*
+ * fmt.c --
+ *
+ * Formatting of numbers, object identifiers, IPv4 addresses and time
+ * stamps for the writers. The functions write straight into a caller
+ * supplied buffer, which is usually space reserved in an output sink,
+ * and return the number of characters written. No terminating NUL is
+ * written. Decimal numbers are produced two digits at a time from a
+ * table of digit pairs.
+ *
+ * The output is the same as that of the printf() conversions used by
+ * the writers before.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+#include "snmp.h"
+
+#include <string.h>
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const uint64_t powers_of_10[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+/*
+ * Number of decimal digits of a value. The bit length gives a guess
+ * (log10(2) is about 1233/4096) which is at most one digit short.
+ * Setting the lowest bit does not change the number of digits but
+ * makes 0 count as one digit.
+ */
+
+static inline unsigned
+fmt_digits(uint64_t v)
+{
+    unsigned n;
+
+    v |= 1;
+    n = ((64 - __builtin_clzll(v)) * 1233) >> 12;
+    return n + (v >= powers_of_10[n]);
+}
+
+/*
+ * Fill the n characters before end with the digits of v, which must
+ * have exactly n digits.
+ */
+
+static inline void
+fmt_fill32(char *end, uint32_t v)
+{
+    unsigned i;
+
+    while (v >= 100) {
+	i = (v % 100) * 2;
+	v /= 100;
+	end -= 2;
+	memcpy(end, digit_pairs + i, 2);
+    }
+    if (v >= 10) {
+	memcpy(end - 2, digit_pairs + v * 2, 2);
+    } else {
+	end[-1] = '0' + v;
+    }
+}
+
+size_t
+snmp_fmt_uint32(char *buf, uint32_t v)
+{
+    unsigned n = fmt_digits(v);
+
+    fmt_fill32(buf + n, v);
+    return n;
+}
+
+size_t
+snmp_fmt_uint64(char *buf, uint64_t v)
+{
+    unsigned n = fmt_digits(v), i;
+    char *end = buf + n;
+
+    while (v > UINT32_MAX) {
+	i = (v % 100) * 2;
+	v /= 100;
+	end -= 2;
+	memcpy(end, digit_pairs + i, 2);
+    }
+    fmt_fill32(end, (uint32_t) v);
+    return n;
+}
+
+size_t
+snmp_fmt_int64(char *buf, int64_t v)
+{
+    if (v < 0) {
+	*buf = '-';
+	return 1 + snmp_fmt_uint64(buf + 1, - (uint64_t) v);
+    }
+    return snmp_fmt_uint64(buf, v);
+}
+
+/*
+ * Object identifiers in dotted notation. The buffer must provide
+ * SNMP_FMT_OID_SIZE(len) bytes.
+ */
+
+size_t
+snmp_fmt_oid(char *buf, const uint32_t *value, unsigned len)
+{
+    char *p = buf;
+    unsigned i;
+
+    for (i = 0; i < len; i++) {
+	if (i > 0) {
+	    *p++ = '.';
+	}
+	p += snmp_fmt_uint32(p, value[i]);
+    }
+    return p - buf;
+}
+
+/*
+ * IPv4 addresses in dotted quad notation, as inet_ntop() writes them.
+ * The address is in network byte order. The buffer must provide
+ * INET_ADDRSTRLEN bytes.
+ */
+
+size_t
+snmp_fmt_ipv4(char *buf, const void *addr)
+{
+    const u_char *a = addr;
+    char *p = buf;
+    unsigned i, v;
+
+    for (i = 0; i < 4; i++) {
+	v = a[i];
+	if (v >= 100) {
+	    *p++ = '0' + v / 100;
+	    memcpy(p, digit_pairs + (v % 100) * 2, 2);
+	    p += 2;
+	} else if (v >= 10) {
+	    memcpy(p, digit_pairs + v * 2, 2);
+	    p += 2;
+	} else {
+	    *p++ = '0' + v;
+	}
+	*p++ = '.';
+    }
+    return p - buf - 1;
+}
+
+/*
+ * Capture time stamps as seconds and six digits of microseconds, like
+ * "%u.%06u" would write them. The buffer must provide
+ * SNMP_FMT_TIME_SIZE bytes.
+ */
+
+size_t
+snmp_fmt_time(char *buf, uint32_t sec, uint32_t usec)
+{
+    char *p = buf;
+
+    p += snmp_fmt_uint32(p, sec);
+    *p++ = '.';
+    if (usec < 1000000) {
+	memcpy(p, digit_pairs + (usec / 10000) * 2, 2);
+	memcpy(p + 2, digit_pairs + (usec / 100 % 100) * 2, 2);
+	memcpy(p + 4, digit_pairs + (usec % 100) * 2, 2);
+	p += 6;
+    } else {
+	p += snmp_fmt_uint32(p, usec);
+    }
+    return p - buf;
+}
@@ -0,0 +1,377 @@
+/*
+ * frag.c --
+ *
+ * Reassembly of fragmented IPv4 and IPv6 datagrams. Datagrams under
+ * reassembly are kept in a hash table keyed by (src, dst, id, proto).
+ * The memory used by the table is bounded: entries time out if no
+ * fragment was received for some time and the least recently used
+ * entries are evicted if the memory limit would be exceeded.
+ *
+ * $Id$
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "snmp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAG_BUCKETS		1024
+#define FRAG_MAX_DATAGRAM	65535
+
+typedef struct {
+    u_int	start;
+    u_int	end;
+} frag_range_t;
+
+typedef struct _frag_entry {
+    struct _frag_entry *next;		/* hash bucket chain */
+    struct _frag_entry *lru_prev;	/* towards more recently used */
+    struct _frag_entry *lru_next;	/* towards less recently used */
+    int		family;
+    u_char	src[16];
+    u_char	dst[16];
+    uint32_t	id;
+    u_char	proto;
+    time_t	last;			/* time of the last fragment */
+    u_int	total;			/* datagram length, 0 if unknown */
+    u_char	*data;
+    size_t	size;
+    frag_range_t *ranges;		/* sorted, non-adjacent ranges */
+    u_int	nranges;
+    u_int	sranges;
+    size_t	mem;			/* memory accounted for this entry */
+} frag_entry_t;
+
+struct _snmp_frag_table {
+    frag_entry_t *buckets[FRAG_BUCKETS];
+    frag_entry_t *lru_head;		/* most recently used */
+    frag_entry_t *lru_tail;		/* least recently used */
+    size_t	memcap;
+    size_t	memused;
+    unsigned	timeout;
+    snmp_frag_stats_t stats;
+};
+
+static inline void*
+xmalloc(size_t size)
+{
+    void *p;
+
+    p = malloc(size);
+    if (! p) {
+	abort();
+    }
+    memset(p, 0, size);
+    return p;
+}
+
+static inline void*
+xrealloc(void *ptr, size_t size)
+{
+    void *p;
+
+    p = realloc(ptr, size);
+    if (! p) {
+	abort();
+    }
+    return p;
+}
+
+static unsigned
+frag_hash(int family, const u_char *src, const u_char *dst,
+	  uint32_t id, u_char proto)
+{
+    unsigned i, n = (family == 4) ? 4 : 16;
+    uint32_t h = 2166136261u;
+
+    for (i = 0; i < n; i++) {
+	h = (h ^ src[i]) * 16777619u;
+	h = (h ^ dst[i]) * 16777619u;
+    }
+    h = (h ^ id) * 16777619u;
+    h = (h ^ proto) * 16777619u;
+    return h % FRAG_BUCKETS;
+}
+
+static void
+lru_unlink(snmp_frag_table_t *t, frag_entry_t *e)
+{
+    if (e->lru_prev) {
+	e->lru_prev->lru_next = e->lru_next;
+    } else {
+	t->lru_head = e->lru_next;
+    }
+    if (e->lru_next) {
+	e->lru_next->lru_prev = e->lru_prev;
+    } else {
+	t->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void
+lru_push(snmp_frag_table_t *t, frag_entry_t *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = t->lru_head;
+    if (t->lru_head) {
+	t->lru_head->lru_prev = e;
+    } else {
+	t->lru_tail = e;
+    }
+    t->lru_head = e;
+}
+
+/*
+ * Remove an entry from the table and release its memory.
+ */
+
+static void
+entry_drop(snmp_frag_table_t *t, frag_entry_t *e)
+{
+    frag_entry_t **pp;
+
+    pp = &t->buckets[frag_hash(e->family, e->src, e->dst, e->id, e->proto)];
+    while (*pp != e) {
+	pp = &(*pp)->next;
+    }
+    *pp = e->next;
+    lru_unlink(t, e);
+
+    t->memused -= e->mem;
+    free(e->data);
+    free(e->ranges);
+    free(e);
+}
+
+/*
+ * Update the memory accounted for an entry after it has grown. The
+ * least recently used entries are evicted if we exceed the limit.
+ * Returns 0 if the entry itself had to be dropped.
+ */
+
+static int
+entry_account(snmp_frag_table_t *t, frag_entry_t *e)
+{
+    size_t mem;
+
+    mem = sizeof(frag_entry_t) + e->size
+	+ e->sranges * sizeof(frag_range_t);
+    t->memused += mem - e->mem;
+    e->mem = mem;
+
+    while (t->memused > t->memcap) {
+	frag_entry_t *victim = t->lru_tail;
+	int self = (victim == e);
+
+	t->stats.evicted++;
+	entry_drop(t, victim);
+	if (self) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * Record the range [start, end) as received. Returns 1 if the range
+ * overlaps data we already have.
+ */
+
+static int
+entry_range(frag_entry_t *e, u_int start, u_int end)
+{
+    u_int i, j;
+    int overlap = 0;
+
+    for (i = 0; i < e->nranges && e->ranges[i].end < start; i++) ;
+
+    for (j = i; j < e->nranges && e->ranges[j].start <= end; j++) {
+	if (e->ranges[j].start < end && e->ranges[j].end > start) {
+	    overlap = 1;
+	}
+	if (e->ranges[j].start < start) {
+	    start = e->ranges[j].start;
+	}
+	if (e->ranges[j].end > end) {
+	    end = e->ranges[j].end;
+	}
+    }
+
+    /* ranges i..j-1 are merged into the new range */
+
+    if (i == j) {
+	if (e->nranges == e->sranges) {
+	    e->sranges = e->sranges ? 2 * e->sranges : 4;
+	    e->ranges = xrealloc(e->ranges, e->sranges * sizeof(frag_range_t));
+	}
+	memmove(&e->ranges[i + 1], &e->ranges[i],
+		(e->nranges - i) * sizeof(frag_range_t));
+	e->nranges++;
+    } else if (j - i > 1) {
+	memmove(&e->ranges[i + 1], &e->ranges[j],
+		(e->nranges - j) * sizeof(frag_range_t));
+	e->nranges -= j - i - 1;
+    }
+    e->ranges[i].start = start;
+    e->ranges[i].end = end;
+
+    return overlap;
+}
+
+/*
+ * Drop all entries which did not receive a fragment within the
+ * timeout interval.
+ */
+
+static void
+frag_expire(snmp_frag_table_t *t, time_t now)
+{
+    while (t->lru_tail && t->lru_tail->last + t->timeout < now) {
+	t->stats.expired++;
+	entry_drop(t, t->lru_tail);
+    }
+}
+
+snmp_frag_table_t*
+snmp_frag_new(size_t memcap, unsigned timeout)
+{
+    snmp_frag_table_t *t;
+
+    t = xmalloc(sizeof(snmp_frag_table_t));
+    t->memcap = memcap;
+    t->timeout = timeout;
+    return t;
+}
+
+/*
+ * Add a fragment to the table. The offset is the byte offset of the
+ * fragment data within the datagram payload, more is set if more
+ * fragments follow. Once all fragments have been received, the
+ * reassembled payload is returned (and its length in dlen). The
+ * returned buffer must be released by the caller with free().
+ */
+
+u_char*
+snmp_frag_add(snmp_frag_table_t *t, int family,
+	      const u_char *src, const u_char *dst, uint32_t id, u_char proto,
+	      u_int offset, int more, const u_char *data, u_int len,
+	      time_t now, u_int *dlen)
+{
+    frag_entry_t *e;
+    unsigned h;
+    u_int alen = (family == 4) ? 4 : 16;
+    u_int end = offset + len;
+    u_char *buf;
+
+    assert(t && (family == 4 || family == 6));
+
+    t->stats.fragments++;
+    frag_expire(t, now);
+
+    if (end > FRAG_MAX_DATAGRAM || (more && len == 0)) {
+	t->stats.invalid++;
+	return NULL;
+    }
+
+    h = frag_hash(family, src, dst, id, proto);
+    for (e = t->buckets[h]; e; e = e->next) {
+	if (e->family == family && e->id == id && e->proto == proto
+	    && memcmp(e->src, src, alen) == 0
+	    && memcmp(e->dst, dst, alen) == 0) {
+	    break;
+	}
+    }
+
+    if (! e) {
+	e = xmalloc(sizeof(frag_entry_t));
+	e->family = family;
+	memcpy(e->src, src, alen);
+	memcpy(e->dst, dst, alen);
+	e->id = id;
+	e->proto = proto;
+	e->next = t->buckets[h];
+	t->buckets[h] = e;
+	lru_push(t, e);
+    } else {
+	lru_unlink(t, e);
+	lru_push(t, e);
+    }
+    e->last = now;
+
+    if (! more) {
+	if ((e->total && e->total != end)
+	    || (e->nranges && e->ranges[e->nranges - 1].end > end)) {
+	    t->stats.invalid++;
+	    entry_drop(t, e);
+	    return NULL;
+	}
+	e->total = end;
+    } else if (e->total && end > e->total) {
+	t->stats.invalid++;
+	entry_drop(t, e);
+	return NULL;
+    }
+
+    if (e->size < end) {
+	e->size = e->total ? e->total : end;
+	e->data = xrealloc(e->data, e->size);
+    }
+    memcpy(e->data + offset, data, len);
+
+    if (entry_range(e, offset, end)) {
+	t->stats.overlaps++;
+    }
+
+    if (! entry_account(t, e)) {
+	return NULL;
+    }
+
+    if (! e->total || e->nranges != 1
+	|| e->ranges[0].start != 0 || e->ranges[0].end != e->total) {
+	return NULL;
+    }
+
+    t->stats.completed++;
+    buf = e->data;
+    *dlen = e->total;
+    e->data = NULL;
+    e->size = 0;
+    entry_drop(t, e);
+    return buf;
+}
+
+/*
+ * Retrieve the counters. Datagrams still incomplete are reported as
+ * pending.
+ */
+
+void
+snmp_frag_stats(snmp_frag_table_t *t, snmp_frag_stats_t *stats)
+{
+    frag_entry_t *e;
+
+    assert(t && stats);
+
+    *stats = t->stats;
+    stats->pending = 0;
+    for (e = t->lru_head; e; e = e->lru_next) {
+	stats->pending++;
+    }
+}
+
+void
+snmp_frag_delete(snmp_frag_table_t *t)
+{
+    if (! t) {
+	return;
+    }
+    while (t->lru_head) {
+	entry_drop(t, t->lru_head);
+    }
+    free(t);
+}
@@ -0,0 +1,358 @@
+/*
+ * hex.c --
+ *
+ * Conversion of octet strings to and from their hexadecimal notation.
+ * Octet strings are written as pairs of lowercase hex digits; upper
+ * and lower case digits are accepted when reading. On x86, the bulk
+ * of a string is converted with SSE2 or AVX2 instructions, selected
+ * at runtime according to the capabilities of the CPU. The remainder
+ * and other architectures use the scalar code.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+#include "snmp.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HEX_X86
+#include <immintrin.h>
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+ * Values of the hex digits, -1 for all other characters.
+ */
+
+static const signed char hex_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/*
+ * The converters handle a prefix of the input and return the number
+ * of input bytes they consumed; the scalar code does the rest. The
+ * decoders stop early at invalid characters.
+ */
+
+typedef size_t (*hex_encode_func)(char *dst, const u_char *src, size_t len);
+typedef size_t (*hex_decode_func)(u_char *dst, const char *src, size_t len);
+
+static size_t
+hex_encode_scalar(char *dst, const u_char *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	dst[2*i] = hex_digits[src[i] >> 4];
+	dst[2*i+1] = hex_digits[src[i] & 0x0f];
+    }
+    return len;
+}
+
+static size_t
+hex_decode_scalar(u_char *dst, const char *src, size_t len)
+{
+    size_t i;
+    int hi, lo;
+
+    for (i = 0; i + 1 < len; i += 2) {
+	hi = hex_values[(u_char) src[i]];
+	lo = hex_values[(u_char) src[i+1]];
+	if (hi < 0 || lo < 0) {
+	    break;
+	}
+	dst[i/2] = (hi << 4) | lo;
+    }
+    return i;
+}
+
+#ifdef HEX_X86
+
+/*
+ * Nibbles to ASCII: '0' + n, plus 'a' - '0' - 10 if n is above 9.
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i
+hex_nibbles_sse2(__m128i n)
+{
+    __m128i gt9 = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+			_mm_and_si128(gt9, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+__attribute__((target("sse2")))
+static size_t
+hex_encode_sse2(char *dst, const u_char *src, size_t len)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i in, hi, lo;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	in = _mm_loadu_si128((const __m128i *) (src + i));
+	hi = hex_nibbles_sse2(_mm_and_si128(_mm_srli_epi16(in, 4), mask));
+	lo = hex_nibbles_sse2(_mm_and_si128(in, mask));
+	_mm_storeu_si128((__m128i *) (dst + 2*i), _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *) (dst + 2*i + 16),
+			 _mm_unpackhi_epi8(hi, lo));
+    }
+    return i;
+}
+
+/*
+ * ASCII to nibbles. Digits and letters are recognized with signed
+ * range checks; the mask of invalid characters is returned in bad.
+ * The values are returned in 16-bit lanes, the first character of
+ * each pair shifted into the high nibble.
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i
+hex_values_sse2(__m128i c, __m128i *bad)
+{
+    __m128i d, l, digit, alpha;
+
+    d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    digit = _mm_and_si128(_mm_cmpgt_epi8(d, _mm_set1_epi8(-1)),
+			  _mm_cmplt_epi8(d, _mm_set1_epi8(10)));
+    l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+		     _mm_set1_epi8('a'));
+    alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8(-1)),
+			  _mm_cmplt_epi8(l, _mm_set1_epi8(6)));
+    *bad = _mm_or_si128(*bad, _mm_andnot_si128(_mm_or_si128(digit, alpha),
+					       _mm_set1_epi8(-1)));
+    d = _mm_or_si128(_mm_and_si128(digit, d),
+		     _mm_and_si128(alpha,
+				   _mm_add_epi8(l, _mm_set1_epi8(10))));
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(d,
+						     _mm_set1_epi16(0xff)), 4),
+			_mm_srli_epi16(d, 8));
+}
+
+__attribute__((target("sse2")))
+static size_t
+hex_decode_sse2(u_char *dst, const char *src, size_t len)
+{
+    __m128i a, b, bad;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	bad = _mm_setzero_si128();
+	a = hex_values_sse2(_mm_loadu_si128((const __m128i *) (src + i)),
+			    &bad);
+	b = hex_values_sse2(_mm_loadu_si128((const __m128i *) (src + i + 16)),
+			    &bad);
+	if (_mm_movemask_epi8(bad)) {
+	    break;
+	}
+	_mm_storeu_si128((__m128i *) (dst + i/2), _mm_packus_epi16(a, b));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+hex_nibbles_avx2(__m256i n)
+{
+    __m256i gt9 = _mm256_cmpgt_epi8(n, _mm256_set1_epi8(9));
+
+    return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')),
+			   _mm256_and_si256(gt9,
+					    _mm256_set1_epi8('a' - '0' - 10)));
+}
+
+__attribute__((target("avx2")))
+static size_t
+hex_encode_avx2(char *dst, const u_char *src, size_t len)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i in, hi, lo, x, y;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	in = _mm256_loadu_si256((const __m256i *) (src + i));
+	hi = hex_nibbles_avx2(_mm256_and_si256(_mm256_srli_epi16(in, 4),
+					       mask));
+	lo = hex_nibbles_avx2(_mm256_and_si256(in, mask));
+	/* the unpack instructions work within 128-bit lanes */
+	x = _mm256_unpacklo_epi8(hi, lo);
+	y = _mm256_unpackhi_epi8(hi, lo);
+	_mm256_storeu_si256((__m256i *) (dst + 2*i),
+			    _mm256_permute2x128_si256(x, y, 0x20));
+	_mm256_storeu_si256((__m256i *) (dst + 2*i + 32),
+			    _mm256_permute2x128_si256(x, y, 0x31));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+hex_values_avx2(__m256i c, __m256i *bad)
+{
+    __m256i d, l, digit, alpha;
+
+    d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    digit = _mm256_and_si256(_mm256_cmpgt_epi8(d, _mm256_set1_epi8(-1)),
+			     _mm256_cmpgt_epi8(_mm256_set1_epi8(10), d));
+    l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)),
+			_mm256_set1_epi8('a'));
+    alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8(-1)),
+			     _mm256_cmpgt_epi8(_mm256_set1_epi8(6), l));
+    *bad = _mm256_or_si256(*bad,
+			   _mm256_andnot_si256(_mm256_or_si256(digit, alpha),
+					       _mm256_set1_epi8(-1)));
+    d = _mm256_or_si256(_mm256_and_si256(digit, d),
+			_mm256_and_si256(alpha,
+					 _mm256_add_epi8(l,
+							 _mm256_set1_epi8(10))));
+    return _mm256_or_si256(
+	_mm256_slli_epi16(_mm256_and_si256(d, _mm256_set1_epi16(0xff)), 4),
+	_mm256_srli_epi16(d, 8));
+}
+
+__attribute__((target("avx2")))
+static size_t
+hex_decode_avx2(u_char *dst, const char *src, size_t len)
+{
+    __m256i a, b, bad;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+	bad = _mm256_setzero_si256();
+	a = hex_values_avx2(_mm256_loadu_si256((const __m256i *) (src + i)),
+			    &bad);
+	b = hex_values_avx2(_mm256_loadu_si256((const __m256i *)
+					       (src + i + 32)), &bad);
+	if (_mm256_movemask_epi8(bad)) {
+	    break;
+	}
+	/* the pack instruction works within 128-bit lanes */
+	_mm256_storeu_si256((__m256i *) (dst + i/2),
+			    _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+						     0xd8));
+    }
+    return i;
+}
+
+#endif
+
+/*
+ * The converters are selected when they are first used. Threads may
+ * race to do so, but they all store the same result.
+ */
+
+static size_t hex_encode_init(char *dst, const u_char *src, size_t len);
+static size_t hex_decode_init(u_char *dst, const char *src, size_t len);
+
+static hex_encode_func hex_encode = hex_encode_init;
+static hex_decode_func hex_decode = hex_decode_init;
+
+static void
+hex_select(void)
+{
+    hex_encode_func encode = hex_encode_scalar;
+    hex_decode_func decode = hex_decode_scalar;
+
+#ifdef HEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	encode = hex_encode_avx2;
+	decode = hex_decode_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+	encode = hex_encode_sse2;
+	decode = hex_decode_sse2;
+    }
+#endif
+
+    __atomic_store_n(&hex_encode, encode, __ATOMIC_RELAXED);
+    __atomic_store_n(&hex_decode, decode, __ATOMIC_RELAXED);
+}
+
+static size_t
+hex_encode_init(char *dst, const u_char *src, size_t len)
+{
+    hex_select();
+    return __atomic_load_n(&hex_encode, __ATOMIC_RELAXED)(dst, src, len);
+}
+
+static size_t
+hex_decode_init(u_char *dst, const char *src, size_t len)
+{
+    hex_select();
+    return __atomic_load_n(&hex_decode, __ATOMIC_RELAXED)(dst, src, len);
+}
+
+/*
+ * Write the 2 * len hex digits of an octet string to dst, which is
+ * not NUL terminated.
+ */
+
+void
+snmp_hex_encode(char *dst, const u_char *src, size_t len)
+{
+    size_t n;
+
+    n = __atomic_load_n(&hex_encode, __ATOMIC_RELAXED)(dst, src, len);
+    hex_encode_scalar(dst + 2*n, src + n, len - n);
+}
+
+/*
+ * Convert len hex digits to len / 2 octets. Returns -1 if len is odd
+ * or if an invalid character is found.
+ */
+
+int
+snmp_hex_decode(u_char *dst, const char *src, size_t len)
+{
+    size_t n;
+
+    if (len % 2) {
+	return -1;
+    }
+    n = __atomic_load_n(&hex_decode, __ATOMIC_RELAXED)(dst, src, len);
+    n += hex_decode_scalar(dst + n/2, src + n, len - n);
+    return (n == len) ? 0 : -1;
+}
+
+/*
+ * Convert a NUL terminated string of hex digits into an octet string
+ * allocated from the arena. Empty strings, strings of odd length and
+ * strings with invalid characters yield NULL.
+ */
+
+u_char*
+snmp_hex_dup(snmp_arena_t *arena, const char *str, unsigned *len)
+{
+    size_t n = strlen(str);
+    u_char *buf;
+
+    if (n == 0 || n % 2) {
+	return NULL;
+    }
+    buf = snmp_arena_alloc(arena, n / 2);
+    if (snmp_hex_decode(buf, str, n) < 0) {
+	return NULL;
+    }
+    *len = n / 2;
+    return buf;
+}
@@ -63,44 +63,54 @@ int libnet_open_raw_sock() { return libnet_open_raw4(); }
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <regex.h>
+#include <netinet/in.h>
 
 #include <pcap.h>
 
-#include <nids.h>
+/*
+ * The decoder context holds everything that is needed while decoding
+ * a message. Each thread decoding messages must use its own context.
+ */
 
-/* libnids does not allow to pass user data - this is not thread safe */
-static snmp_callback user_callback = NULL;
-static void *user_data = NULL;
+struct _snmp_decoder {
+    snmp_callback callback;	/* called for every decoded message */
+    void	*user_data;	/* passed on to the callback */
+    int		truncated;	/* the message was not captured completely */
+    char	*hex;		/* buffer for hexify() */
+    size_t	hexsize;
+    char	print[1024];	/* buffer for asn1_print() */
+    snmp_packet_t *pkt;		/* packet handed to the callback */
+    struct _pcap_pool *pool;	/* worker threads decoding for us */
+    snmp_frag_table_t *frags;	/* IP fragments under reassembly */
+};
 
 /*
  * Convert octet string values into something useful.
  */
 
 static char*
-hexify(const int len, const u_char *str)
+hexify(snmp_decoder_t *ctx, const int len, const u_char *str)
 {
-	static size_t size = 0;
-	static char *buffer = NULL;
-	int i;
-
 	if (len < 0) {
 		return NULL;
 	}
 
-	if (size < 2*len+1) {
-		size = 2*len+1;
-		buffer = realloc(buffer, size);
-		if (! buffer) {
-			size = 0;
+	if (ctx->hexsize < 2*len+1) {
+		ctx->hexsize = 2*len+1;
+		ctx->hex = realloc(ctx->hex, ctx->hexsize);
+		if (! ctx->hex) {
+			ctx->hexsize = 0;
 			return NULL;
 		}
 	}
 	
-	for (i = 0; i < len; i++) {
-		snprintf(buffer+2*i, size-2*i, "%.2x", str[i]);
-	}
-	return buffer;
+	snmp_hex_encode(ctx->hex, str, len);
+	ctx->hex[2*len] = '\0';
+	return ctx->hex;
 }
 
 /*
@@ -333,9 +343,6 @@ const char *SnmpVersion[] = {
 };
 
 
-static int truncated;
-
-
 /*
  * constants for ASN.1 decoding
  */
@@ -358,8 +365,7 @@ static int truncated;
  * truncated==1 means the packet was complete, but we don't have all of
  * it to decode.
  */
-static int truncated;
-#define ifNotTruncated if (truncated) fputs("[|snmp]", stdout); else
+#define ifNotTruncated if (ctx->truncated) fputs("[|snmp]", stdout); else
 
 /*
  * This decodes the next ASN.1 object in the stream pointed to by "p"
@@ -370,7 +376,8 @@ static int truncated;
  * O/w, this returns the number of bytes parsed from "p".
  */
 static int
-asn1_parse(register const u_char *p, u_int len, struct be *elem)
+asn1_parse(snmp_decoder_t *ctx, register const u_char *p, u_int len,
+	   struct be *elem)
 {
 	u_char form, class, id;
 	int i, hdr;
@@ -433,7 +440,7 @@ asn1_parse(register const u_char *p, u_int len, struct be *elem)
 			elem->asnlen = (elem->asnlen << ASN_SHIFT8) | *p++;
 	}
 	if (len < elem->asnlen) {
-		if (!truncated) {
+		if (!ctx->truncated) {
 			fprintf(stderr, "[len%d<asnlen%u]\n",
 				len, elem->asnlen);
 			return -1;
@@ -630,9 +637,9 @@ asn1_parse(register const u_char *p, u_int len, struct be *elem)
  * BE form was added.
  */
 static const char*
-asn1_print(struct be *elem)
+asn1_print(snmp_decoder_t *ctx, struct be *elem)
 {
-	static char buffer[1024];
+	char *buffer = ctx->print;
 	char numbuf[20];
 	u_char *p = (u_char *)elem->data.raw;
 	uint32_t asnlen = elem->asnlen;
@@ -642,7 +649,7 @@ asn1_print(struct be *elem)
 	switch (elem->type) {
 
 	case BE_OCTET:
-		return hexify(asnlen, p);
+		return hexify(ctx, asnlen, p);
 
 	case BE_NULL:
 		return buffer;
@@ -664,7 +671,7 @@ asn1_print(struct be *elem)
 				first = 0;
 				s = o / OIDMUX;
 				if (s > 2) s = 2;
-				snprintf(buffer, sizeof(buffer), "%d", s);
+				snprintf(buffer, sizeof(ctx->print), "%d", s);
 				/* OBJ_PRINT(s, first); */
 				o -= s * OIDMUX;
 			}
@@ -700,7 +707,7 @@ asn1_print(struct be *elem)
 			printable = isprint(*p) || isspace(*p);
 		p = elem->data.str;
 		if (printable) {
-			snprintf(buffer, sizeof(buffer), "%.*s",
+			snprintf(buffer, sizeof(ctx->print), "%.*s",
 				 asnlen, elem->data.str);
 			return buffer;
 		} else
@@ -710,7 +717,7 @@ asn1_print(struct be *elem)
 			}
 
 #else
-		return hexify(asnlen, p);
+		return hexify(ctx, asnlen, p);
 #endif
 		break;
 	}
@@ -813,16 +820,24 @@ set_octs(snmp_octs_t *v, int count, struct be *elem)
  */
 
 static void
-set_oid(snmp_oid_t *v, int count, struct be *elem)
+set_oid(snmp_arena_t *arena, snmp_oid_t *v, int count, struct be *elem)
 {
-    uint32_t o = 0;
+    uint32_t o = 0, *value;
     int first = -1, i = elem->asnlen;
     u_char *p = (u_char *)elem->data.raw;
-    
-    v->value = malloc((1 + elem->asnlen) * sizeof(uint32_t));
-    if (! v->value) {
-	abort();
+    unsigned n = 1;
+
+    /*
+     * Every byte without bit 8 set ends a sub-identifier, and the
+     * first one ends two of them.
+     */
+    for (; i-- > 0; p++) {
+	n += ! (*p & ASN_LONGLEN);
     }
+    i = elem->asnlen;
+    p = (u_char *)elem->data.raw;
+    
+    value = snmp_oid_alloc(arena, v, n);
     v->len = 0;
 
     for (; i-- > 0; p++) {
@@ -838,10 +853,10 @@ set_oid(snmp_oid_t *v, int count, struct be *elem)
 	    first = 0;
 	    s = o / OIDMUX;
 	    if (s > 2) s = 2;
-	    v->value[v->len++] = s;
+	    value[v->len++] = s;
 	    o -= s * OIDMUX;
 	}
-	v->value[v->len++] = o;
+	value[v->len++] = o;
 	if (--first < 0) {
 	    first = 0;
 	}
@@ -873,14 +888,15 @@ set_ipaddr(snmp_ipaddr_t *v, int count, struct be *elem)
  */
 
 static void
-varbind_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
+varbind_print(snmp_decoder_t *ctx, u_char pduid, const u_char *np,
+	      u_int length, snmp_packet_t *pkt)
 {
 	struct be elem;
 	int count = 0, ind;
-	snmp_varbind_t **lvbp;
+	snmp_var_bindings_t *vbl = &pkt->snmp.scoped_pdu.pdu.varbindings;
 
 	/* Sequence of varBind */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_SEQ) {
 		fputs("[!SEQ of varbind]\n", stderr);
@@ -900,25 +916,19 @@ varbind_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
 	length = elem.asnlen;
 	np = (u_char *)elem.data.raw;
 
-	lvbp = &pkt->snmp.scoped_pdu.pdu.varbindings.varbind;
-
 	for (ind = 1; length > 0; ind++) {
 		const u_char *vbend;
 		u_int vblength;
 		snmp_varbind_t *vb;
 
-		vb = (snmp_varbind_t *) malloc(sizeof(snmp_varbind_t));
-		if (! vb) {
-			abort();
-		}
-		memset(vb, 0, sizeof(snmp_varbind_t));
+		vb = snmp_vbl_append(pkt->arena, vbl);
 
 		/* Sequence */
-		if ((count = asn1_parse(np, length, &elem)) < 0)
-			return;
+		if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
+			goto drop;
 		if (elem.type != BE_SEQ) {
 			fputs("[!varbind]\n", stderr);
-			return;
+			goto drop;
 		}
 
 		vb->attr.blen = count;
@@ -932,21 +942,21 @@ varbind_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
 		np = (u_char *)elem.data.raw;
 
 		/* objName (OID) */
-		if ((count = asn1_parse(np, length, &elem)) < 0)
-			return;
+		if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
+			goto drop;
 		if (elem.type != BE_OID) {
 			fputs("[objName!=OID]\n", stderr);
-			return;
+			goto drop;
 		}
 
-		set_oid(&vb->name, count, &elem);
+		set_oid(pkt->arena, &vb->name, count, &elem);
 
 		length -= count;
 		np += count;
 
 		/* objVal (ANY) */
-		if ((count = asn1_parse(np, length, &elem)) < 0)
-			return;
+		if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
+			goto drop;
 
 		switch (elem.type) {
 		case BE_NULL:
@@ -992,7 +1002,7 @@ varbind_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
 		case BE_OID:
 		    vb->type = SNMP_TYPE_OID;
 		    vb->attr.flags |= SNMP_FLAG_VALUE;
-		    set_oid(&vb->value.oid, count, &elem);
+		    set_oid(pkt->arena, &vb->value.oid, count, &elem);
 		    break;
 		case BE_OCTET:
 		    vb->type = SNMP_TYPE_OPAQUE;
@@ -1022,9 +1032,14 @@ varbind_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
 		length = vblength;
 		np = vbend;
 
-		*lvbp = vb;
-		lvbp = &vb->next;
 	}
+	snmp_vbl_sign(vbl);
+	return;
+
+ drop:
+	/* do not keep a partially decoded varbind */
+	vbl->count--;
+	snmp_vbl_sign(vbl);
 }
 
 /*
@@ -1033,13 +1048,14 @@ varbind_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
  */
 
 static void
-snmppdu_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
+snmppdu_print(snmp_decoder_t *ctx, u_char pduid, const u_char *np,
+	      u_int length, snmp_packet_t *pkt)
 {
 	struct be elem;
 	int count = 0;
 
 	/* reqId (Integer) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[reqId!=INT]\n", stderr);
@@ -1052,7 +1068,7 @@ snmppdu_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* errorStatus (Integer) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[errorStatus!=INT]\n", stderr);
@@ -1065,7 +1081,7 @@ snmppdu_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* errorIndex (Integer) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[errorIndex!=INT]\n", stderr);
@@ -1077,7 +1093,7 @@ snmppdu_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
 	length -= count;
 	np += count;
 
-	varbind_print(pduid, np, length, pkt);
+	varbind_print(ctx, pduid, np, length, pkt);
 	return;
 }
 
@@ -1086,26 +1102,27 @@ snmppdu_print(u_char pduid, const u_char *np, u_int length, snmp_packet_t *pkt)
  */
 
 static void
-trappdu_print(const u_char *np, u_int length, snmp_packet_t *pkt)
+trappdu_print(snmp_decoder_t *ctx, const u_char *np, u_int length,
+	      snmp_packet_t *pkt)
 {
 	struct be elem;
 	int count = 0;
 
 	/* enterprise (oid) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_OID) {
 		fputs("[enterprise!=OID]\n", stderr);
 		return;
 	}
 
-	set_oid(&pkt->snmp.scoped_pdu.pdu.enterprise, count, &elem);
+	set_oid(pkt->arena, &pkt->snmp.scoped_pdu.pdu.enterprise, count, &elem);
 
 	length -= count;
 	np += count;
 
 	/* agent-addr (inetaddr) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INETADDR) {
 		fputs("[agent-addr!=INETADDR]\n", stderr);
@@ -1118,7 +1135,7 @@ trappdu_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* generic-trap (Integer) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[generic-trap!=INT]\n", stderr);
@@ -1131,7 +1148,7 @@ trappdu_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* specific-trap (Integer) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[specific-trap!=INT]\n", stderr);
@@ -1144,7 +1161,7 @@ trappdu_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* time-stamp (TimeTicks) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_TIMETICKS) {
 		fputs("[time-stamp!=TIMETICKS]\n", stderr);
@@ -1156,7 +1173,7 @@ trappdu_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	length -= count;
 	np += count;
 
-	varbind_print(TRAP, np, length, pkt);
+	varbind_print(ctx, TRAP, np, length, pkt);
 	return;
 }
 
@@ -1165,13 +1182,14 @@ trappdu_print(const u_char *np, u_int length, snmp_packet_t *pkt)
  */
 
 static void
-pdu_print(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
+pdu_print(snmp_decoder_t *ctx, const u_char *np, u_int length, int version,
+	  snmp_packet_t *pkt)
 {
 	struct be pdu;
 	int count = 0;
 
 	/* PDU (Context) */
-	if ((count = asn1_parse(np, length, &pdu)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &pdu)) < 0)
 		return;
 	if (pdu.type != BE_PDU) {
 		fputs("[no PDU]\n", stderr);
@@ -1236,7 +1254,7 @@ pdu_print(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
 
 	switch (pdu.id) {
 	case TRAP:
-		trappdu_print(np, length, pkt);
+		trappdu_print(ctx, np, length, pkt);
 		break;
 	case GETREQ:
 	case GETNEXTREQ:
@@ -1246,7 +1264,7 @@ pdu_print(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
 	case INFORMREQ:
 	case V2TRAP:
 	case REPORT:
-		snmppdu_print(pdu.id, np, length, pkt);
+		snmppdu_print(ctx, pdu.id, np, length, pkt);
 		break;
 	}
 }
@@ -1256,13 +1274,14 @@ pdu_print(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
  */
 
 static void
-scopedpdu_print(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
+scopedpdu_print(snmp_decoder_t *ctx, const u_char *np, u_int length,
+		int version, snmp_packet_t *pkt)
 {
 	struct be elem;
 	int count = 0;
 
 	/* Sequence */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_SEQ) {
 		fputs("[!scoped PDU]\n", stderr);
@@ -1280,7 +1299,7 @@ scopedpdu_print(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
 	np = (u_char *)elem.data.raw;
 
 	/* contextEngineID (OCTET STRING) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_STR) {
 		fputs("[contextEngineID!=STR]\n", stderr);
@@ -1293,7 +1312,7 @@ scopedpdu_print(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
 	np += count;
 
 	/* contextName (OCTET STRING) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_STR) {
 		fputs("[contextName!=STR]\n", stderr);
@@ -1305,7 +1324,7 @@ scopedpdu_print(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
 	length -= count;
 	np += count;
 
-	pdu_print(np, length, version, pkt);
+	pdu_print(ctx, np, length, version, pkt);
 }
 
 /*
@@ -1314,13 +1333,14 @@ scopedpdu_print(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
  */
 
 static void
-v12msg_parse(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
+v12msg_parse(snmp_decoder_t *ctx, const u_char *np, u_int length, int version,
+	     snmp_packet_t *pkt)
 {
 	struct be elem;
 	int count = 0;
 
 	/* Community (String) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_STR) {
 		fputs("[comm!=STR]\n", stderr);
@@ -1332,7 +1352,7 @@ v12msg_parse(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
 	length -= count;
 	np += count;
 
-	pdu_print(np, length, version, pkt);
+	pdu_print(ctx, np, length, version, pkt);
 }
 
 /*
@@ -1341,13 +1361,14 @@ v12msg_parse(const u_char *np, u_int length, int version, snmp_packet_t *pkt)
  */
 
 static void
-usm_print(const u_char *np, u_int length, snmp_packet_t *pkt)
+usm_print(snmp_decoder_t *ctx, const u_char *np, u_int length,
+	  snmp_packet_t *pkt)
 {
         struct be elem;
 	int count = 0;
 
 	/* Sequence */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_SEQ) {
 		fputs("[!usm]\n", stderr);
@@ -1363,7 +1384,7 @@ usm_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np = (u_char *)elem.data.raw;
 
 	/* msgAuthoritativeEngineID (OCTET STRING) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_STR) {
 		fputs("[msgAuthoritativeEngineID!=STR]\n", stderr);
@@ -1376,7 +1397,7 @@ usm_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* msgAuthoritativeEngineBoots (INTEGER) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[msgAuthoritativeEngineBoots!=INT]\n", stderr);
@@ -1389,7 +1410,7 @@ usm_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* msgAuthoritativeEngineTime (INTEGER) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[msgAuthoritativeEngineTime!=INT]\n", stderr);
@@ -1402,7 +1423,7 @@ usm_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* msgUserName (OCTET STRING) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_STR) {
 		fputs("[msgUserName!=STR]\n", stderr);
@@ -1415,7 +1436,7 @@ usm_print(const u_char *np, u_int length, snmp_packet_t *pkt)
         np += count;
 
 	/* msgAuthenticationParameters (OCTET STRING) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_STR) {
 		fputs("[msgAuthenticationParameters!=STR]\n", stderr);
@@ -1428,7 +1449,7 @@ usm_print(const u_char *np, u_int length, snmp_packet_t *pkt)
         np += count;
 
 	/* msgPrivacyParameters (OCTET STRING) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_STR) {
 		fputs("[msgPrivacyParameters!=STR]\n", stderr);
@@ -1450,7 +1471,8 @@ usm_print(const u_char *np, u_int length, snmp_packet_t *pkt)
  */
 
 static void
-v3msg_print(const u_char *np, u_int length, snmp_packet_t *pkt)
+v3msg_print(snmp_decoder_t *ctx, const u_char *np, u_int length,
+	    snmp_packet_t *pkt)
 {
 	struct be elem;
 	int count = 0;
@@ -1460,11 +1482,11 @@ v3msg_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	int xlength = length;
 
 	/* Sequence */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_SEQ) {
 		fputs("[!message]", stderr);
-		asn1_print(&elem);
+		asn1_print(ctx, &elem);
 		return;
 	}
 
@@ -1477,7 +1499,7 @@ v3msg_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np = (u_char *)elem.data.raw;
 
 	/* msgID (INTEGER) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[msgID!=INT]\n", stderr);
@@ -1490,7 +1512,7 @@ v3msg_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* msgMaxSize (INTEGER) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[msgMaxSize!=INT]\n", stderr);
@@ -1503,7 +1525,7 @@ v3msg_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* msgFlags (OCTET STRING) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_STR) {
 		fputs("[msgFlags!=STR]\n", stderr);
@@ -1526,11 +1548,11 @@ v3msg_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np += count;
 
 	/* msgSecurityModel (INTEGER) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[msgSecurityModel!=INT]\n", stderr);
-		asn1_print(&elem);
+		asn1_print(ctx, &elem);
 		return;
 	}
 	
@@ -1551,40 +1573,42 @@ v3msg_print(const u_char *np, u_int length, snmp_packet_t *pkt)
 	/* xxx */
 
 	/* msgSecurityParameters (OCTET STRING) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_STR) {
 		fputs("[msgSecurityParameters!=STR]", stdout);
-		asn1_print(&elem);
+		asn1_print(ctx, &elem);
 		return;
 	}
 	length -= count;
 	np += count;
 
 	if (model == 3) {
-		usm_print(elem.data.str, elem.asnlen, pkt);
+		usm_print(ctx, elem.data.str, elem.asnlen, pkt);
 	}
 
-	scopedpdu_print(np, length, 3, pkt);
+	scopedpdu_print(ctx, np, length, 3, pkt);
 }
 
 /*
  * Decode the outer SNMP message header and pass on to message version
  * specific printing routines. Error messages are send to stderr and
- * further processing stops.
+ * further processing stops. All decoder state lives in the context,
+ * so this function can be called concurrently on different contexts.
  */
 
-static void
-snmp_parse(const u_char *np, u_int length, snmp_packet_t *pkt)
+void
+snmp_parse(snmp_decoder_t *ctx, const u_char *np, u_int length,
+	   snmp_packet_t *pkt)
 {
 	struct be elem;
 	int count = 0;
 	int version = 0;
 
-	truncated = 0;
+	ctx->truncated = 0;
 
 	/* initial Sequence */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_SEQ) {
 		fputs("[!init SEQ]\n", stderr);
@@ -1603,7 +1627,7 @@ snmp_parse(const u_char *np, u_int length, snmp_packet_t *pkt)
 	np = (u_char *)elem.data.raw;
 
 	/* Version (INTEGER) */
-	if ((count = asn1_parse(np, length, &elem)) < 0)
+	if ((count = asn1_parse(ctx, np, length, &elem)) < 0)
 		return;
 	if (elem.type != BE_INT) {
 		fputs("[version!=INT]\n", stderr);
@@ -1628,10 +1652,10 @@ snmp_parse(const u_char *np, u_int length, snmp_packet_t *pkt)
 	switch (version) {
 	case SNMP_VERSION_1:
         case SNMP_VERSION_2:
-		v12msg_parse(np, length, version, pkt);
+		v12msg_parse(ctx, np, length, version, pkt);
 		break;
 	case SNMP_VERSION_3:
-		v3msg_print(np, length, pkt);
+		v3msg_print(ctx, np, length, pkt);
 		break;
 	default:
 	        fprintf(stderr, "[version = %d]\n", elem.data.integer);
@@ -1640,191 +1664,1359 @@ snmp_parse(const u_char *np, u_int length, snmp_packet_t *pkt)
 }
 
 /*
- * Deallocate memory for a parsed SNMP packet.
+ * Create and destroy decoder contexts.
+ */
+
+snmp_decoder_t*
+snmp_decoder_new(snmp_callback func, void *user_data)
+{
+    snmp_decoder_t *ctx;
+
+    ctx = calloc(1, sizeof(snmp_decoder_t));
+    if (! ctx) {
+	abort();
+    }
+    ctx->callback = func;
+    ctx->user_data = user_data;
+    return ctx;
+}
+
+void
+snmp_decoder_delete(snmp_decoder_t *ctx)
+{
+    if (ctx) {
+	snmp_pkt_delete(ctx->pkt);
+	free(ctx->hex);
+	free(ctx);
+    }
+}
+
+/*
+ * Get a cleared packet for the next message, reusing pkt if the
+ * application did not keep it, and copy the time stamp, addresses and
+ * ports filled in by the caller from hdr. Octet strings of the decoded
+ * message will point into the input buffer.
+ */
+
+static snmp_packet_t*
+pkt_prepare(snmp_packet_t *pkt, const snmp_packet_t *hdr)
+{
+    pkt = snmp_pkt_recycle(pkt);
+    pkt->time_sec = hdr->time_sec;
+    pkt->time_usec = hdr->time_usec;
+    pkt->src_addr = hdr->src_addr;
+    pkt->src_addr6 = hdr->src_addr6;
+    pkt->src_port = hdr->src_port;
+    pkt->dst_addr = hdr->dst_addr;
+    pkt->dst_addr6 = hdr->dst_addr6;
+    pkt->dst_port = hdr->dst_port;
+    pkt->attr.flags |= hdr->attr.flags | SNMP_FLAG_BORROWED;
+    return pkt;
+}
+
+/*
+ * Parallel decoding. The reading thread collects UDP payloads into
+ * batches and a pool of worker threads runs the BER decoder on them.
+ * Decoded batches are handed to the callback by the reading thread in
+ * capture order, so the callback sees exactly the same sequence of
+ * packets as without worker threads.
+ */
+
+#define PCAP_BATCH_PKTS		256
+#define PCAP_BATCH_DATA		(PCAP_BATCH_PKTS * 512)
+
+typedef struct _pcap_batch {
+    struct _pcap_batch *next;	/* next batch in capture order */
+    struct _pcap_batch *qnext;	/* next batch waiting for a worker */
+    int		done;		/* set once a worker decoded the batch */
+    u_int	cnt;
+    snmp_packet_t *pkt[PCAP_BATCH_PKTS];
+    size_t	off[PCAP_BATCH_PKTS];
+    u_int	len[PCAP_BATCH_PKTS];
+    u_char	*data;		/* copies of the UDP payloads */
+    size_t	size;
+    size_t	used;
+} pcap_batch_t;
+
+typedef struct _pcap_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;	/* signalled when a batch is queued */
+    pthread_cond_t done;	/* signalled when a batch is decoded */
+    pthread_t	*threads;
+    int		nthreads;
+    int		shutdown;
+    int		inflight;	/* batches queued or being decoded */
+    pcap_batch_t *head, *tail;	/* batches in capture order */
+    pcap_batch_t *qhead, *qtail;	/* batches waiting for a worker */
+    pcap_batch_t *cur;		/* batch currently being filled */
+    pcap_batch_t *idle;		/* batches ready for reuse */
+} pcap_pool_t;
+
+static int pcap_threads = 0;
+
+/*
+ * Set the number of decoder threads used by the pcap input functions.
+ * Zero (the default) decodes in the reading thread.
+ */
+
+void
+snmp_pcap_set_threads(int n)
+{
+    pcap_threads = (n > 0) ? n : 0;
+}
+
+static void*
+pool_worker(void *arg)
+{
+    pcap_pool_t *pool = (pcap_pool_t *) arg;
+    snmp_decoder_t *ctx;
+    pcap_batch_t *b;
+    u_int i;
+
+    ctx = snmp_decoder_new(NULL, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+	while (! pool->qhead && ! pool->shutdown) {
+	    pthread_cond_wait(&pool->work, &pool->lock);
+	}
+	if (! pool->qhead) {
+	    break;
+	}
+	b = pool->qhead;
+	pool->qhead = b->qnext;
+	if (! pool->qhead) {
+	    pool->qtail = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < b->cnt; i++) {
+	    snmp_parse(ctx, b->data + b->off[i], b->len[i], b->pkt[i]);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	b->done = 1;
+	pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    snmp_decoder_delete(ctx);
+    return NULL;
+}
+
+/*
+ * Deliver decoded batches in capture order until at most max batches
+ * are still in flight. This blocks if the oldest batch is not decoded
+ * yet and more than max batches are in flight.
  */
 
 static void
-snmp_free(snmp_packet_t *pkt)
+pool_deliver(snmp_decoder_t *ctx, int max)
 {
-    snmp_varbind_t *varbind, *last_varbind;
+    pcap_pool_t *pool = ctx->pool;
+    pcap_batch_t *b;
+    u_int i;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head && (pool->head->done || pool->inflight > max)) {
+	while (! pool->head->done) {
+	    pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	b = pool->head;
+	pool->head = b->next;
+	if (! pool->head) {
+	    pool->tail = NULL;
+	}
+	pool->inflight--;
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < b->cnt; i++) {
+	    if (ctx->callback) {
+		ctx->callback(b->pkt[i], ctx->user_data);
+	    }
+	}
+	b->cnt = 0;
+	b->used = 0;
+	b->done = 0;
+	b->qnext = NULL;
+	b->next = pool->idle;
+	pool->idle = b;
+
+	pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Queue the batch currently being filled for decoding.
+ */
+
+static void
+pool_flush(snmp_decoder_t *ctx)
+{
+    pcap_pool_t *pool = ctx->pool;
+    pcap_batch_t *b = pool->cur;
 
-    varbind = pkt->snmp.scoped_pdu.pdu.varbindings.varbind;
+    if (! b || ! b->cnt) {
+	return;
+    }
+    pool->cur = NULL;
 
-    while (varbind) {
-	if (varbind->name.value) {
-	    free(varbind->name.value);
+    pthread_mutex_lock(&pool->lock);
+    b->next = NULL;
+    if (pool->tail) {
+	pool->tail->next = b;
+    } else {
+	pool->head = b;
+    }
+    pool->tail = b;
+    if (pool->qtail) {
+	pool->qtail->qnext = b;
+    } else {
+	pool->qhead = b;
+    }
+    pool->qtail = b;
+    pool->inflight++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_deliver(ctx, 2 * pool->nthreads);
+}
+
+/*
+ * Add a UDP payload to the current batch. The payload is copied since
+ * the caller's buffer will be reused before the batch is decoded.
+ */
+
+static void
+pool_submit(snmp_decoder_t *ctx, const u_char *buf, u_int len,
+	    snmp_packet_t *pkt)
+{
+    pcap_pool_t *pool = ctx->pool;
+    pcap_batch_t *b = pool->cur;
+
+    if (b && (b->cnt == PCAP_BATCH_PKTS || b->used + len > b->size)) {
+	pool_flush(ctx);
+	b = NULL;
+    }
+
+    if (! b) {
+	b = pool->idle;
+	if (b) {
+	    pool->idle = b->next;
+	    b->next = NULL;
+	} else {
+	    b = calloc(1, sizeof(pcap_batch_t));
+	    if (! b) {
+		abort();
+	    }
+	}
+	if (b->size < len || ! b->data) {
+	    b->size = (len > PCAP_BATCH_DATA) ? len : PCAP_BATCH_DATA;
+	    b->data = realloc(b->data, b->size);
+	    if (! b->data) {
+		abort();
+	    }
 	}
-	if (varbind->type == SNMP_TYPE_OID && varbind->value.oid.value) {
-	    free(varbind->value.oid.value);
+	pool->cur = b;
+    }
+
+    memcpy(b->data + b->used, buf, len);
+    b->off[b->cnt] = b->used;
+    b->len[b->cnt] = len;
+    b->pkt[b->cnt] = pkt_prepare(b->pkt[b->cnt], pkt);
+    b->used += len;
+    b->cnt++;
+}
+
+static void
+pool_start(snmp_decoder_t *ctx)
+{
+    pcap_pool_t *pool;
+    int i;
+
+    if (! pcap_threads) {
+	return;
+    }
+
+    pool = calloc(1, sizeof(pcap_pool_t));
+    if (! pool) {
+	abort();
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->nthreads = pcap_threads;
+    pool->threads = calloc(pool->nthreads, sizeof(pthread_t));
+    if (! pool->threads) {
+	abort();
+    }
+    for (i = 0; i < pool->nthreads; i++) {
+	if (pthread_create(&pool->threads[i], NULL, pool_worker, pool)) {
+	    fprintf(stderr, "%s: creating decoder thread failed\n", progname);
+	    exit(1);
 	}
-	last_varbind = varbind;
-	varbind = varbind->next;
-	free(last_varbind);
     }
+    ctx->pool = pool;
 }
 
 /*
- * Callback invoked by libnids for every UDP datagram that we have
- * received. Note that the datagram might have been reassembled from
- * multiple IP packets. The time information belongs to the last
- * fragment we have received.
+ * Decode and deliver everything still pending and stop the workers.
  */
 
 static void
-udp_callback(struct tuple4 * addr, char * buf, int len, void *ignore)
+pool_stop(snmp_decoder_t *ctx)
 {
-    snmp_packet_t _pkt, *pkt = &_pkt;
+    pcap_pool_t *pool = ctx->pool;
+    pcap_batch_t *b;
+    int i;
 
-    memset(pkt, 0, sizeof(snmp_packet_t));
-    
-    pkt->time_sec.value = nids_last_pcap_header->ts.tv_sec;
+    if (! pool) {
+	return;
+    }
+
+    pool_flush(ctx);
+    pool_deliver(ctx, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++) {
+	pthread_join(pool->threads[i], NULL);
+    }
+
+    while (pool->idle) {
+	b = pool->idle;
+	pool->idle = b->next;
+	for (i = 0; i < PCAP_BATCH_PKTS; i++) {
+	    snmp_pkt_delete(b->pkt[i]);
+	}
+	free(b->data);
+	free(b);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+    ctx->pool = NULL;
+}
+
+/*
+ * Deliver a UDP payload to the SNMP decoder and the user callback.
+ * The caller has already filled in the addresses and ports, we add
+ * the time stamp and take care of the cleanup. If we have decoder
+ * threads, the payload is queued for them instead.
+ */
+
+static void
+udp_deliver(snmp_decoder_t *ctx, const struct timeval *ts,
+	    const u_char *buf, u_int len, snmp_packet_t *pkt)
+{
+    pkt->time_sec.value = ts->tv_sec;
     pkt->time_sec.attr.flags |= SNMP_FLAG_VALUE;
-    pkt->time_usec.value = nids_last_pcap_header->ts.tv_usec;
+    pkt->time_usec.value = ts->tv_usec;
     pkt->time_usec.attr.flags |= SNMP_FLAG_VALUE;
 
-    pkt->src_addr.value = addr->saddr;
-    pkt->src_addr.attr.flags |= SNMP_FLAG_VALUE;
-    pkt->src_port.value = addr->source;
+    pkt->attr.flags |= SNMP_FLAG_VALUE;
+
+    if (ctx->pool) {
+	pool_submit(ctx, buf, len, pkt);
+	return;
+    }
+
+    pkt = ctx->pkt = pkt_prepare(ctx->pkt, pkt);
+    snmp_parse(ctx, buf, len, pkt);
+
+    if (ctx->callback) {
+	ctx->callback(pkt, ctx->user_data);
+    }
+}
+
+/*
+ * Decoder for the link, network and transport layer headers. UDP
+ * datagrams are decoded directly from the raw pcap records. IP
+ * fragments are collected in the fragment table (see frag.c) until
+ * the datagram is complete.
+ */
+
+#define EXTRACT_16BITS(p) \
+	((uint16_t)(((const u_char *)(p))[0] << 8 | ((const u_char *)(p))[1]))
+
+#ifndef ETHERTYPE_IP
+#define ETHERTYPE_IP		0x0800
+#endif
+#ifndef ETHERTYPE_IPV6
+#define ETHERTYPE_IPV6		0x86dd
+#endif
+#ifndef ETHERTYPE_VLAN
+#define ETHERTYPE_VLAN		0x8100
+#endif
+#define ETHERTYPE_QINQ		0x88a8
+#define ETHERTYPE_QINQ_OLD	0x9100
+
+#define EXTRACT_LE_16BITS(p) \
+	((uint16_t)(((const u_char *)(p))[1] << 8 | ((const u_char *)(p))[0]))
+
+#define PPP_IP			0x0021
+#define PPP_IPV6		0x0057
+
+#define SLIP_HDRLEN		16	/* pseudo header written by libpcap */
+#define PRISM_HDRLEN		144
+
+#define FRAG_MEMCAP		(16 * 1024 * 1024)
+#define FRAG_TIMEOUT		30
+
+static size_t frag_memcap = FRAG_MEMCAP;
+static unsigned frag_timeout = FRAG_TIMEOUT;
+
+/*
+ * Set the memory limit (in bytes) and the timeout (in seconds) for
+ * datagrams under reassembly.
+ */
+
+void
+snmp_pcap_set_frag_memcap(size_t memcap)
+{
+    frag_memcap = memcap;
+}
+
+void
+snmp_pcap_set_frag_timeout(unsigned timeout)
+{
+    frag_timeout = timeout;
+}
+
+/*
+ * Test whether we know how to decode the given pcap link type.
+ */
+
+static int
+link_supported(int linktype)
+{
+    switch (linktype) {
+    case DLT_EN10MB:
+    case DLT_LINUX_SLL:
+    case DLT_NULL:
+    case DLT_LOOP:
+    case DLT_RAW:
+    case DLT_SLIP:
+    case DLT_PPP:
+    case DLT_PPP_SERIAL:
+    case DLT_C_HDLC:
+    case DLT_FDDI:
+    case DLT_IEEE802:
+    case DLT_IEEE802_11:
+    case DLT_PRISM_HEADER:
+    case DLT_IEEE802_11_RADIO:
+#ifdef DLT_IPV4
+    case DLT_IPV4:
+#endif
+#ifdef DLT_IPV6
+    case DLT_IPV6:
+#endif
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Strip an 802.2 LLC header with a SNAP header carrying an ethertype,
+ * as used by FDDI, token ring and 802.11.
+ */
+
+static const u_char*
+llc_decode(const u_char *p, u_int *len, uint16_t *type)
+{
+    if (*len < 8 || p[0] != 0xaa || p[1] != 0xaa || p[2] != 0x03) {
+	return NULL;
+    }
+    *type = EXTRACT_16BITS(p + 6);
+    *len -= 8;
+    return p + 8;
+}
+
+/*
+ * Strip an 802.11 header. Only unprotected data frames can carry IP.
+ */
+
+static const u_char*
+wlan_decode(const u_char *p, u_int *len, uint16_t *type)
+{
+    u_int hlen = 24;
+
+    if (*len < hlen || (p[0] & 0x0c) != 0x08 || (p[1] & 0x40)) {
+	return NULL;
+    }
+    if ((p[1] & 0x03) == 0x03) {
+	hlen += 6;			/* from and to distribution system */
+    }
+    if (p[0] & 0x80) {
+	hlen += 2;			/* QoS control */
+	if (p[1] & 0x80) {
+	    hlen += 4;			/* HT control */
+	}
+    }
+    if (*len < hlen) {
+	return NULL;
+    }
+    *len -= hlen;
+    return llc_decode(p + hlen, len, type);
+}
+
+/*
+ * Strip the link layer header. Returns a pointer to the network layer
+ * header and sets the ethertype of the network layer protocol, or
+ * NULL if this is not an IPv4 or IPv6 packet.
+ */
+
+static const u_char*
+link_decode(int linktype, const u_char *p, u_int *len, uint16_t *type)
+{
+    switch (linktype) {
+    case DLT_EN10MB:
+	if (*len < 14) {
+	    return NULL;
+	}
+	*type = EXTRACT_16BITS(p + 12);
+	p += 14, *len -= 14;
+	while (*type == ETHERTYPE_VLAN
+	       || *type == ETHERTYPE_QINQ || *type == ETHERTYPE_QINQ_OLD) {
+	    if (*len < 4) {
+		return NULL;
+	    }
+	    *type = EXTRACT_16BITS(p + 2);
+	    p += 4, *len -= 4;
+	}
+	break;
+    case DLT_LINUX_SLL:
+	if (*len < 16) {
+	    return NULL;
+	}
+	*type = EXTRACT_16BITS(p + 14);
+	p += 16, *len -= 16;
+	break;
+    case DLT_PPP:
+    case DLT_PPP_SERIAL:
+	if (*len >= 2 && p[0] == 0xff && p[1] == 0x03) {
+	    p += 2, *len -= 2;		/* HDLC address and control */
+	}
+	if (*len >= 1 && (p[0] & 0x01)) {
+	    *type = p[0];		/* compressed protocol field */
+	    p += 1, *len -= 1;
+	} else if (*len >= 2) {
+	    *type = EXTRACT_16BITS(p);
+	    p += 2, *len -= 2;
+	} else {
+	    return NULL;
+	}
+	if (*type == PPP_IP) {
+	    *type = ETHERTYPE_IP;
+	} else if (*type == PPP_IPV6) {
+	    *type = ETHERTYPE_IPV6;
+	}
+	break;
+    case DLT_C_HDLC:
+	if (*len < 4) {
+	    return NULL;
+	}
+	*type = EXTRACT_16BITS(p + 2);
+	p += 4, *len -= 4;
+	break;
+    case DLT_FDDI:
+	if (*len < 13) {
+	    return NULL;
+	}
+	*len -= 13;
+	p = llc_decode(p + 13, len, type);
+	break;
+    case DLT_IEEE802:
+	if (*len < 14) {
+	    return NULL;
+	}
+	if (p[8] & 0x80) {
+	    /* source routed: the routing information follows */
+	    if (*len < 15 || *len < 14u + (p[14] & 0x1f)) {
+		return NULL;
+	    }
+	    *len -= p[14] & 0x1f;
+	    p += p[14] & 0x1f;
+	}
+	*len -= 14;
+	p = llc_decode(p + 14, len, type);
+	break;
+    case DLT_IEEE802_11:
+	p = wlan_decode(p, len, type);
+	break;
+    case DLT_PRISM_HEADER:
+	if (*len < PRISM_HDRLEN) {
+	    return NULL;
+	}
+	*len -= PRISM_HDRLEN;
+	p = wlan_decode(p + PRISM_HDRLEN, len, type);
+	break;
+    case DLT_IEEE802_11_RADIO:
+	if (*len < 4 || *len < EXTRACT_LE_16BITS(p + 2)) {
+	    return NULL;
+	}
+	*len -= EXTRACT_LE_16BITS(p + 2);
+	p = wlan_decode(p + EXTRACT_LE_16BITS(p + 2), len, type);
+	break;
+    case DLT_SLIP:
+	if (*len < SLIP_HDRLEN) {
+	    return NULL;
+	}
+	p += SLIP_HDRLEN, *len -= SLIP_HDRLEN;
+	goto ip;
+    case DLT_NULL:
+    case DLT_LOOP:
+	/* the address family is in host byte order of the capturing
+	   machine, so we simply look at the IP version instead */
+	if (*len < 4) {
+	    return NULL;
+	}
+	p += 4, *len -= 4;
+	/* fall through */
+    default:
+    ip:
+	if (*len < 1) {
+	    return NULL;
+	}
+	switch (p[0] >> 4) {
+	case 4:
+	    *type = ETHERTYPE_IP;
+	    break;
+	case 6:
+	    *type = ETHERTYPE_IPV6;
+	    break;
+	default:
+	    return NULL;
+	}
+	break;
+    }
+
+    if (! p || (*type != ETHERTYPE_IP && *type != ETHERTYPE_IPV6)) {
+	return NULL;
+    }
+    return p;
+}
+
+/*
+ * Decode the UDP header and deliver the payload. Datagrams that were
+ * not completely captured are silently ignored.
+ */
+
+static void
+udp_decode(snmp_decoder_t *ctx, const struct pcap_pkthdr *h,
+	   const u_char *p, u_int len, snmp_packet_t *pkt)
+{
+    u_int ulen;
+
+    if (len < 8) {
+	return;
+    }
+    ulen = EXTRACT_16BITS(p + 4);
+    if (ulen < 8 || ulen > len) {
+	return;
+    }
+
+    pkt->src_port.value = EXTRACT_16BITS(p);
     pkt->src_port.attr.flags |= SNMP_FLAG_VALUE;
- 
-    pkt->dst_addr.value = addr->daddr;
-    pkt->dst_addr.attr.flags |= SNMP_FLAG_VALUE;
-    pkt->dst_port.value = addr->dest;
+    pkt->dst_port.value = EXTRACT_16BITS(p + 2);
     pkt->dst_port.attr.flags |= SNMP_FLAG_VALUE;
 
-    pkt->attr.flags |= SNMP_FLAG_VALUE;
+    udp_deliver(ctx, &h->ts, p + 8, ulen - 8, pkt);
+}
+
+/*
+ * Add a fragment of a UDP datagram to the fragment table and decode
+ * the datagram once it is complete. The time stamp of the datagram is
+ * the time stamp of the last fragment received.
+ */
+
+static void
+frag_decode(snmp_decoder_t *ctx, const struct pcap_pkthdr *h, int family,
+	    const u_char *src, const u_char *dst, uint32_t id,
+	    u_int offset, int more, const u_char *p, u_int len,
+	    snmp_packet_t *pkt)
+{
+    u_char *buf;
+    u_int dlen = 0;
+
+    buf = snmp_frag_add(ctx->frags, family, src, dst, id, IPPROTO_UDP,
+			offset, more, p, len, h->ts.tv_sec, &dlen);
+    if (buf) {
+	udp_decode(ctx, h, buf, dlen, pkt);
+	free(buf);
+    }
+}
+
+/*
+ * Decode an IPv4 header.
+ */
+
+static void
+ipv4_decode(snmp_decoder_t *ctx, const struct pcap_pkthdr *h,
+	    const u_char *p, u_int len)
+{
+    snmp_packet_t _pkt, *pkt = &_pkt;
+    u_int hlen, tlen, off;
 
-    snmp_parse((unsigned char *) buf, len, pkt);
+    if (len < 20 || (p[0] >> 4) != 4) {
+	return;
+    }
+    hlen = (p[0] & 0x0f) * 4;
+    tlen = EXTRACT_16BITS(p + 2);
+    if (hlen < 20 || tlen < hlen || tlen > len) {
+	return;
+    }
+    if (p[9] != IPPROTO_UDP) {
+	return;
+    }
+
+    memset(pkt, 0, sizeof(snmp_packet_t));
+    memcpy(&pkt->src_addr.value, p + 12, 4);
+    pkt->src_addr.attr.flags |= SNMP_FLAG_VALUE;
+    memcpy(&pkt->dst_addr.value, p + 16, 4);
+    pkt->dst_addr.attr.flags |= SNMP_FLAG_VALUE;
 
-    if (user_callback) {
-	user_callback(pkt, user_data);
+    off = EXTRACT_16BITS(p + 6);
+    if (off & 0x3fff) {			/* MF flag or offset */
+	frag_decode(ctx, h, 4, p + 12, p + 16, EXTRACT_16BITS(p + 4),
+		    (off & 0x1fff) * 8, off & 0x2000,
+		    p + hlen, tlen - hlen, pkt);
+	return;
     }
 
-    snmp_free(pkt);
+    udp_decode(ctx, h, p + hlen, tlen - hlen, pkt);
+}
+
+/*
+ * Decode an IPv6 header and skip over the extension headers which
+ * may preceed the UDP header.
+ */
+
+static void
+ipv6_decode(snmp_decoder_t *ctx, const struct pcap_pkthdr *h,
+	    const u_char *p, u_int len)
+{
+    snmp_packet_t _pkt, *pkt = &_pkt;
+    const u_char *q;
+    u_int plen, xlen, off;
+    uint32_t id;
+    u_char nxt;
+
+    if (len < 40 || (p[0] >> 4) != 6) {
+	return;
+    }
+    plen = EXTRACT_16BITS(p + 4);
+    if (40 + plen > len) {
+	return;
+    }
+
+    memset(pkt, 0, sizeof(snmp_packet_t));
+    memcpy(&pkt->src_addr6.value, p + 8, 16);
+    pkt->src_addr6.attr.flags |= SNMP_FLAG_VALUE;
+    memcpy(&pkt->dst_addr6.value, p + 24, 16);
+    pkt->dst_addr6.attr.flags |= SNMP_FLAG_VALUE;
+
+    nxt = p[6];
+    q = p + 40;
+    while (nxt != IPPROTO_UDP) {
+	switch (nxt) {
+	case IPPROTO_HOPOPTS:
+	case IPPROTO_ROUTING:
+	case IPPROTO_DSTOPTS:
+	    if (plen < 8) {
+		return;
+	    }
+	    xlen = (q[1] + 1) * 8;
+	    if (xlen > plen) {
+		return;
+	    }
+	    nxt = q[0];
+	    q += xlen, plen -= xlen;
+	    break;
+	case IPPROTO_FRAGMENT:
+	    if (plen < 8 || q[0] != IPPROTO_UDP) {
+		return;
+	    }
+	    off = EXTRACT_16BITS(q + 2);
+	    id = (uint32_t) EXTRACT_16BITS(q + 4) << 16 | EXTRACT_16BITS(q + 6);
+	    frag_decode(ctx, h, 6, p + 8, p + 24, id,
+			off & 0xfff8, off & 0x0001, q + 8, plen - 8, pkt);
+	    return;
+	default:
+	    return;
+	}
+    }
+
+    udp_decode(ctx, h, q, plen, pkt);
+}
+
+/*
+ * Decode a raw pcap record.
+ */
+
+static void
+frame_decode(snmp_decoder_t *ctx, int linktype,
+	     const struct pcap_pkthdr *h, const u_char *bytes)
+{
+    const u_char *p;
+    u_int len = h->caplen;
+    uint16_t type = 0;
+
+    p = link_decode(linktype, bytes, &len, &type);
+    if (! p) {
+	return;
+    }
+
+    if (type == ETHERTYPE_IP) {
+	ipv4_decode(ctx, h, p, len);
+    } else {
+	ipv6_decode(ctx, h, p, len);
+    }
+}
+
+/*
+ * Create the fragment table before we start reading a capture and
+ * report anything unusual once we are done.
+ */
+
+static void
+frag_start(snmp_decoder_t *ctx)
+{
+    ctx->frags = snmp_frag_new(frag_memcap, frag_timeout);
+}
+
+static void
+frag_stop(snmp_decoder_t *ctx, const char *name)
+{
+    snmp_frag_stats_t stats;
+
+    snmp_frag_stats(ctx->frags, &stats);
+    if (stats.expired || stats.evicted || stats.overlaps
+	|| stats.invalid || stats.pending) {
+	fprintf(stderr, "%s: %s: %"PRIu64" fragmented datagrams reassembled, "
+		"%"PRIu64" expired, %"PRIu64" evicted, %"PRIu64" incomplete, "
+		"%"PRIu64" overlapping and %"PRIu64" invalid fragments\n",
+		progname, name, stats.completed, stats.expired,
+		stats.evicted, stats.pending, stats.overlaps, stats.invalid);
+    }
+    snmp_frag_delete(ctx->frags);
+    ctx->frags = NULL;
+}
+
+/*
+ * Apply the pcap filter expression (if any) to a pcap handle.
+ */
+
+static void
+filter_setup(pcap_t *pcap, const char *filter)
+{
+    struct bpf_program bpf;
+
+    if (! filter) {
+	return;
+    }
+
+    if (pcap_compile(pcap, &bpf, (char *) filter, 1, 0) == -1
+	|| pcap_setfilter(pcap, &bpf) == -1) {
+	fprintf(stderr, "%s: invalid pcap filter '%s': %s\n",
+		progname, filter, pcap_geterr(pcap));
+	exit(1);
+    }
+    pcap_freecode(&bpf);
+}
+
+/*
+ * Read all records from a pcap handle.
+ */
+
+static void
+native_read(snmp_decoder_t *ctx, pcap_t *pcap)
+{
+    struct pcap_pkthdr *h;
+    const u_char *bytes;
+    int linktype, rc;
+
+    linktype = pcap_datalink(pcap);
+
+    while ((rc = pcap_next_ex(pcap, &h, &bytes)) >= 0) {
+	if (rc == 0) {
+	    continue;
+	}
+	frame_decode(ctx, linktype, h, bytes);
+    }
+
+    if (rc == -1) {
+	fprintf(stderr, "%s: reading pcap data failed: %s\n",
+		progname, pcap_geterr(pcap));
+    }
+}
+
+/*
+ * Reader for classic pcap files which walks over the pcap records in
+ * place. Payload pointers handed to snmp_parse() point directly into
+ * the caller's buffer (e.g. a memory mapped file), so octet strings
+ * are never copied. Files in other formats (e.g. pcapng) are left to
+ * libpcap.
+ */
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_FILE_HDR_LEN	24
+#define PCAP_REC_HDR_LEN	16
+#define PCAP_MAX_CAPLEN		262144
+
+typedef struct {
+    snmp_decoder_t *ctx;
+    int		linktype;
+    int		swapped;
+    int		nsec;
+    int		corrupt;
+    pcap_t	*pcap;		/* dead pcap handle used for filtering */
+    struct bpf_program bpf;
+    int		filter;
+} pcap_walk_t;
+
+static uint32_t
+walk_extract32(const pcap_walk_t *w, const u_char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    if (w->swapped) {
+	v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+    }
+    return v;
+}
+
+/*
+ * Parse the pcap file header and prepare the filter. Returns 0 if
+ * this is not a classic pcap file or if the link type is not
+ * supported by the native decoder.
+ */
+
+static int
+walk_init(pcap_walk_t *w, snmp_decoder_t *ctx,
+	  const u_char *buf, size_t len, const char *filter)
+{
+    uint32_t magic, snaplen;
+
+    memset(w, 0, sizeof(*w));
+    w->ctx = ctx;
+    if (len < PCAP_FILE_HDR_LEN) {
+	return 0;
+    }
+
+    magic = walk_extract32(w, buf);
+    switch (magic) {
+    case PCAP_MAGIC:
+	break;
+    case PCAP_MAGIC_NSEC:
+	w->nsec = 1;
+	break;
+    default:
+	w->swapped = 1;
+	magic = walk_extract32(w, buf);
+	if (magic == PCAP_MAGIC_NSEC) {
+	    w->nsec = 1;
+	} else if (magic != PCAP_MAGIC) {
+	    return 0;
+	}
+	break;
+    }
+
+    snaplen = walk_extract32(w, buf + 16);
+    w->linktype = walk_extract32(w, buf + 20) & 0x03ffffff;
+    if (! link_supported(w->linktype)) {
+	return 0;
+    }
+
+    w->pcap = pcap_open_dead(w->linktype,
+			     snaplen ? (int) snaplen : PCAP_MAX_CAPLEN);
+    if (! w->pcap) {
+	return 0;
+    }
+
+    if (filter) {
+	if (pcap_compile(w->pcap, &w->bpf, (char *) filter, 1, 0) == -1) {
+	    fprintf(stderr, "%s: invalid pcap filter '%s': %s\n",
+		    progname, filter, pcap_geterr(w->pcap));
+	    exit(1);
+	}
+	w->filter = 1;
+    }
+
+    return 1;
+}
+
+/*
+ * Process all complete pcap records in the buffer. Returns the number
+ * of bytes consumed. The corrupt flag is set if a record header
+ * carries a bogus capture length.
+ */
+
+static size_t
+walk_records(pcap_walk_t *w, const u_char *buf, size_t len)
+{
+    struct pcap_pkthdr h;
+    const u_char *p = buf;
+    uint32_t caplen;
+
+    while (len >= PCAP_REC_HDR_LEN) {
+	caplen = walk_extract32(w, p + 8);
+	if (caplen > PCAP_MAX_CAPLEN) {
+	    w->corrupt = 1;
+	    break;
+	}
+	if (caplen > len - PCAP_REC_HDR_LEN) {
+	    break;
+	}
+
+	h.ts.tv_sec = walk_extract32(w, p);
+	h.ts.tv_usec = walk_extract32(w, p + 4);
+	if (w->nsec) {
+	    h.ts.tv_usec /= 1000;
+	}
+	h.caplen = caplen;
+	h.len = walk_extract32(w, p + 12);
+	p += PCAP_REC_HDR_LEN, len -= PCAP_REC_HDR_LEN;
+
+	if (! w->filter || pcap_offline_filter(&w->bpf, &h, p)) {
+	    frame_decode(w->ctx, w->linktype, &h, p);
+	}
+	p += caplen, len -= caplen;
+    }
+
+    return p - buf;
+}
+
+static void
+walk_done(pcap_walk_t *w)
+{
+    if (w->filter) {
+	pcap_freecode(&w->bpf);
+    }
+    if (w->pcap) {
+	pcap_close(w->pcap);
+    }
+}
+
+/*
+ * Read a pcap file by mapping it into memory. Returns 0 if the file
+ * can not be handled this way, in which case the caller should fall
+ * back to libpcap.
+ */
+
+static int
+mmap_read(snmp_decoder_t *ctx, const char *file, const char *filter)
+{
+    pcap_walk_t _w, *w = &_w;
+    struct stat st;
+    u_char *base;
+    size_t len, n;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1) {
+	return 0;
+    }
+    if (fstat(fd, &st) == -1 || ! S_ISREG(st.st_mode)
+	|| st.st_size < PCAP_FILE_HDR_LEN
+	|| (uint64_t) st.st_size > (size_t) -1) {
+	close(fd);
+	return 0;
+    }
+
+    len = st.st_size;
+    base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+	return 0;
+    }
+#ifdef MADV_SEQUENTIAL
+    (void) madvise(base, len, MADV_SEQUENTIAL);
+#endif
+
+    if (! walk_init(w, ctx, base, len, filter)) {
+	walk_done(w);
+	munmap(base, len);
+	return 0;
+    }
+
+    n = PCAP_FILE_HDR_LEN + walk_records(w, base + PCAP_FILE_HDR_LEN,
+					 len - PCAP_FILE_HDR_LEN);
+    if (n < len) {
+	fprintf(stderr, "%s: %s: %s pcap file\n", progname, file,
+		w->corrupt ? "corrupt" : "truncated");
+    }
+
+    walk_done(w);
+    munmap(base, len);
+    return 1;
 }
 
 /*
  * Entry point which reads a pcap file, applies the given pcap filter
  * and then calls the callback func for each SNMP message, passing the
- * user data pointer as well.
+ * user data pointer as well. Classic pcap files are memory mapped,
+ * everything else is read via libpcap.
  */
 
 void
 snmp_pcap_read_file(const char *file, const char *filter,
 		    snmp_callback func, void *data)
 {
+    char errbuf[PCAP_ERRBUF_SIZE];
+    snmp_decoder_t *ctx;
+    pcap_t *pcap;
+
     assert(file);
 
-    nids_params.filename = (char *) file;
-    nids_params.device = NULL;
-    nids_params.pcap_filter = (char *) filter;
+    ctx = snmp_decoder_new(func, data);
+    frag_start(ctx);
+    pool_start(ctx);
 
-#if 1
-    static struct nids_chksum_ctl ctl;
-#endif
+    if (! mmap_read(ctx, file, filter)) {
+	pcap = pcap_open_offline(file, errbuf);
+	if (! pcap) {
+	    fprintf(stderr, "%s: opening pcap file failed: %s\n",
+		    progname, errbuf);
+	    exit(1);
+	}
 
-    user_callback = func;
-    user_data = data;
-	
-    if (! nids_init()) {
-	fprintf(stderr, "libnids initialization failed: %s\n", nids_errbuf);
-	exit(1);
+	if (link_supported(pcap_datalink(pcap))) {
+	    filter_setup(pcap, filter);
+	    native_read(ctx, pcap);
+	} else {
+	    fprintf(stderr, "%s: %s: unsupported link type %d\n",
+		    progname, file, pcap_datalink(pcap));
+	}
+	pcap_close(pcap);
     }
 
-#if 1
-    /* this code discables checksum checking in libnids */
-    ctl.netaddr = inet_addr("0.0.0.0");
-    ctl.mask = inet_addr("0.0.0.0");
-    ctl.action = NIDS_DONT_CHKSUM;
-    nids_register_chksum_ctl(&ctl, 1);
-#endif
-
-    nids_register_udp(udp_callback);
-    nids_run();
+    pool_stop(ctx);
+    frag_stop(ctx, file);
+    snmp_decoder_delete(ctx);
 }
 
-void
-snmp_pcap_read_stream(FILE *stream, const char *filter,
-		      snmp_callback func, void *data)
+/*
+ * Streams which are not classic pcap data (e.g. pcapng) or which use
+ * a link type the walker does not know are handed to libpcap. Since
+ * the beginning of the stream has already been consumed, libpcap
+ * reads from a cookie stream which first replays the bytes read so
+ * far and then continues with the original stream. Systems without
+ * cookie streams get a temporary file holding the whole stream.
+ */
+
+typedef struct {
+    const u_char *buf;
+    size_t	len;
+    size_t	off;
+    FILE	*stream;
+} replay_t;
+
+static size_t
+replay_read(replay_t *r, char *buf, size_t size)
 {
-#ifdef HAVE_LIBNIDS_PCAP_DESC
+    size_t n;
 
-    /* This code was suggested by Rafal Wojtczuk <nergal@avet.com.pl>
-       but requires libnids 1.21 to compile and run. */
-    
-    char errbuf[PCAP_ERRBUF_SIZE];
-    
-    assert(stream);
+    if (r->off < r->len) {
+	n = r->len - r->off;
+	if (n > size) {
+	    n = size;
+	}
+	memcpy(buf, r->buf + r->off, n);
+	r->off += n;
+	return n;
+    }
 
-    nids_params.filename = NULL;
-    nids_params.device = NULL;
-    nids_params.pcap_filter = (char *) filter;
-    nids_params.pcap_desc = pcap_fopen_offline(stream, errbuf);
+    return fread(buf, 1, size, r->stream);
+}
 
-    if (! nids_params.pcap_desc) {
-	fprintf(stderr, "opening pcap stream failed: %s\n", errbuf);
-	exit(1);
+#if defined(HAVE_FOPENCOOKIE)
+
+static ssize_t
+replay_cookie_read(void *cookie, char *buf, size_t size)
+{
+    replay_t *r = (replay_t *) cookie;
+    size_t n;
+
+    n = replay_read(r, buf, size);
+    if (n == 0 && ferror(r->stream)) {
+	return -1;
     }
+    return n;
+}
 
-    user_callback = func;
-    user_data = data;
-	
-    if (! nids_init()) {
-	fprintf(stderr, "libnids initialization failed: %s\n", nids_errbuf);
-	exit(1);
+static FILE*
+replay_open(replay_t *r)
+{
+    cookie_io_functions_t io = { replay_cookie_read, NULL, NULL, NULL };
+
+    return fopencookie(r, "r", io);
+}
+
+#elif defined(HAVE_FUNOPEN)
+
+static int
+replay_cookie_read(void *cookie, char *buf, int size)
+{
+    replay_t *r = (replay_t *) cookie;
+    size_t n;
+
+    n = replay_read(r, buf, size);
+    if (n == 0 && ferror(r->stream)) {
+	return -1;
     }
+    return n;
+}
+
+static FILE*
+replay_open(replay_t *r)
+{
+    return funopen(r, replay_cookie_read, NULL, NULL, NULL);
+}
 
-    nids_register_udp(udp_callback);
-    nids_run();
 #else
-    char path[] = "/tmp/snmpdump.XXXXXX";
-    pid_t pid;
 
-    assert(stream);
+static FILE*
+replay_open(replay_t *r)
+{
+    char buf[BUFSIZ];
+    FILE *tmp;
+    size_t n;
 
-    if (mktemp(path) == NULL) {
-	fprintf(stderr, "%s: creating temporary file name failed\n",
-		progname);
-	exit(1);
+    tmp = tmpfile();
+    if (! tmp) {
+	return NULL;
     }
+    while ((n = replay_read(r, buf, sizeof(buf))) > 0) {
+	if (fwrite(buf, 1, n, tmp) != n) {
+	    fclose(tmp);
+	    return NULL;
+	}
+    }
+    if (ferror(r->stream) || fflush(tmp) || fseek(tmp, 0, SEEK_SET)) {
+	fclose(tmp);
+	return NULL;
+    }
+    return tmp;
+}
 
-    if (mkfifo(path, 0600) == -1) {
-	fprintf(stderr, "%s: failed to create fifo: %s\n",
-		progname, strerror(errno));
+#endif
+
+static void
+replay_stream(snmp_decoder_t *ctx, FILE *stream,
+	      const u_char *buf, size_t len, const char *filter)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    replay_t r = { buf, len, 0, stream };
+    FILE *replay;
+    pcap_t *pcap;
+
+    replay = replay_open(&r);
+    if (! replay) {
+	fprintf(stderr, "%s: pcap stream: %s\n", progname, strerror(errno));
 	exit(1);
     }
 
-    pid = fork();
-    if (pid == -1) {
-	fprintf(stderr, "%s: fork failed: %s\n",
-		progname, strerror(errno));
+    pcap = pcap_fopen_offline(replay, errbuf);
+    if (! pcap) {
+	fprintf(stderr, "%s: opening pcap stream failed: %s\n",
+		progname, errbuf);
 	exit(1);
     }
 
-    if (pid == 0) {
-	FILE *fifo;
-	int c;
-	
-	fifo = fopen(path, "w");
-	if (! fifo) {
-	    fprintf(stderr, "%s: failed to open fifo: %s\n",
-		    progname, strerror(errno));
-	    exit(1);
-	}
-	while ((c = getc(stream)) != EOF) {
-	    putc(c, fifo);
+    if (link_supported(pcap_datalink(pcap))) {
+	filter_setup(pcap, filter);
+	native_read(ctx, pcap);
+    } else {
+	fprintf(stderr, "%s: pcap stream: unsupported link type %d\n",
+		progname, pcap_datalink(pcap));
+    }
+    pcap_close(pcap);		/* also closes the replay stream */
+}
+
+/*
+ * Entry point which reads pcap data from a stream. Classic pcap data
+ * is read in large blocks and the records are processed in place, so
+ * no helper process or fifo is needed. Everything else is read via
+ * libpcap.
+ */
+
+#define PCAP_STREAM_BLOCK	(1024 * 1024)
+
+static void
+walk_stream(pcap_walk_t *w, FILE *stream, u_char *buf, size_t have)
+{
+    size_t off, n;
+
+    off = PCAP_FILE_HDR_LEN;
+    while (1) {
+	off += walk_records(w, buf + off, have - off);
+	if (w->corrupt) {
+	    break;
 	}
-	
-	if (fflush(fifo) || ferror(fifo) || ferror(stream)) {
-	    perror(progname);
-	    exit(1);
+	memmove(buf, buf + off, have - off);
+	have -= off, off = 0;
+	n = fread(buf + have, 1, PCAP_STREAM_BLOCK - have, stream);
+	if (n == 0) {
+	    break;
 	}
-	fclose(fifo);
-	unlink(path);
-	exit(0);
+	have += n;
+    }
+
+    if (ferror(stream)) {
+	fprintf(stderr, "%s: pcap stream: %s\n", progname, strerror(errno));
+    } else if (have > off) {
+	fprintf(stderr, "%s: pcap stream: %s pcap data\n", progname,
+		w->corrupt ? "corrupt" : "truncated");
+    }
+}
+
+void
+snmp_pcap_read_stream(FILE *stream, const char *filter,
+		      snmp_callback func, void *data)
+{
+    pcap_walk_t _w, *w = &_w;
+    snmp_decoder_t *ctx;
+    u_char *buf;
+    size_t have = 0, n;
+
+    assert(stream);
+
+    ctx = snmp_decoder_new(func, data);
+    frag_start(ctx);
+    pool_start(ctx);
+
+    buf = malloc(PCAP_STREAM_BLOCK);
+    if (! buf) {
+	abort();
+    }
+
+    while (have < PCAP_FILE_HDR_LEN
+	   && (n = fread(buf + have, 1, PCAP_STREAM_BLOCK - have, stream)) > 0) {
+	have += n;
+    }
+    if (ferror(stream)) {
+	fprintf(stderr, "%s: pcap stream: %s\n", progname, strerror(errno));
+	exit(1);
+    }
+
+    if (walk_init(w, ctx, buf, have, filter)) {
+	walk_stream(w, stream, buf, have);
+	walk_done(w);
     } else {
-	snmp_pcap_read_file(path, filter, func, data);
-	unlink(path);
+	walk_done(w);
+	replay_stream(ctx, stream, buf, have, filter);
     }
-#endif
+    free(buf);
+
+    pool_stop(ctx);
+    frag_stop(ctx, "pcap stream");
+    snmp_decoder_delete(ctx);
 }
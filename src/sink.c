@@ -0,0 +1,337 @@
+/*
+ * sink.c --
+ *
+ * Buffered output sinks. The writers append their output to the
+ * buffer of a sink instead of calling stdio for every field, and the
+ * buffer is handed to the operating system in large chunks, either
+ * with write()/writev() on a file descriptor or with fwrite() on a
+ * stdio stream.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+#include "snmp.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+static inline void*
+xmalloc(size_t size)
+{
+    void *p;
+
+    p = malloc(size);
+    if (! p) {
+	abort();
+    }
+    return p;
+}
+
+static snmp_sink_t*
+sink_new(size_t size)
+{
+    snmp_sink_t *sink;
+
+    sink = xmalloc(sizeof(snmp_sink_t));
+    memset(sink, 0, sizeof(snmp_sink_t));
+    sink->size = size ? size : SNMP_SINK_SIZE;
+    sink->buf = xmalloc(sink->size);
+    sink->fd = -1;
+    return sink;
+}
+
+/*
+ * Create a sink writing to a file descriptor or to a stdio stream.
+ * The size is the size of the buffer, 0 selects the default size.
+ */
+
+snmp_sink_t*
+snmp_sink_new_fd(int fd, size_t size)
+{
+    snmp_sink_t *sink;
+
+    sink = sink_new(size);
+    sink->fd = fd;
+    return sink;
+}
+
+snmp_sink_t*
+snmp_sink_new_stream(FILE *stream, size_t size)
+{
+    snmp_sink_t *sink;
+
+    sink = sink_new(size);
+    sink->stream = stream;
+    return sink;
+}
+
+/*
+ * Write a vector of buffers to the sink's file descriptor or stream.
+ * Short writes are continued; the first error is remembered in the
+ * sink and the remaining data is dropped.
+ */
+
+static void
+sink_raw_output(snmp_sink_t *sink, struct iovec *iov, int cnt)
+{
+    ssize_t n;
+    int i;
+
+    if (sink->error) {
+	return;
+    }
+
+    if (sink->fd < 0) {
+	for (i = 0; i < cnt; i++) {
+	    if (iov[i].iov_len
+		&& fwrite(iov[i].iov_base, 1, iov[i].iov_len, sink->stream)
+		   != iov[i].iov_len) {
+		sink->error = errno ? errno : EIO;
+		return;
+	    }
+	}
+	return;
+    }
+
+    while (cnt > 0) {
+	n = writev(sink->fd, iov, cnt);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    sink->error = errno;
+	    return;
+	}
+	while (cnt > 0 && (size_t) n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++, cnt--;
+	}
+	if (cnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+}
+
+static void
+sink_zip_output(void *ctx, const void *data, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) data;
+    iov.iov_len = len;
+    sink_raw_output((snmp_sink_t *) ctx, &iov, 1);
+}
+
+/*
+ * Pass data on to the compressor if the sink compresses, otherwise
+ * write it right away.
+ */
+
+static void
+sink_output(snmp_sink_t *sink, struct iovec *iov, int cnt)
+{
+    if (sink->error) {
+	return;
+    }
+    if (sink->zip) {
+	snmp_zip_write(sink->zip, iov, cnt, sink_zip_output, sink);
+    } else {
+	sink_raw_output(sink, iov, cnt);
+    }
+}
+
+/*
+ * Compress everything written to the sink from now on with the given
+ * gzip level. The compressor collects the output into blocks of its
+ * own, so the buffer of the sink keeps its size.
+ */
+
+void
+snmp_sink_compress(snmp_sink_t *sink, int level)
+{
+    snmp_sink_flush(sink);
+    sink->zip = snmp_zip_new(level);
+}
+
+/*
+ * Flush the buffer. Returns 0 on success and -1 if any write to the
+ * sink has failed so far, with errno set accordingly.
+ */
+
+int
+snmp_sink_flush(snmp_sink_t *sink)
+{
+    struct iovec iov;
+
+    if (sink->len) {
+	iov.iov_base = sink->buf;
+	iov.iov_len = sink->len;
+	sink_output(sink, &iov, 1);
+	sink->len = 0;
+    }
+    if (sink->zip) {
+	/* files are never empty, but the output stream may be */
+	snmp_zip_flush(sink->zip, sink->fd < 0, sink_zip_output, sink);
+    }
+    if (sink->stream && ! sink->error && fflush(sink->stream)) {
+	sink->error = errno;
+    }
+    if (sink->error) {
+	errno = sink->error;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Slow path of snmp_sink_reserve(): flush the buffer and enlarge it if
+ * it cannot hold len bytes at all.
+ */
+
+char*
+snmp_sink_grow(snmp_sink_t *sink, size_t len)
+{
+    struct iovec iov;
+
+    if (sink->len) {
+	iov.iov_base = sink->buf;
+	iov.iov_len = sink->len;
+	sink_output(sink, &iov, 1);
+	sink->len = 0;
+    }
+    if (sink->size < len) {
+	free(sink->buf);
+	sink->buf = xmalloc(len);
+	sink->size = len;
+    }
+    return sink->buf;
+}
+
+/*
+ * Slow path of snmp_sink_write(): the data does not fit into the
+ * buffer. Large blocks are written together with the buffered bytes
+ * in a single call instead of being copied.
+ */
+
+void
+snmp_sink_spill(snmp_sink_t *sink, const void *data, size_t len)
+{
+    struct iovec iov[2];
+
+    if (len < sink->size) {
+	snmp_sink_grow(sink, len);
+	memcpy(sink->buf, data, len);
+	sink->len = len;
+	return;
+    }
+
+    iov[0].iov_base = sink->buf;
+    iov[0].iov_len = sink->len;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = len;
+    sink_output(sink, iov, 2);
+    sink->len = 0;
+}
+
+/*
+ * Flush and release a sink. snmp_sink_delete() leaves the file
+ * descriptor or stream open while snmp_sink_close() closes it. Both
+ * return -1 if writing to the sink failed at some point.
+ */
+
+int
+snmp_sink_delete(snmp_sink_t *sink)
+{
+    int rc;
+
+    rc = snmp_sink_flush(sink);
+    if (sink->zip) {
+	snmp_zip_delete(sink->zip);
+    }
+    free(sink->buf);
+    free(sink);
+    return rc;
+}
+
+int
+snmp_sink_close(snmp_sink_t *sink)
+{
+    int rc;
+
+    rc = snmp_sink_flush(sink);
+    if (sink->fd >= 0) {
+	if (close(sink->fd) && ! rc) {
+	    rc = -1;
+	}
+    } else if (sink->stream) {
+	if (fclose(sink->stream) && ! rc) {
+	    rc = -1;
+	}
+    }
+    if (sink->zip) {
+	snmp_zip_delete(sink->zip);
+    }
+    free(sink->buf);
+    free(sink);
+    return rc;
+}
+
+/*
+ * Append numbers, object identifiers, IPv4 addresses and time stamps
+ * formatted by the fmt.c functions, and octet strings in hexadecimal
+ * notation.
+ */
+
+void
+snmp_sink_uint64(snmp_sink_t *sink, uint64_t v)
+{
+    char *p = snmp_sink_reserve(sink, SNMP_FMT_UINT64_SIZE);
+
+    snmp_sink_commit(sink, snmp_fmt_uint64(p, v));
+}
+
+void
+snmp_sink_int64(snmp_sink_t *sink, int64_t v)
+{
+    char *p = snmp_sink_reserve(sink, SNMP_FMT_INT64_SIZE);
+
+    snmp_sink_commit(sink, snmp_fmt_int64(p, v));
+}
+
+void
+snmp_sink_oid(snmp_sink_t *sink, const uint32_t *value, unsigned len)
+{
+    char *p = snmp_sink_reserve(sink, SNMP_FMT_OID_SIZE(len));
+
+    snmp_sink_commit(sink, snmp_fmt_oid(p, value, len));
+}
+
+void
+snmp_sink_ipv4(snmp_sink_t *sink, const void *addr)
+{
+    char *p = snmp_sink_reserve(sink, SNMP_FMT_IPV4_SIZE);
+
+    snmp_sink_commit(sink, snmp_fmt_ipv4(p, addr));
+}
+
+void
+snmp_sink_time(snmp_sink_t *sink, uint32_t sec, uint32_t usec)
+{
+    char *p = snmp_sink_reserve(sink, SNMP_FMT_TIME_SIZE);
+
+    snmp_sink_commit(sink, snmp_fmt_time(p, sec, usec));
+}
+
+void
+snmp_sink_hex(snmp_sink_t *sink, const u_char *data, size_t len)
+{
+    char *p = snmp_sink_reserve(sink, 2 * len);
+
+    snmp_hex_encode(p, data, len);
+    snmp_sink_commit(sink, 2 * len);
+}
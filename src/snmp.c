@@ -32,21 +32,118 @@ xmalloc(size_t size)
     return p;
 }
 
-static inline void*
-xmemdup(const void *src, size_t len)
+/*
+ * Prepare an OID to hold up to size sub-identifiers and return the
+ * storage. Short OIDs use the inline storage of the snmp_oid_t, longer
+ * ones are allocated from the arena. The length is left to the caller.
+ */
+
+uint32_t*
+snmp_oid_alloc(snmp_arena_t *arena, snmp_oid_t *v, unsigned size)
 {
-    void *dst;
-    
-    dst = xmalloc(len);
-    memcpy(dst, src, len);
-    return dst;
+    assert(v);
+
+    if (size <= SNMP_OID_INLINE) {
+	v->ext = NULL;
+	return v->sub;
+    }
+    assert(arena);
+    v->ext = snmp_arena_alloc(arena, size * sizeof(uint32_t));
+    return v->ext;
 }
 
+void
+snmp_oid_set(snmp_arena_t *arena, snmp_oid_t *v,
+	     const uint32_t *value, unsigned len)
+{
+    uint32_t *p;
+
+    p = snmp_oid_alloc(arena, v, len);
+    if (len && p != value) {
+	memcpy(p, value, len * sizeof(uint32_t));
+    }
+    v->len = len;
+}
+
+/*
+ * Insert a zeroed varbind at position pos of a varbind list. The
+ * array is doubled in size from the arena if it is full.
+ */
+
+snmp_varbind_t*
+snmp_vbl_insert(snmp_arena_t *arena, snmp_var_bindings_t *vbl, unsigned pos)
+{
+    snmp_varbind_t *vb;
+
+    assert(arena && vbl && pos <= vbl->count);
+
+    if (vbl->count == vbl->size) {
+	vbl->size = vbl->size ? 2 * vbl->size : 8;
+	vb = snmp_arena_alloc(arena, vbl->size * sizeof(snmp_varbind_t));
+	if (vbl->count) {
+	    memcpy(vb, vbl->varbind, vbl->count * sizeof(snmp_varbind_t));
+	}
+	vbl->varbind = vb;
+    }
+
+    vb = vbl->varbind + pos;
+    if (pos < vbl->count) {
+	memmove(vb + 1, vb, (vbl->count - pos) * sizeof(snmp_varbind_t));
+    }
+    memset(vb, 0, sizeof(snmp_varbind_t));
+    vbl->count++;
+    return vb;
+}
+
+snmp_varbind_t*
+snmp_vbl_append(snmp_arena_t *arena, snmp_var_bindings_t *vbl)
+{
+    return snmp_vbl_insert(arena, vbl, vbl->count);
+}
+
+/*
+ * Compute the signature of the varbind names. Every name sets two
+ * bits selected by a hash of the name, so the signature does not
+ * depend on the order of the varbinds. If the names of one list are
+ * contained in another list, the bits of its signature are contained
+ * in the signature of the other list, which allows to reject most
+ * non-matching lists without comparing the names.
+ */
+
+void
+snmp_vbl_sign(snmp_var_bindings_t *vbl)
+{
+    snmp_varbind_t *vb;
+    uint32_t *sub;
+    uint64_t h;
+    unsigned i;
+
+    vbl->sig = 0;
+    SNMP_VBL_FOREACH(vbl, vb) {
+	if (! vb->name.attr.flags) {
+	    continue;
+	}
+	sub = SNMP_OID_VALUE(&vb->name);
+	h = 14695981039346656037ULL ^ vb->name.len;
+	for (i = 0; i < vb->name.len; i++) {
+	    h = (h ^ sub[i]) * 1099511628211ULL;
+	}
+	h ^= h >> 29;
+	vbl->sig |= (1ULL << (h & 63)) | (1ULL << ((h >> 6) & 63));
+    }
+}
+
+/*
+ * Convert a version one trap into the RFC 3416 format. The new
+ * varbinds are allocated from the packet's arena.
+ */
+
 void
 snmp_pkt_v1tov2(snmp_packet_t *pkt)
 {
     snmp_pdu_t *pdu;
-    snmp_varbind_t *nvb, *vb;
+    snmp_varbind_t *nvb;
+    snmp_arena_t *arena;
 
     static uint32_t sysUpTime0[]   = { 1, 3, 6, 1, 2, 1, 1, 3, 0 };
     static uint32_t snmpTrapOid0[] = { 1, 3, 6, 1, 6, 3, 1, 1, 4, 1, 0 };
@@ -61,7 +158,9 @@ snmp_pkt_v1tov2(snmp_packet_t *pkt)
     static uint32_t authFailure[]  = { 1, 3, 6, 1, 6, 3, 1, 1, 5, 5 };
     static uint32_t egpNeighLoss[] = { 1, 3, 6, 1, 6, 3, 1, 1, 5, 6 };
 
-    assert(pkt);
+    assert(pkt && pkt->arena);
+
+    arena = pkt->arena;
 
     pdu = &pkt->snmp.scoped_pdu.pdu;
 
@@ -71,68 +170,60 @@ snmp_pkt_v1tov2(snmp_packet_t *pkt)
 
     /* set 2nd varbind to { snmpTrapOid.0 == ... } (RFC 3584) */
 
-    nvb = (snmp_varbind_t *) xmalloc(sizeof(snmp_varbind_t));
-    nvb->attr.flags |= SNMP_FLAG_DYNAMIC;
+    nvb = snmp_vbl_insert(arena, &pdu->varbindings, 0);
     nvb->attr.flags |= SNMP_FLAG_VALUE;
     nvb->type = SNMP_TYPE_OID;
-    nvb->name.len = sizeof(snmpTrapOid0) / sizeof(snmpTrapOid0[0]);
-    nvb->name.value = xmemdup(snmpTrapOid0, nvb->name.len * sizeof(uint32_t));
+    snmp_oid_set(arena, &nvb->name, snmpTrapOid0,
+		 sizeof(snmpTrapOid0) / sizeof(snmpTrapOid0[0]));
     nvb->name.attr.flags |= SNMP_FLAG_VALUE;
     if (! pdu->generic_trap.attr.flags & SNMP_FLAG_VALUE) {
 	nvb->value.oid.len = 0;
-	nvb->value.oid.value = NULL;
     } else {
 	switch (pdu->generic_trap.value) {
 	case 0: /* coldStart */
-	    nvb->value.oid.len = sizeof(coldStart) / sizeof(coldStart[0]);
-	    nvb->value.oid.value = xmemdup(coldStart,
-				   nvb->value.oid.len * sizeof(uint32_t));
+	    snmp_oid_set(arena, &nvb->value.oid, coldStart,
+			 sizeof(coldStart) / sizeof(coldStart[0]));
 	    nvb->value.oid.attr.flags |= SNMP_FLAG_VALUE;
 	    break;
 	case 1: /* warmStart */
-	    nvb->value.oid.len = sizeof(warmStart) / sizeof(warmStart[0]);
-	    nvb->value.oid.value = xmemdup(warmStart,
-				   nvb->value.oid.len * sizeof(uint32_t));
+	    snmp_oid_set(arena, &nvb->value.oid, warmStart,
+			 sizeof(warmStart) / sizeof(warmStart[0]));
 	    nvb->value.oid.attr.flags |= SNMP_FLAG_VALUE;
 	    break;
 	case 2: /* linkDown */
-	    nvb->value.oid.len = sizeof(linkDown) / sizeof(linkDown[0]);
-	    nvb->value.oid.value = xmemdup(linkDown,
-				   nvb->value.oid.len * sizeof(uint32_t));
+	    snmp_oid_set(arena, &nvb->value.oid, linkDown,
+			 sizeof(linkDown) / sizeof(linkDown[0]));
 	    nvb->value.oid.attr.flags |= SNMP_FLAG_VALUE;
 	    break;
 	case 3: /* linkUp */
-	    nvb->value.oid.len = sizeof(linkUp) / sizeof(linkUp[0]);
-	    nvb->value.oid.value = xmemdup(linkUp,
-				   nvb->value.oid.len * sizeof(uint32_t));
+	    snmp_oid_set(arena, &nvb->value.oid, linkUp,
+			 sizeof(linkUp) / sizeof(linkUp[0]));
 	    nvb->value.oid.attr.flags |= SNMP_FLAG_VALUE;
 	    break;
 	case 4: /* authenticationFailure */
-	    nvb->value.oid.len = sizeof(authFailure) / sizeof(authFailure[0]);
-	    nvb->value.oid.value = xmemdup(authFailure,
-				   nvb->value.oid.len * sizeof(uint32_t));
+	    snmp_oid_set(arena, &nvb->value.oid, authFailure,
+			 sizeof(authFailure) / sizeof(authFailure[0]));
 	    nvb->value.oid.attr.flags |= SNMP_FLAG_VALUE;
 	    break;
 	case 5: /* egpNeighborLoss */
-	    nvb->value.oid.len = sizeof(egpNeighLoss) / sizeof(egpNeighLoss[0]);
-	    nvb->value.oid.value = xmemdup(egpNeighLoss,
-				   nvb->value.oid.len * sizeof(uint32_t));
+	    snmp_oid_set(arena, &nvb->value.oid, egpNeighLoss,
+			 sizeof(egpNeighLoss) / sizeof(egpNeighLoss[0]));
 	    nvb->value.oid.attr.flags |= SNMP_FLAG_VALUE;
 	    break;
 	case 6: /* enterprise specific */
 	    if ((! pdu->specific_trap.attr.flags & SNMP_FLAG_VALUE)
 		|| (! pdu->enterprise.attr.flags & SNMP_FLAG_VALUE)) {
 		nvb->value.oid.len = 0;
-		nvb->value.oid.value = NULL;
 	    } else {
 		int len = pdu->enterprise.len;
+		uint32_t *value;
 		nvb->value.oid.len = pdu->enterprise.len + 2;
-		nvb->value.oid.value = xmalloc(nvb->value.oid.len
-					       * sizeof(uint32_t));
-		memcpy(nvb->value.oid.value, pdu->enterprise.value,
+		value = snmp_oid_alloc(arena, &nvb->value.oid,
+				       nvb->value.oid.len);
+		memcpy(value, SNMP_OID_VALUE(&pdu->enterprise),
 		       pdu->enterprise.len * sizeof(uint32_t));
-		nvb->value.oid.value[len] = 0;
-		nvb->value.oid.value[++len] = pdu->specific_trap.value;
+		value[len] = 0;
+		value[++len] = pdu->specific_trap.value;
 		nvb->value.oid.attr.flags |= SNMP_FLAG_VALUE;
 	    }
 	    break;
@@ -140,17 +231,14 @@ snmp_pkt_v1tov2(snmp_packet_t *pkt)
 	    abort();
 	}
     }
-    nvb->next = pdu->varbindings.varbind;
-    pdu->varbindings.varbind = nvb;
 
     /* set 1st varbind to { sysUpTime.0, time_stamp } (RFC 3584) */
 
-    nvb = (snmp_varbind_t *) xmalloc(sizeof(snmp_varbind_t));
-    nvb->attr.flags |= SNMP_FLAG_DYNAMIC;
+    nvb = snmp_vbl_insert(arena, &pdu->varbindings, 0);
     nvb->attr.flags |= SNMP_FLAG_VALUE;
     nvb->type = SNMP_TYPE_UINT32;
-    nvb->name.len = sizeof(sysUpTime0) / sizeof(sysUpTime0[0]);
-    nvb->name.value = xmemdup(sysUpTime0, nvb->name.len * sizeof(uint32_t));
+    snmp_oid_set(arena, &nvb->name, sysUpTime0,
+		 sizeof(sysUpTime0) / sizeof(sysUpTime0[0]));
     nvb->name.attr.flags |= SNMP_FLAG_VALUE;
     if (! pdu->time_stamp.attr.flags & SNMP_FLAG_VALUE) {
 	nvb->value.u32.value = 0;
@@ -158,21 +246,14 @@ snmp_pkt_v1tov2(snmp_packet_t *pkt)
 	nvb->value.u32.value = pdu->time_stamp.value;
 	nvb->value.u32.attr.flags |= SNMP_FLAG_VALUE;
     }
-    nvb->next = pdu->varbindings.varbind;
-    pdu->varbindings.varbind = nvb;
-
-    /* get a pointer to the last varbind */
-
-    for (vb = pdu->varbindings.varbind; vb->next; vb = vb->next) ;
 
     /* set n-2nd varbind to { snmpTrapAddress.0, agent_addr } (RFC 3584) */
 
-    nvb = (snmp_varbind_t *) xmalloc(sizeof(snmp_varbind_t));
-    nvb->attr.flags |= SNMP_FLAG_DYNAMIC;
+    nvb = snmp_vbl_append(arena, &pdu->varbindings);
     nvb->attr.flags |= SNMP_FLAG_VALUE;
     nvb->type = SNMP_TYPE_IPADDR;
-    nvb->name.len = sizeof(snmpTrapAddress0) / sizeof(snmpTrapAddress0[0]);
-    nvb->name.value = xmemdup(snmpTrapAddress0, nvb->name.len * sizeof(uint32_t));
+    snmp_oid_set(arena, &nvb->name, snmpTrapAddress0,
+		 sizeof(snmpTrapAddress0) / sizeof(snmpTrapAddress0[0]));
     nvb->name.attr.flags |= SNMP_FLAG_VALUE;
     if (! pdu->agent_addr.attr.flags & SNMP_FLAG_VALUE) {
 	nvb->value.ip.value = 0;
@@ -180,60 +261,46 @@ snmp_pkt_v1tov2(snmp_packet_t *pkt)
 	nvb->value.ip.value = pdu->agent_addr.value;
 	nvb->value.ip.attr.flags |= SNMP_FLAG_VALUE;
     }
-    nvb->next = NULL;
-    vb->next = nvb;
-    vb = nvb;
 
     /* set n-1st varbind to { snmpTrapCommunity.0, community } (RFC 3584) */
 
-    nvb = (snmp_varbind_t *) xmalloc(sizeof(snmp_varbind_t));
-    nvb->attr.flags |= SNMP_FLAG_DYNAMIC;
+    nvb = snmp_vbl_append(arena, &pdu->varbindings);
     nvb->attr.flags |= SNMP_FLAG_VALUE;
     nvb->type = SNMP_TYPE_OCTS;
-    nvb->name.len = sizeof(snmpTrapCommunity0) / sizeof(snmpTrapCommunity0[0]);
-    nvb->name.value = xmemdup(snmpTrapCommunity0, nvb->name.len * sizeof(uint32_t));
+    snmp_oid_set(arena, &nvb->name, snmpTrapCommunity0,
+		 sizeof(snmpTrapCommunity0) / sizeof(snmpTrapCommunity0[0]));
     nvb->name.attr.flags |= SNMP_FLAG_VALUE;
     if (! pkt->snmp.community.attr.flags & SNMP_FLAG_VALUE) {
 	nvb->value.octs.len = 0;
 	nvb->value.octs.value = NULL;
     } else {
 	nvb->value.octs.len = pkt->snmp.community.len;
-	nvb->value.octs.value = xmemdup(pkt->snmp.community.value,
+	nvb->value.octs.value = snmp_arena_memdup(arena, pkt->snmp.community.value,
 					pkt->snmp.community.len);
 	nvb->value.octs.attr.flags |= SNMP_FLAG_VALUE;
-	nvb->value.octs.attr.flags |= SNMP_FLAG_DYNAMIC;
     }
-    nvb->next = NULL;
-    vb->next = nvb;
-    vb = nvb;
 
     /* set n-th varbind to { snmpTrapEnterprise.0, community } (RFC 3584) */
 
-    nvb = (snmp_varbind_t *) xmalloc(sizeof(snmp_varbind_t));
-    nvb->attr.flags |= SNMP_FLAG_DYNAMIC;
+    nvb = snmp_vbl_append(arena, &pdu->varbindings);
     nvb->attr.flags |= SNMP_FLAG_VALUE;
     nvb->type = SNMP_TYPE_OID;
-    nvb->name.len = sizeof(snmpTrapEnterprise0) / sizeof(snmpTrapEnterprise0[0]);
-    nvb->name.value = xmemdup(snmpTrapEnterprise0, nvb->name.len * sizeof(uint32_t));
+    snmp_oid_set(arena, &nvb->name, snmpTrapEnterprise0,
+		 sizeof(snmpTrapEnterprise0) / sizeof(snmpTrapEnterprise0[0]));
     nvb->name.attr.flags |= SNMP_FLAG_VALUE;
     if (! pdu->enterprise.attr.flags & SNMP_FLAG_VALUE) {
 	nvb->value.oid.len = 0;
-	nvb->value.oid.value = NULL;
     } else {
-	nvb->value.oid.len = pdu->enterprise.len;
-	nvb->value.oid.value = xmemdup(pdu->enterprise.value,
-					pdu->enterprise.len * sizeof(uint32_t));
+	snmp_oid_set(arena, &nvb->value.oid, SNMP_OID_VALUE(&pdu->enterprise),
+		     pdu->enterprise.len);
 	nvb->value.oid.attr.flags |= SNMP_FLAG_VALUE;
-	nvb->value.oid.attr.flags |= SNMP_FLAG_DYNAMIC;
     }
-    nvb->next = NULL;
-    vb->next = nvb;
-    vb = nvb;
 
     /* Finally, change the pdu type and mark all trap fields as unused
      * by clearing the value flags. */
 
     pdu->type = SNMP_PDU_TRAP2;
+    snmp_vbl_sign(&pdu->varbindings);
 
     pdu->enterprise.attr.flags &= ~SNMP_FLAG_VALUE;
     pdu->agent_addr.attr.flags &= ~SNMP_FLAG_VALUE;
@@ -250,92 +317,184 @@ snmp_pkt_new(void)
 
     pkt = xmalloc(sizeof(snmp_packet_t));
     pkt->attr.flags |= SNMP_FLAG_DYNAMIC;
+    pkt->arena = snmp_arena_new();
+    pkt->refcnt = 1;
     return pkt;
 }
 
+/*
+ * Copy all octet strings of a packet into the given arena.
+ */
+
+static inline void
+detach_octs(snmp_arena_t *arena, snmp_octs_t *v)
+{
+    if (v->value) {
+	v->value = snmp_arena_memdup(arena, v->value, v->len);
+    }
+}
+
+static void
+snmp_pkt_detach(snmp_arena_t *arena, snmp_packet_t *pkt)
+{
+    snmp_varbind_t *vb;
+
+    detach_octs(arena, &pkt->snmp.community);
+    detach_octs(arena, &pkt->snmp.message.msg_flags);
+    detach_octs(arena, &pkt->snmp.usm.auth_engine_id);
+    detach_octs(arena, &pkt->snmp.usm.user);
+    detach_octs(arena, &pkt->snmp.usm.auth_params);
+    detach_octs(arena, &pkt->snmp.usm.priv_params);
+    detach_octs(arena, &pkt->snmp.scoped_pdu.context_engine_id);
+    detach_octs(arena, &pkt->snmp.scoped_pdu.context_name);
+
+    SNMP_VBL_FOREACH(&pkt->snmp.scoped_pdu.pdu.varbindings, vb) {
+	if (vb->type == SNMP_TYPE_OCTS || vb->type == SNMP_TYPE_OPAQUE) {
+	    detach_octs(arena, &vb->value.octs);
+	}
+    }
+    pkt->attr.flags &= ~SNMP_FLAG_BORROWED;
+}
+
+/*
+ * Make a deep copy of a packet. Everything the copy refers to lives
+ * in the copy's own arena, so it remains valid after the original
+ * packet has been released by the reader.
+ */
+
 snmp_packet_t*
 snmp_pkt_copy(snmp_packet_t *pkt)
 {
     snmp_packet_t *n;
-    snmp_varbind_t *vb, **nvb = NULL;
+    snmp_arena_t *arena;
+    snmp_var_bindings_t *vbl;
+    snmp_varbind_t *vb;
 
     n = snmp_pkt_new();
+    arena = n->arena;
     memcpy(n, pkt, sizeof(snmp_packet_t));
+    n->arena = arena;
     n->attr.flags |= SNMP_FLAG_DYNAMIC;
+    n->refcnt = 1;
 
-    n->snmp.community.value
-	= (unsigned char *) xmemdup(pkt->snmp.community.value, pkt->snmp.community.len);
-    n->snmp.community.attr.flags |= SNMP_FLAG_DYNAMIC;
-    
-    /* xxx more copying to be done here for SNMPv3 messages */
+    snmp_oid_set(arena, &n->snmp.scoped_pdu.pdu.enterprise,
+		 SNMP_OID_VALUE(&pkt->snmp.scoped_pdu.pdu.enterprise),
+		 pkt->snmp.scoped_pdu.pdu.enterprise.len);
 
     /*
      * Duplicate the varbind list.
      */
 
-    for (vb = pkt->snmp.scoped_pdu.pdu.varbindings.varbind,
-	     nvb = &n->snmp.scoped_pdu.pdu.varbindings.varbind;
-	 vb; vb = vb->next) {
-	*nvb = (snmp_varbind_t *) xmemdup(vb, sizeof(snmp_varbind_t));
-	(*nvb)->attr.flags |= SNMP_FLAG_DYNAMIC;
-	(*nvb)->name.attr.flags |= SNMP_FLAG_DYNAMIC;
-	(*nvb)->name.value = xmemdup(vb->name.value,
-				     vb->name.len * sizeof(uint32_t));
-	switch (vb->type) {
-	case SNMP_TYPE_OCTS:
-	    (*nvb)->value.octs.value = xmemdup(vb->value.octs.value,
-					       vb->value.octs.len);
-	    (*nvb)->value.octs.attr.flags |= SNMP_FLAG_DYNAMIC;
-	    break;
-	case SNMP_TYPE_OID:
-	    (*nvb)->value.oid.value = xmemdup(vb->value.oid.value,
-					      vb->value.oid.len * sizeof(uint32_t));
-	    (*nvb)->value.oid.attr.flags |= SNMP_FLAG_DYNAMIC;
+    vbl = &n->snmp.scoped_pdu.pdu.varbindings;
+    vbl->varbind = snmp_arena_memdup(arena, vbl->varbind,
+				     vbl->count * sizeof(snmp_varbind_t));
+    vbl->size = vbl->count;
+
+    SNMP_VBL_FOREACH(vbl, vb) {
+	snmp_oid_set(arena, &vb->name,
+		     SNMP_OID_VALUE(&vb->name), vb->name.len);
+	if (vb->type == SNMP_TYPE_OID) {
+	    snmp_oid_set(arena, &vb->value.oid,
+			 SNMP_OID_VALUE(&vb->value.oid), vb->value.oid.len);
 	}
-	nvb = &((*nvb)->next);
     }
 
+    snmp_pkt_detach(arena, n);
     return n;
 }
 
+/*
+ * Take a reference to a packet so that it can be kept after the
+ * callback returned. Dynamic packets are shared; octet strings still
+ * borrowed from the parser's input buffer are moved into the packet's
+ * arena first. Packets owned by the parsers have to be copied.
+ */
+
+snmp_packet_t*
+snmp_pkt_ref(snmp_packet_t *pkt)
+{
+    if (! pkt) {
+	return NULL;
+    }
+
+    if (! (pkt->attr.flags & SNMP_FLAG_DYNAMIC)) {
+	return snmp_pkt_copy(pkt);
+    }
+
+    if (pkt->attr.flags & SNMP_FLAG_BORROWED) {
+	snmp_pkt_detach(pkt->arena, pkt);
+    }
+    __sync_add_and_fetch(&pkt->refcnt, 1);
+    return pkt;
+}
+
+/*
+ * Return a packet that may be modified. A shared packet is copied and
+ * the copy has to be released by the caller with snmp_pkt_delete().
+ * Otherwise, the packet itself is returned, with octet strings still
+ * borrowed from the parser's input buffer (which may be read-only)
+ * moved into the packet's arena.
+ */
+
+snmp_packet_t*
+snmp_pkt_writable(snmp_packet_t *pkt)
+{
+    if (! pkt) {
+	return NULL;
+    }
+
+    if ((pkt->attr.flags & SNMP_FLAG_DYNAMIC)
+	&& __sync_add_and_fetch(&pkt->refcnt, 0) > 1) {
+	return snmp_pkt_copy(pkt);
+    }
+
+    if (pkt->attr.flags & SNMP_FLAG_BORROWED) {
+	snmp_pkt_detach(pkt->arena, pkt);
+    }
+    return pkt;
+}
+
+/*
+ * Return a cleared dynamic packet for the next message of a parser.
+ * The given packet is reused if nobody else holds a reference to it;
+ * otherwise the parser's reference is dropped and a new packet is
+ * allocated.
+ */
+
+snmp_packet_t*
+snmp_pkt_recycle(snmp_packet_t *pkt)
+{
+    snmp_arena_t *arena;
+
+    if (! pkt || __sync_add_and_fetch(&pkt->refcnt, 0) != 1) {
+	snmp_pkt_delete(pkt);
+	return snmp_pkt_new();
+    }
+
+    arena = pkt->arena;
+    snmp_arena_reset(arena);
+    memset(pkt, 0, sizeof(snmp_packet_t));
+    pkt->attr.flags |= SNMP_FLAG_DYNAMIC;
+    pkt->arena = arena;
+    pkt->refcnt = 1;
+    return pkt;
+}
+
+/*
+ * Release a reference to a packet created by snmp_pkt_new() or
+ * snmp_pkt_copy(). The packet is freed once the last reference is
+ * gone. Packets owned by the readers are left alone.
+ */
+
 void
 snmp_pkt_delete(snmp_packet_t *pkt)
 {
-    snmp_varbind_t *vb, *q;
-    
     if (! pkt || ! (pkt->attr.flags & SNMP_FLAG_DYNAMIC)) {
 	return;
     }
 
-    if (pkt->snmp.community.value
-	&& pkt->snmp.community.attr.flags & SNMP_FLAG_DYNAMIC) {
-	free(pkt->snmp.community.value);
-    }
-    
-    /* xxx more cleanup to be done here for SNMPv3 messages */
-
-    /*
-     * Delete the varbind list.
-     */
-
-    for (vb = pkt->snmp.scoped_pdu.pdu.varbindings.varbind; vb;) {
-	if (vb->name.attr.flags & SNMP_FLAG_DYNAMIC) {
-	    free(vb->name.value);
-	}
-	if (vb->type == SNMP_TYPE_OCTS
-	    && vb->value.octs.attr.flags & SNMP_FLAG_DYNAMIC) {
-	    free(vb->value.octs.value);
-	}
-	if (vb->type == SNMP_TYPE_OID
-	    && vb->value.oid.attr.flags & SNMP_FLAG_DYNAMIC) {
-	    free(vb->value.oid.value);
-	}
-	q = vb->next;
-	if (vb->attr.flags & SNMP_FLAG_DYNAMIC) {
-	    free(vb);
-	}
-	vb = q;
+    if (__sync_sub_and_fetch(&pkt->refcnt, 1) == 0) {
+	snmp_arena_delete(pkt->arena);
+	free(pkt);
     }
-    
-    free(pkt);
 }
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -31,6 +32,7 @@
 #define SNMP_FLAG_DADDR		0x0040
 #define SNMP_FLAG_DYNAMIC	0x8000
 #define SNMP_FLAG_USER		0x4000
+#define SNMP_FLAG_BORROWED	0x2000
 
 typedef struct {
     int      blen;	/* length of the BER encided TLV triple */
@@ -66,12 +68,23 @@ typedef struct {
     snmp_attr_t    attr;	/* attributes */
 } snmp_octs_t;
 
+/*
+ * OIDs with up to SNMP_OID_INLINE sub-identifiers are stored in the
+ * snmp_oid_t itself; only longer OIDs use separately allocated
+ * memory. Use SNMP_OID_VALUE() to access the sub-identifiers.
+ */
+
+#define SNMP_OID_INLINE		24
+
 typedef struct {
-    uint32_t    *value;		/* oid value (sequence of unsigned ints) */
+    uint32_t    *ext;		/* oid value if longer than SNMP_OID_INLINE */
+    uint32_t     sub[SNMP_OID_INLINE]; /* oid value if short enough */
     unsigned     len;		/* number of oids present */
     snmp_attr_t  attr;		/* attributes */
 } snmp_oid_t;
 
+#define SNMP_OID_VALUE(v)	((v)->ext ? (v)->ext : (v)->sub)
+
 typedef struct {
     in_addr_t	    value;	/* ip address value */
     snmp_attr_t     attr;	/* attributes */
@@ -109,7 +122,6 @@ typedef struct _snmp_varbind {
 	snmp_oid_t    oid;
 	snmp_ipaddr_t ip;
     } value;
-    struct _snmp_varbind *next;	/* next varbind (linked list) */
     snmp_attr_t		  attr;	/* attributes */
 				/* setting SNMP_FLAG_VALUE here indicates
 				 * that the type field is set, other fields
@@ -118,10 +130,20 @@ typedef struct _snmp_varbind {
 } snmp_varbind_t;
 
 typedef struct {
-    snmp_varbind_t *varbind;	/* linked list of varbinds */
+    snmp_varbind_t *varbind;	/* array of varbinds */
+    unsigned        count;	/* number of varbinds in the array */
+    unsigned        size;	/* number of varbinds allocated */
+    uint64_t        sig;	/* signature of the names, see snmp_vbl_sign() */
     snmp_attr_t     attr;	/* attributes */
 } snmp_var_bindings_t;
 
+/*
+ * Iterate over all varbinds of a varbind list in order.
+ */
+
+#define SNMP_VBL_FOREACH(vbl, vb) \
+    for ((vb) = (vbl)->varbind; (vb) < (vbl)->varbind + (vbl)->count; (vb)++)
+
 #define SNMP_PDU_GET		0x01
 #define SNMP_PDU_GETNEXT	0x02
 #define SNMP_PDU_GETBULK	0x03
@@ -182,6 +204,48 @@ typedef struct {
     snmp_attr_t	      attr;
 } snmp_snmp_t;
 
+/*
+ * Arena allocator for the data hanging off a packet. Everything
+ * allocated from an arena is released at once by resetting the arena.
+ */
+
+typedef struct _snmp_arena snmp_arena_t;
+
+snmp_arena_t* snmp_arena_new(void);
+void*	      snmp_arena_alloc(snmp_arena_t *arena, size_t size);
+void*	      snmp_arena_memdup(snmp_arena_t *arena,
+				const void *src, size_t len);
+void	      snmp_arena_reset(snmp_arena_t *arena);
+void	      snmp_arena_delete(snmp_arena_t *arena);
+
+/*
+ * Functions to set up the storage of an OID. Long OIDs are allocated
+ * from the arena, short ones use the inline storage.
+ */
+
+uint32_t*     snmp_oid_alloc(snmp_arena_t *arena, snmp_oid_t *v,
+			     unsigned size);
+void	      snmp_oid_set(snmp_arena_t *arena, snmp_oid_t *v,
+			   const uint32_t *value, unsigned len);
+
+/*
+ * Functions to add a zeroed varbind to a varbind list. The array
+ * grows from the arena as needed, which invalidates pointers to
+ * varbinds obtained earlier.
+ */
+
+snmp_varbind_t* snmp_vbl_append(snmp_arena_t *arena,
+				snmp_var_bindings_t *vbl);
+snmp_varbind_t* snmp_vbl_insert(snmp_arena_t *arena,
+				snmp_var_bindings_t *vbl, unsigned pos);
+
+/*
+ * Function to compute the signature of the varbind names. It has to
+ * be called again whenever the names of a varbind list are changed.
+ */
+
+void	      snmp_vbl_sign(snmp_var_bindings_t *vbl);
+
 typedef struct {
     snmp_uint32_t	time_sec;
     snmp_uint32_t	time_usec;
@@ -193,6 +257,8 @@ typedef struct {
     snmp_uint32_t	dst_port;
     snmp_snmp_t		snmp;
     snmp_attr_t		attr;
+    snmp_arena_t	*arena;	/* memory for varbinds, oids, ... */
+    unsigned		refcnt;	/* references to a dynamic packet */
 } snmp_packet_t;
 
 /*
@@ -201,10 +267,26 @@ typedef struct {
  * parsers and thus not something applications have to take care of.
  * Packets which are dynamically allocated have the SNMP_FLAG_DYNAMIC
  * set to distinguish them from packets allocated by the parsers.
+ * All memory referenced by a packet is allocated from the packet's
+ * arena, which is owned by the parser or, for dynamically allocated
+ * packets, by the packet itself. Packets with SNMP_FLAG_BORROWED set
+ * still have octet strings pointing into the parser's input buffer.
+ *
+ * Dynamically allocated packets are reference counted and treated as
+ * immutable once they are shared: snmp_pkt_ref() takes a reference
+ * (packets owned by the parsers are copied instead), snmp_pkt_delete()
+ * drops one, and snmp_pkt_writable() returns a private copy of a
+ * shared packet that has to be released with snmp_pkt_delete(), or
+ * the packet itself with all borrowed octet strings detached. The
+ * parsers hand out dynamic packets and use snmp_pkt_recycle() to
+ * reuse a packet unless the application kept a reference to it.
  */
 
 snmp_packet_t* snmp_pkt_new(void);
 snmp_packet_t* snmp_pkt_copy(snmp_packet_t *pkt);
+snmp_packet_t* snmp_pkt_ref(snmp_packet_t *pkt);
+snmp_packet_t* snmp_pkt_writable(snmp_packet_t *pkt);
+snmp_packet_t* snmp_pkt_recycle(snmp_packet_t *pkt);
 void           snmp_pkt_delete(snmp_packet_t *pkt);
 void	       snmp_pkt_v1tov2(snmp_packet_t *pkt);
 
@@ -215,6 +297,136 @@ void	       snmp_pkt_v1tov2(snmp_packet_t *pkt);
 
 typedef void (*snmp_callback)(snmp_packet_t *pkt, void *user_data);
 
+/*
+ * Output sinks. The writers append the serialized messages to the
+ * buffer of a sink, which is handed to a file descriptor or a stdio
+ * stream only when it is full or flushed. Sinks are not thread-safe.
+ */
+
+typedef struct _snmp_zip snmp_zip_t;
+
+typedef struct _snmp_sink {
+    char	*buf;
+    size_t	len;		/* bytes in use */
+    size_t	size;		/* bytes allocated */
+    int		fd;		/* -1 if writing to stream */
+    FILE	*stream;
+    int		error;		/* errno of the first failed write */
+    snmp_zip_t	*zip;		/* NULL if not compressing */
+} snmp_sink_t;
+
+#define SNMP_SINK_SIZE	(64 * 1024)
+
+snmp_sink_t* snmp_sink_new_fd(int fd, size_t size);
+snmp_sink_t* snmp_sink_new_stream(FILE *stream, size_t size);
+char*	      snmp_sink_grow(snmp_sink_t *sink, size_t len);
+void	      snmp_sink_spill(snmp_sink_t *sink, const void *data, size_t len);
+int	      snmp_sink_flush(snmp_sink_t *sink);
+int	      snmp_sink_delete(snmp_sink_t *sink);
+int	      snmp_sink_close(snmp_sink_t *sink);
+void	      snmp_sink_compress(snmp_sink_t *sink, int level);
+
+void	      snmp_sink_int64(snmp_sink_t *sink, int64_t v);
+void	      snmp_sink_uint64(snmp_sink_t *sink, uint64_t v);
+void	      snmp_sink_hex(snmp_sink_t *sink, const u_char *data, size_t len);
+void	      snmp_sink_oid(snmp_sink_t *sink,
+			    const uint32_t *value, unsigned len);
+void	      snmp_sink_ipv4(snmp_sink_t *sink, const void *addr);
+void	      snmp_sink_time(snmp_sink_t *sink, uint32_t sec, uint32_t usec);
+
+/*
+ * Block-parallel gzip compression used by compressing sinks. The
+ * worker threads are shared by all sinks and stopped by
+ * snmp_zip_done().
+ */
+
+#define SNMP_ZIP_BLOCK	(64 * 1024)	/* bytes compressed per block */
+
+struct iovec;
+typedef void (*snmp_zip_out)(void *ctx, const void *data, size_t len);
+
+snmp_zip_t*   snmp_zip_new(int level);
+void	      snmp_zip_write(snmp_zip_t *zip, const struct iovec *iov, int cnt,
+			     snmp_zip_out out, void *ctx);
+void	      snmp_zip_flush(snmp_zip_t *zip, int empty,
+			     snmp_zip_out out, void *ctx);
+void	      snmp_zip_delete(snmp_zip_t *zip);
+void	      snmp_zip_done(void);
+
+/*
+ * Formatting functions used by the writers. They write into the given
+ * buffer without a terminating NUL and return the number of bytes
+ * written.
+ */
+
+#define SNMP_FMT_UINT64_SIZE	20
+#define SNMP_FMT_INT64_SIZE	21
+#define SNMP_FMT_OID_SIZE(len)	((len) * 11)
+#define SNMP_FMT_IPV4_SIZE	16
+#define SNMP_FMT_TIME_SIZE	21
+
+size_t	      snmp_fmt_uint32(char *buf, uint32_t v);
+size_t	      snmp_fmt_uint64(char *buf, uint64_t v);
+size_t	      snmp_fmt_int64(char *buf, int64_t v);
+size_t	      snmp_fmt_oid(char *buf, const uint32_t *value, unsigned len);
+size_t	      snmp_fmt_ipv4(char *buf, const void *addr);
+size_t	      snmp_fmt_time(char *buf, uint32_t sec, uint32_t usec);
+
+/*
+ * Conversion of octet strings to and from pairs of hex digits.
+ */
+
+void	      snmp_hex_encode(char *dst, const u_char *src, size_t len);
+int	      snmp_hex_decode(u_char *dst, const char *src, size_t len);
+u_char*	      snmp_hex_dup(snmp_arena_t *arena, const char *str,
+			   unsigned *len);
+
+/*
+ * Return space for at least len bytes at the end of the buffer. The
+ * bytes actually used are accounted for with snmp_sink_commit().
+ */
+
+static inline char*
+snmp_sink_reserve(snmp_sink_t *sink, size_t len)
+{
+    if (sink->size - sink->len < len) {
+	return snmp_sink_grow(sink, len);
+    }
+    return sink->buf + sink->len;
+}
+
+static inline void
+snmp_sink_commit(snmp_sink_t *sink, size_t len)
+{
+    sink->len += len;
+}
+
+static inline void
+snmp_sink_write(snmp_sink_t *sink, const void *data, size_t len)
+{
+    if (sink->size - sink->len < len) {
+	snmp_sink_spill(sink, data, len);
+	return;
+    }
+    memcpy(sink->buf + sink->len, data, len);
+    sink->len += len;
+}
+
+static inline void
+snmp_sink_putc(snmp_sink_t *sink, char c)
+{
+    if (sink->len == sink->size) {
+	snmp_sink_grow(sink, 1);
+    }
+    sink->buf[sink->len++] = c;
+}
+
+static inline void
+snmp_sink_puts(snmp_sink_t *sink, const char *s)
+{
+    snmp_sink_write(sink, s, strlen(s));
+}
+
 /*
  * XML input and output functions.
  */
@@ -224,9 +436,9 @@ void snmp_xml_read_file(const char *file,
 void snmp_xml_read_stream(FILE *stream,
 			  snmp_callback func, void *user_data);
 
-void snmp_xml_write_stream_new(FILE *stream);
-void snmp_xml_write_stream_pkt(FILE *stream, snmp_packet_t *pkt);
-void snmp_xml_write_stream_end(FILE *stream);
+void snmp_xml_write_stream_new(snmp_sink_t *sink);
+void snmp_xml_write_stream_pkt(snmp_sink_t *sink, snmp_packet_t *pkt);
+void snmp_xml_write_stream_end(snmp_sink_t *sink);
 
 /*
  * PCAP input functions (we do not write pcap files)
@@ -238,6 +450,51 @@ void snmp_pcap_read_stream(FILE *stream, const char *filter,
 			   snmp_callback func, void *user_data);
 void snmp_pcap_read_life(const char *file,
 			 snmp_callback func, void *user_data);
+void snmp_pcap_set_threads(int n);
+void snmp_pcap_set_frag_memcap(size_t memcap);
+void snmp_pcap_set_frag_timeout(unsigned timeout);
+
+/*
+ * Interface for the reassembly of fragmented IPv4 and IPv6 datagrams
+ * used by the pcap input functions. The table never uses more memory
+ * than memcap bytes. Incomplete datagrams time out if no fragment has
+ * been seen for timeout seconds.
+ */
+
+typedef struct _snmp_frag_table snmp_frag_table_t;
+
+typedef struct {
+    uint64_t fragments;		/* fragments processed */
+    uint64_t completed;		/* datagrams reassembled */
+    uint64_t expired;		/* datagrams dropped due to the timeout */
+    uint64_t evicted;		/* datagrams dropped due to the memcap */
+    uint64_t overlaps;		/* fragments overlapping earlier data */
+    uint64_t invalid;		/* fragments with bogus offsets/lengths */
+    uint64_t pending;		/* datagrams still incomplete */
+} snmp_frag_stats_t;
+
+snmp_frag_table_t* snmp_frag_new(size_t memcap, unsigned timeout);
+u_char* snmp_frag_add(snmp_frag_table_t *t, int family,
+		      const u_char *src, const u_char *dst,
+		      uint32_t id, u_char proto,
+		      u_int offset, int more, const u_char *data, u_int len,
+		      time_t now, u_int *dlen);
+void snmp_frag_stats(snmp_frag_table_t *t, snmp_frag_stats_t *stats);
+void snmp_frag_delete(snmp_frag_table_t *t);
+
+/*
+ * Interface for the BER decoder used by the pcap input functions. A
+ * decoder context owns all state needed while decoding a message, so
+ * several threads can decode messages at the same time as long as
+ * each thread uses its own context.
+ */
+
+typedef struct _snmp_decoder snmp_decoder_t;
+
+snmp_decoder_t* snmp_decoder_new(snmp_callback func, void *user_data);
+void snmp_parse(snmp_decoder_t *ctx, const u_char *buf, u_int len,
+		snmp_packet_t *pkt);
+void snmp_decoder_delete(snmp_decoder_t *ctx);
 
 /*
  * CSV input functions.
@@ -252,9 +509,9 @@ void snmp_csv_read_stream(FILE *stream,
  * CSV output functions (we do not read CVS files)
  */
 
-void snmp_csv_write_stream_new(FILE *stream);
-void snmp_csv_write_stream_pkt(FILE *stream, snmp_packet_t *pkt);
-void snmp_csv_write_stream_end(FILE *stream);
+void snmp_csv_write_stream_new(snmp_sink_t *sink);
+void snmp_csv_write_stream_pkt(snmp_sink_t *sink, snmp_packet_t *pkt);
+void snmp_csv_write_stream_end(snmp_sink_t *sink);
 
 /*
  * Interface for SNMP flows. We encapsulate the write functions into a
@@ -263,13 +520,20 @@ void snmp_csv_write_stream_end(FILE *stream);
  */
 
 typedef struct _snmp_write {
-    FILE *stream;
-    void (*write_new) (FILE *stream);
-    void (*write_pkt) (FILE *stream, snmp_packet_t *pkt);
-    void (*write_end) (FILE *stream);
+    snmp_sink_t *sink;
+    void (*write_new) (snmp_sink_t *sink);
+    void (*write_pkt) (snmp_sink_t *sink, snmp_packet_t *pkt);
+    void (*write_end) (snmp_sink_t *sink);
     const char *path;
     const char *prefix;
     const char *ext;
+    unsigned window;		/* seconds requests wait for responses */
+    unsigned idle;		/* seconds until idle flows expire, 0 = never */
+    unsigned shards;		/* threads splitting flows, 0 = none */
+    int gzip;			/* gzip level of flow files, 0 = none */
+    unsigned batch;		/* messages written at once, 0 = none */
+    size_t batch_bytes;		/* size limit of a batch, 0 = none */
+    struct _snmp_shards *state;	/* private state of the flow writers */
 } snmp_write_t;
 
 void snmp_flow_init(snmp_write_t *out);
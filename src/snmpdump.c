@@ -28,6 +28,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <regex.h>
 #include <smi.h>
@@ -71,6 +73,7 @@ static void
 print(snmp_packet_t *pkt, void *user_data)
 {
     callback_state_t *state = (callback_state_t *) user_data;
+    snmp_packet_t *orig = pkt;
 
     if (! state) {
 	return;
@@ -85,12 +88,21 @@ print(snmp_packet_t *pkt, void *user_data)
 	    state->do_flow_done(&state->out);
 	    return;
 	}
-	if (state->cnt && state->out.write_end && state->out.stream) {
-	    state->out.write_end(state->out.stream);
+	if (state->cnt && state->out.write_end && state->out.sink) {
+	    state->out.write_end(state->out.sink);
 	}
 	return;
     }
 
+    /* The filters, the conversion and the anonymization modify the
+     * packet, so we need a private copy if the packet is shared.
+     */
+
+    if ((state->filter && state->do_filter)
+	|| (state->flags & STATE_FLAG_V1V2) || state->do_anon) {
+	pkt = snmp_pkt_writable(pkt);
+    }
+
     /* First apply the filters. Then call the anonymization module. We
      * might have to call it twice for learning purposes.
      */
@@ -126,7 +138,7 @@ print(snmp_packet_t *pkt, void *user_data)
 
     if (state->do_flow_write) {
 	state->do_flow_write(&state->out, pkt);
-	if (state->flags & STATE_FLAG_V1V2) {
+	if (pkt != orig) {
 	    snmp_pkt_delete(pkt);
 	}
 	return;
@@ -136,35 +148,149 @@ print(snmp_packet_t *pkt, void *user_data)
      * print the packet.
      */
 
-    if (state->cnt == 0 && state->out.stream && state->out.write_new) {
-	state->out.write_new(state->out.stream);
+    if (state->cnt == 0 && state->out.sink && state->out.write_new) {
+	state->out.write_new(state->out.sink);
     }
 
-    if (state->out.stream && state->out.write_pkt) {
-	state->out.write_pkt(state->out.stream, pkt);
+    if (state->out.sink && state->out.write_pkt) {
+	state->out.write_pkt(state->out.sink, pkt);
     }
     state->cnt++;
 
-    if (state->flags & STATE_FLAG_V1V2) {
+    if (pkt != orig) {
 	snmp_pkt_delete(pkt);
     }
 }
 
 
+/*
+ * Print the usage summary. The summary goes to standard error and the
+ * program exits with an error if the command line is invalid.
+ */
+
+static void
+usage(FILE *stream)
+{
+    fprintf(stream, "%s [-c config] [-m module] [-f filter] [-i format] [-o format] [-z regex] [-p passphrase] [-w file] [-h] [-V] [-F] [-S] [-C path] [-P prefix] [-W seconds] [-I seconds] [-J threads] [-B count[:bytes]] [-Z gzip[:level]] [-j threads] [-M memcap] [-T timeout] [-a] file ... \n", progname);
+}
+
+static void
+bad_argument(int opt, const char *arg)
+{
+    fprintf(stderr, "%s: invalid argument for -%c: %s\n",
+	    progname, opt, arg);
+    usage(stderr);
+    exit(1);
+}
+
+/*
+ * Parse the positive decimal number at the beginning of an argument
+ * of option opt. Signs, zero and values larger than max are rejected.
+ * The number must be followed by the end of the argument or by one of
+ * the characters in stop.
+ */
+
+static unsigned long
+parse_ulong(int opt, const char *arg, const char *begin,
+	    unsigned long max, const char *stop, char **end)
+{
+    unsigned long v;
+
+    if (! isdigit((unsigned char) *begin)) {
+	bad_argument(opt, arg);
+    }
+    errno = 0;
+    v = strtoul(begin, end, 10);
+    if (errno || v == 0 || v > max
+	|| (**end && ! strchr(stop, **end))) {
+	bad_argument(opt, arg);
+    }
+    return v;
+}
+
+static unsigned
+parse_count(int opt, const char *arg)
+{
+    char *end;
+
+    return parse_ulong(opt, arg, arg, INT_MAX, "", &end);
+}
+
+/*
+ * Parse a size argument which may carry a k, m or g suffix.
+ */
+
+static size_t
+parse_size(int opt, const char *arg, const char *begin)
+{
+    char *end;
+    size_t size, unit = 1;
+
+    size = parse_ulong(opt, arg, begin, ULONG_MAX, "kKmMgG", &end);
+    switch (*end) {
+    case 'g':
+    case 'G':
+	unit *= 1024;
+	/* fall through */
+    case 'm':
+    case 'M':
+	unit *= 1024;
+	/* fall through */
+    case 'k':
+    case 'K':
+	unit *= 1024;
+	end++;
+	break;
+    }
+    if (*end || size > (size_t) -1 / unit) {
+	bad_argument(opt, arg);
+    }
+    return size * unit;
+}
+
+/*
+ * Parse a compression argument of the form format[:level] and return
+ * the compression level. Only gzip is supported.
+ */
+
+static int
+parse_compression(const char *arg)
+{
+    const char *colon = strchr(arg, ':');
+    size_t len = colon ? (size_t) (colon - arg) : strlen(arg);
+    char *end;
+    int level = 6;
+
+    if (len != 4 || strncmp(arg, "gzip", 4) != 0) {
+	fprintf(stderr, "%s: unsupported compression format %.*s\n",
+		progname, (int) len, arg);
+	exit(1);
+    }
+    if (colon) {
+	level = parse_ulong('Z', arg, colon + 1, 9, "", &end);
+    }
+    return level;
+}
+
 /*
  * The main function to parse arguments, initialize the libraries and
- * to fire off the libnids library using nids_run() for every input
- * file we process.
+ * to run the reader for every input file we process.
  */
 
 int
 main(int argc, char **argv)
 {
-    int i, c;
+    int i, c, rc = 0;
     char *expr = NULL, *path = NULL, *prefix = NULL;
+    unsigned window = 0;
+    unsigned idle = 0;
+    unsigned shards = 0;
+    unsigned batch = 0;
+    size_t batch_bytes = 0;
+    int gzip = 0;
     output_t output = OUTPUT_XML;
     input_t input = INPUT_PCAP;
-    char *errmsg;
+    char *errmsg, *end;
     anon_key_t *key = NULL;
     callback_state_t _state, *state = &_state;
     FILE *stream = stdout;
@@ -176,7 +302,7 @@ main(int argc, char **argv)
     key = anon_key_new();
     anon_key_set_random(key);
 
-    while ((c = getopt(argc, argv, "FSVz:f:w:i:o:c:m:hap:tC:P:")) != -1) {
+    while ((c = getopt(argc, argv, "FSVz:f:w:i:o:c:m:hap:tC:P:W:I:J:B:Z:j:M:T:")) != -1) {
 	switch (c) {
 	case 'a':
 	    state->do_anon = snmp_anon_apply;
@@ -226,6 +352,24 @@ main(int argc, char **argv)
 	case 'P':
 	    prefix = optarg;
 	    break;
+	case 'W':
+	    window = parse_count(c, optarg);
+	    break;
+	case 'I':
+	    idle = parse_count(c, optarg);
+	    break;
+	case 'J':
+	    shards = parse_count(c, optarg);
+	    break;
+	case 'Z':
+	    gzip = parse_compression(optarg);
+	    break;
+	case 'B':
+	    batch = parse_ulong(c, optarg, optarg, INT_MAX, ":", &end);
+	    if (*end == ':') {
+		batch_bytes = parse_size(c, optarg, end + 1);
+	    }
+	    break;
 	case 't':
 	    state->flags |= STATE_FLAG_V1V2;
 	    break;
@@ -249,22 +393,40 @@ main(int argc, char **argv)
 	    state->do_flow_write = snmp_slice_write;
 	    state->do_flow_done = snmp_slice_done;
 	    break;
+	case 'j':
+	    snmp_pcap_set_threads(parse_count(c, optarg));
+	    break;
+	case 'M':
+	    snmp_pcap_set_frag_memcap(parse_size(c, optarg, optarg));
+	    break;
+	case 'T':
+	    snmp_pcap_set_frag_timeout(parse_count(c, optarg));
+	    break;
 	case 'V':
 	    printf("%s %s\n", progname, VERSION);
 	    exit(0);
 	case 'h':
 	case '?':
-	    printf("%s [-c config] [-m module] [-f filter] [-i format] [-o format] [-z regex] [-p passphrase] [-w file] [-h] [-V] [-F] [-S] [-C path] [-P prefix] [-a] file ... \n", progname);
+	    usage(stdout);
 	    exit(0);
 	}
     }
 
-    state->out.stream = stream;
+    state->out.sink = snmp_sink_new_stream(stream, SNMP_SINK_SIZE);
+    if (gzip) {
+	snmp_sink_compress(state->out.sink, gzip);
+    }
     state->out.write_new = NULL;
     state->out.write_pkt = NULL;
     state->out.write_end = NULL;
     state->out.path = path;
     state->out.prefix = prefix;
+    state->out.window = window;
+    state->out.idle = idle;
+    state->out.shards = shards;
+    state->out.gzip = gzip;
+    state->out.batch = batch;
+    state->out.batch_bytes = batch_bytes;
 
     if (state->do_anon) {
 	anon_init(key);
@@ -317,6 +479,13 @@ main(int argc, char **argv)
     }
     print(NULL, state);
 
+    if (snmp_sink_delete(state->out.sink)) {
+	fprintf(stderr, "%s: error writing output: %s\n",
+		progname, strerror(errno));
+	rc = 1;
+    }
+    snmp_zip_done();
+
     if (state->do_anon) {
 	anon_done();
     }
@@ -329,5 +498,5 @@ main(int argc, char **argv)
 	anon_key_delete(key);
     }
 
-    return 0;
+    return rc;
 }
@@ -112,50 +112,6 @@ UTF8atoi(const xmlChar* xmlstr) {
 }
 */
 
-/*
- * deallocate memory for a filled-in snmp_packet_t
- */
-void
-snmp_packet_free(snmp_packet_t* packet) {
-    snmp_varbind_t *varbind, *next;
-    assert(packet);
-    /* free varbinds */
-    next = packet->snmp.scoped_pdu.pdu.varbindings.varbind;
-    while (next) {
-	varbind = next;
-	//DEBUG("freeing... varbind: %x\n", varbind);
-	if (varbind->name.value) {
-	    free(varbind->name.value);
-	}
-	switch (varbind->type) {
-	case SNMP_TYPE_OCTS:
-	    if (varbind->value.octs.value) {
-		free(varbind->value.octs.value);
-	    }
-	    break;
-	case SNMP_TYPE_OID:
-	    if (varbind->value.oid.value) {
-		free(varbind->value.oid.value);
-	    }
-	    break;
-	case SNMP_TYPE_OPAQUE:
-	    if (varbind->value.octs.value) {
-		free(varbind->value.octs.value);
-	    }
-	    break;
-	default:
-	    break;
-	}
-	next = next->next;
-	free(varbind);
-    }
-    /* free community string */
-    if ((packet->snmp.community.attr.flags & SNMP_FLAG_VALUE)
-	&& packet->snmp.community.value) {
-	xmlFree(packet->snmp.community.value);
-    }
-}
-
 /*
  * just set the state
  * could evolve into some error-checking and state-keeping fct
@@ -234,70 +190,17 @@ process_snmp_ipaddr(xmlTextReaderPtr reader, snmp_ipaddr_t* snmpaddr) {
     }
 }
 
-/* helper function for dehexify */
-static int
-char_to_i(char c){
-    int n = c;
-    if (n >= '0' && n <= '9') {
-	n -= '0';
-    } else if (n >= 'a' && n <= 'f') {
-	n -= 'a' - 10;
-    } else if (n >= 'A' && n <= 'F') {
-	n -= 'A' - 10;
-    } else {
-	n = -1;
-    }
-    return n;
-}
-
-/*
- * convert octet string into string (i.e. xml -> pcap)
- * fills in length
- * returned buffer is NOT null-terminated and may contain \0 at any position
- * user has to deallocate returned buffer
- */
-static unsigned char*
-dehexify(const char *str, unsigned *length) {
-    static size_t size = 0; /* buffer size, i.e. length of output 
-			     * which is strlen(str)/2
-			     */
-    static unsigned char *buffer = NULL;
-    int i;
-    int tmp, tmp2;
-    
-    if (strlen(str)%2 != 0) {
-	/* octet string implies pairs of hex numbers */
-	return NULL;
-    }
-    size = strlen(str)/2;
-    assert(size);
-    buffer = malloc(size);
-    assert(buffer);
-    memset(buffer, 0, size);
-    for (i = 0; i < size; i++) {
-	tmp = char_to_i(str[2*i]);
-	tmp2 = char_to_i(str[2*i+1]);
-	if (tmp < 0 || tmp2 < 0) {
-	    /* encountered invalid character */
-	    free(buffer);
-	    return NULL;
-	}
-	buffer[i] = tmp*16 + tmp2;
-    }
-    *length = size;
-    DEBUG("dehexify(%s): %s\n", str, buffer);
-    return buffer;
-}
-
 /*
  * parse node currently in reader for snmp_octs_t
  */
 static void
-process_snmp_octs(xmlTextReaderPtr reader, snmp_octs_t* snmpstr) {
+process_snmp_octs(xmlTextReaderPtr reader, snmp_arena_t *arena,
+		  snmp_octs_t* snmpstr) {
     assert(snmpstr);
     const xmlChar* value = xmlTextReaderConstValue(reader);
     if (value) {
-	snmpstr->value = dehexify((const char *) value, &snmpstr->len);
+	snmpstr->value = snmp_hex_dup(arena, (const char *) value,
+				      &snmpstr->len);
 	if (snmpstr->value)
 	    snmpstr->attr.flags |= SNMP_FLAG_VALUE;
     }
@@ -325,30 +228,30 @@ count_snmp_oid(const char* value) {
  * parse node currently in reader for snmp_oid_t
  */
 static void
-process_snmp_oid(xmlTextReaderPtr reader, snmp_oid_t* snmpoid) {
+process_snmp_oid(xmlTextReaderPtr reader, snmp_arena_t *arena,
+		 snmp_oid_t* snmpoid) {
     int i;
     char *end;
     int count = 0;
+    uint32_t *oid;
     assert(snmpoid);
     const xmlChar* value = xmlTextReaderConstValue(reader);
     count = count_snmp_oid((const char*) value);
     if (value && count > 0) {
-	snmpoid->value = malloc(sizeof(uint32_t)*count);
-	assert(snmpoid->value);
-	memset(snmpoid->value, 0, sizeof(uint32_t)*count);
+	oid = snmp_oid_alloc(arena, snmpoid, count);
 	snmpoid->len = count;
 
-	snmpoid->value[0] = (uint32_t) strtoul((const char *) value, &end, 10);
+	oid[0] = (uint32_t) strtoul((const char *) value, &end, 10);
 	if (*end == '\0' || *end == '.') {
-	    if (!(snmpoid->value[0] >= 0 && snmpoid->value[0] <= 2)) {
+	    if (!(oid[0] >= 0 && oid[0] <= 2)) {
 		ERROR("warning: oid first value %d should be in  0..2\n",
-		      snmpoid->value[0]);
+		      oid[0]);
 	    }
 	}
 	for(i=1;i<count && *end == '.';i++) {
 	    value = (xmlChar*) end+1;
 	    //end = NULL;
-	    snmpoid->value[i] = (uint32_t) strtoul((const char *) value, &end, 10);
+	    oid[i] = (uint32_t) strtoul((const char *) value, &end, 10);
 	}
 	
 	if (*end == '\0' && *value != '\0') {
@@ -389,9 +292,10 @@ process_snmp_attr(xmlTextReaderPtr reader, snmp_attr_t* attr) {
  * when end of "packet" xml node is reached, callback function is called
  */
 static void
-process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
+process_node(xmlTextReaderPtr reader, snmp_packet_t** packetp,
 	     snmp_varbind_t** varbind, snmp_callback func, void *user_data) {
     const xmlChar *name, *value;
+    snmp_packet_t *packet = *packetp;
 
     assert(packet);
     /* 1, 3, 8, 14, 15 */
@@ -411,7 +315,7 @@ process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
 	if (name && xmlStrcmp(name, BAD_CAST("packet")) == 0) {
 	    DEBUG("in PACKET\n");
 	    set_state(IN_PACKET);
-	    memset(packet, 0, sizeof(snmp_packet_t));
+	    packet = *packetp = snmp_pkt_recycle(packet);
 	    *varbind = NULL;
 	    /* no attributes */
 	    packet->attr.flags |= SNMP_FLAG_VALUE;
@@ -591,17 +495,8 @@ process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
 	/* varbind */
 	} else if (name && xmlStrcmp(name, BAD_CAST("varbind")) == 0) {
 	    set_state(IN_VARBIND);
-	    if (*varbind != NULL) {
-		(*varbind)->next =
-		    (snmp_varbind_t*) malloc(sizeof(snmp_varbind_t));
-		*varbind = (*varbind)->next;
-	    } else {
-		*varbind = (snmp_varbind_t*) malloc(sizeof(snmp_varbind_t));
-		packet->snmp.scoped_pdu.pdu.varbindings.varbind = *varbind;
-	    }
-	    assert(*varbind);
-	    memset(*varbind,0,sizeof(snmp_varbind_t));
-	    //DEBUG("malloc... *varbind: %x\n", *varbind);
+	    *varbind = snmp_vbl_append(packet->arena,
+			&packet->snmp.scoped_pdu.pdu.varbindings);
 	    /* attributes */
 	    /* blen, vlen */
 	    process_snmp_attr(reader, &(*varbind)->attr);
@@ -923,10 +818,10 @@ process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
 	    }
 	    break;
 	case IN_COMMUNITY:
-	    process_snmp_octs(reader, &(packet->snmp.community));
+	    process_snmp_octs(reader, packet->arena, &(packet->snmp.community));
 	    break;
 	case IN_ENTERPRISE:
-	    process_snmp_oid(reader, &(packet->snmp.scoped_pdu.pdu.enterprise));
+	    process_snmp_oid(reader, packet->arena, &(packet->snmp.scoped_pdu.pdu.enterprise));
 	    break;
 	case IN_AGENT_ADDR:
 	    process_snmp_ipaddr(reader,
@@ -953,7 +848,7 @@ process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
 	/* varbind */
 	case IN_NAME:
 	    assert(*varbind);
-	    process_snmp_oid(reader, &((*varbind)->name));
+	    process_snmp_oid(reader, packet->arena, &((*varbind)->name));
 	    break;
 	case IN_INTEGER32:
 	    assert(*varbind);
@@ -988,17 +883,17 @@ process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
 	case IN_OCTET_STRING:
 	    assert(*varbind);
 	    assert((*varbind)->type == SNMP_TYPE_OCTS);
-	    process_snmp_octs(reader, &((*varbind)->value.octs));
+	    process_snmp_octs(reader, packet->arena, &((*varbind)->value.octs));
 	    break;
 	case IN_OBJECT_IDENTIFIER:
 	    assert(*varbind);
 	    assert((*varbind)->type == SNMP_TYPE_OID);
-	    process_snmp_oid(reader, &((*varbind)->value.oid));
+	    process_snmp_oid(reader, packet->arena, &((*varbind)->value.oid));
 	    break;
 	case IN_OPAQUE:
 	    assert(*varbind);
 	    assert((*varbind)->type == SNMP_TYPE_OPAQUE);
-	    process_snmp_octs(reader, &((*varbind)->value.octs));
+	    process_snmp_octs(reader, packet->arena, &((*varbind)->value.octs));
 	    break;
 	/* snmpv3 */
 	case IN_MSG_ID:
@@ -1008,13 +903,13 @@ process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
 	    process_snmp_uint32(reader, &(packet->snmp.message.msg_max_size));
 	    break;
 	case IN_FLAGS:
-	    process_snmp_octs(reader, &(packet->snmp.message.msg_flags));
+	    process_snmp_octs(reader, packet->arena, &(packet->snmp.message.msg_flags));
 	    break;
 	case IN_SEC_MODEL:
 	    process_snmp_uint32(reader, &(packet->snmp.message.msg_sec_model));
 	    break;
 	case IN_AUTH_ENGINE_ID:
-	    process_snmp_octs(reader, &(packet->snmp.usm.
+	    process_snmp_octs(reader, packet->arena, &(packet->snmp.usm.
 					auth_engine_id));
 	    break;
 	case IN_AUTH_ENGINE_BOOTS:
@@ -1026,22 +921,22 @@ process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
 				    auth_engine_time));
 	    break;
 	case IN_USER:
-	    process_snmp_octs(reader, &(packet->snmp.usm.user));
+	    process_snmp_octs(reader, packet->arena, &(packet->snmp.usm.user));
 	    break;
 	case IN_AUTH_PARAMS:
-	    process_snmp_octs(reader, &(packet->snmp.usm.
+	    process_snmp_octs(reader, packet->arena, &(packet->snmp.usm.
 					auth_params));
 	    break;
 	case IN_PRIV_PARAMS:
-	    process_snmp_octs(reader, &(packet->snmp.usm.
+	    process_snmp_octs(reader, packet->arena, &(packet->snmp.usm.
 					priv_params));
 	    break;
 	case IN_CONTEXT_ENGINE_ID:
-	    process_snmp_octs(reader, &(packet->snmp.scoped_pdu.
+	    process_snmp_octs(reader, packet->arena, &(packet->snmp.scoped_pdu.
 				    context_engine_id));
 	    break;
 	case IN_CONTEXT_NAME:
-	    process_snmp_octs(reader, &(packet->snmp.scoped_pdu.
+	    process_snmp_octs(reader, packet->arena, &(packet->snmp.scoped_pdu.
 				    context_name));
 	    break;
 	}
@@ -1058,8 +953,8 @@ process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
 	if (name && xmlStrcmp(name, BAD_CAST("packet")) == 0) {
 	    // call calback function and give it filled-in snmp_packet_t object
 	    DEBUG("out PACKET\n");
+	    snmp_vbl_sign(&packet->snmp.scoped_pdu.pdu.varbindings);
 	    func(packet, user_data);
-	    snmp_packet_free(packet);
 	}
 	break;
     default:
@@ -1097,9 +992,11 @@ process_node(xmlTextReaderPtr reader, snmp_packet_t* packet,
 static void
 process_reader(xmlTextReaderPtr reader, snmp_callback func, void *user_data)
 {
-    snmp_packet_t packet;
+    snmp_packet_t *packet;
     snmp_varbind_t *varbind = NULL;
     int ret;
+
+    packet = snmp_pkt_new();
 	
     ret = xmlTextReaderRead(reader);
     while (ret == 1) {
@@ -1107,6 +1004,7 @@ process_reader(xmlTextReaderPtr reader, snmp_callback func, void *user_data)
 	ret = xmlTextReaderRead(reader);
     }
     xmlFreeTextReader(reader);
+    snmp_pkt_delete(packet);
     if (ret != 0) {
 	fprintf(stderr, "xmlTextReaderRead: failed to parse\n");
 	//return -2;
@@ -16,401 +16,492 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <string.h>
 
 
+/*
+ * The start and end tags of all elements are kept as constant byte
+ * fragments so that they can be copied into the output buffer in one
+ * go. The start tag includes the closing '>', which is left out if
+ * attributes follow.
+ */
+
+typedef struct {
+    const char	*open;		/* "<name>" */
+    size_t	open_len;
+    const char	*close;		/* "</name>" */
+    size_t	close_len;
+} xml_tag_t;
+
+#define XML_TAG(var, name) \
+    static const xml_tag_t var = \
+	{ "<" name ">", sizeof(name) + 1, "</" name ">", sizeof(name) + 2 }
+
+XML_TAG(xml_tag_time_sec, "time-sec");
+XML_TAG(xml_tag_time_usec, "time-usec");
+XML_TAG(xml_tag_src_ip, "src-ip");
+XML_TAG(xml_tag_src_port, "src-port");
+XML_TAG(xml_tag_dst_ip, "dst-ip");
+XML_TAG(xml_tag_dst_port, "dst-port");
+XML_TAG(xml_tag_snmp, "snmp");
+XML_TAG(xml_tag_version, "version");
+XML_TAG(xml_tag_community, "community");
+XML_TAG(xml_tag_message, "message");
+XML_TAG(xml_tag_msg_id, "msg-id");
+XML_TAG(xml_tag_max_size, "max-size");
+XML_TAG(xml_tag_flags, "flags");
+XML_TAG(xml_tag_security_model, "security-model");
+XML_TAG(xml_tag_usm, "usm");
+XML_TAG(xml_tag_auth_engine_id, "auth-engine-id");
+XML_TAG(xml_tag_auth_engine_boots, "auth-engine-boots");
+XML_TAG(xml_tag_auth_engine_time, "auth-engine-time");
+XML_TAG(xml_tag_user, "user");
+XML_TAG(xml_tag_auth_params, "auth-params");
+XML_TAG(xml_tag_priv_params, "priv-params");
+XML_TAG(xml_tag_scoped_pdu, "scoped-pdu");
+XML_TAG(xml_tag_context_engine_id, "context-engine-id");
+XML_TAG(xml_tag_context_name, "context-name");
+XML_TAG(xml_tag_get_request, "get-request");
+XML_TAG(xml_tag_get_next_request, "get-next-request");
+XML_TAG(xml_tag_get_bulk_request, "get-bulk-request");
+XML_TAG(xml_tag_set_request, "set-request");
+XML_TAG(xml_tag_response, "response");
+XML_TAG(xml_tag_trap, "trap");
+XML_TAG(xml_tag_snmpV2_trap, "snmpV2-trap");
+XML_TAG(xml_tag_inform_request, "inform-request");
+XML_TAG(xml_tag_report, "report");
+XML_TAG(xml_tag_request_id, "request-id");
+XML_TAG(xml_tag_error_status, "error-status");
+XML_TAG(xml_tag_error_index, "error-index");
+XML_TAG(xml_tag_enterprise, "enterprise");
+XML_TAG(xml_tag_agent_addr, "agent-addr");
+XML_TAG(xml_tag_generic_trap, "generic-trap");
+XML_TAG(xml_tag_specific_trap, "specific-trap");
+XML_TAG(xml_tag_time_stamp, "time-stamp");
+XML_TAG(xml_tag_variable_bindings, "variable-bindings");
+XML_TAG(xml_tag_varbind, "varbind");
+XML_TAG(xml_tag_name, "name");
+XML_TAG(xml_tag_null, "null");
+XML_TAG(xml_tag_integer32, "integer32");
+XML_TAG(xml_tag_unsigned32, "unsigned32");
+XML_TAG(xml_tag_counter32, "counter32");
+XML_TAG(xml_tag_timeticks, "timeticks");
+XML_TAG(xml_tag_counter64, "counter64");
+XML_TAG(xml_tag_ipaddress, "ipaddress");
+XML_TAG(xml_tag_octet_string, "octet-string");
+XML_TAG(xml_tag_object_identifier, "object-identifier");
+XML_TAG(xml_tag_opaque, "opaque");
+XML_TAG(xml_tag_no_such_object, "no-such-object");
+XML_TAG(xml_tag_no_such_instance, "no-such-instance");
+XML_TAG(xml_tag_end_of_mib_view, "end-of-mib-view");
+
+/* Unknown PDU types used to come out as "(null)" elements. */
+
+XML_TAG(xml_tag_null_pdu, "(null)");
+
+#define XML_ATTR_SIZE	(2 * (sizeof(" blen=\"\"") - 1 + SNMP_FMT_INT64_SIZE))
+
 static inline void
-xml_write_attr(FILE *stream, snmp_attr_t *attr)
+xml_write_attr(snmp_sink_t *sink, snmp_attr_t *attr)
 {
+    char *p, *q;
+
+    p = q = snmp_sink_reserve(sink, XML_ATTR_SIZE);
     if (attr->flags & SNMP_FLAG_BLEN) {
-	fprintf(stream, " blen=\"%d\"", attr->blen);
+	memcpy(q, " blen=\"", 7);
+	q += 7;
+	q += snmp_fmt_int64(q, attr->blen);
+	*q++ = '"';
     }
     if (attr->flags & SNMP_FLAG_VLEN) {
-	fprintf(stream, " vlen=\"%d\"", attr->vlen);
+	memcpy(q, " vlen=\"", 7);
+	q += 7;
+	q += snmp_fmt_int64(q, attr->vlen);
+	*q++ = '"';
     }
+    snmp_sink_commit(sink, q - p);
 }
 
 
 static inline void
-xml_write_open(FILE *stream, const char *name, snmp_attr_t *attr)
+xml_write_open(snmp_sink_t *sink, const xml_tag_t *tag, snmp_attr_t *attr)
 {
-    fprintf(stream, "<%s", name);
-    xml_write_attr(stream, attr);
-    fprintf(stream, ">");
+    if (! (attr->flags & (SNMP_FLAG_BLEN | SNMP_FLAG_VLEN))) {
+	snmp_sink_write(sink, tag->open, tag->open_len);
+	return;
+    }
+    snmp_sink_write(sink, tag->open, tag->open_len - 1);
+    xml_write_attr(sink, attr);
+    snmp_sink_putc(sink, '>');
 }
 
 
 static inline void
-xml_write_close(FILE *stream, const char *name)
+xml_write_close(snmp_sink_t *sink, const xml_tag_t *tag)
 {
-    fprintf(stream, "</%s>", name);
+    snmp_sink_write(sink, tag->close, tag->close_len);
 }
 
 
 static void
-xml_write_null(FILE *stream, char *name, snmp_null_t *v)
+xml_write_null(snmp_sink_t *sink, const xml_tag_t *tag, snmp_null_t *v)
 {
-    fprintf(stream, "<%s", name);
-    xml_write_attr(stream, &v->attr);
-    fprintf(stream, "/>");
+    snmp_sink_write(sink, tag->open, tag->open_len - 1);
+    xml_write_attr(sink, &v->attr);
+    snmp_sink_write(sink, "/>", 2);
 }
 
 
 static void
-xml_write_int32(FILE *stream, const char *name, snmp_int32_t *v)
+xml_write_int32(snmp_sink_t *sink, const xml_tag_t *tag, snmp_int32_t *v)
 {
-    xml_write_open(stream, name, &v->attr);
+    xml_write_open(sink, tag, &v->attr);
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	fprintf(stream, "%"PRId32, v->value);
+	snmp_sink_int64(sink, v->value);
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_uint32(FILE *stream, const char *name, snmp_uint32_t *v)
+xml_write_uint32(snmp_sink_t *sink, const xml_tag_t *tag, snmp_uint32_t *v)
 {
-    xml_write_open(stream, name, &v->attr);
+    xml_write_open(sink, tag, &v->attr);
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	fprintf(stream, "%"PRIu32, v->value);
+	snmp_sink_uint64(sink, v->value);
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_uint64(FILE *stream, const char *name, snmp_uint64_t *v)
+xml_write_uint64(snmp_sink_t *sink, const xml_tag_t *tag, snmp_uint64_t *v)
 {
-    xml_write_open(stream, name, &v->attr);
+    xml_write_open(sink, tag, &v->attr);
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	fprintf(stream, "%"PRIu64, v->value);
+	snmp_sink_uint64(sink, v->value);
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_ipaddr(FILE *stream, const char *name, snmp_ipaddr_t *v)
+xml_write_ipaddr(snmp_sink_t *sink, const xml_tag_t *tag, snmp_ipaddr_t *v)
 {
-    char buffer[INET_ADDRSTRLEN];
-
-    xml_write_open(stream, name, &v->attr);
+    xml_write_open(sink, tag, &v->attr);
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	if (inet_ntop(AF_INET, &v->value, buffer, sizeof(buffer))) {
-	    fprintf(stream, "%s", buffer);
-	}
+	snmp_sink_ipv4(sink, &v->value);
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_ip6addr(FILE *stream, const char *name, snmp_ip6addr_t *v)
+xml_write_ip6addr(snmp_sink_t *sink, const xml_tag_t *tag, snmp_ip6addr_t *v)
 {
     char buffer[INET6_ADDRSTRLEN];
 
-    xml_write_open(stream, name, &v->attr);
+    xml_write_open(sink, tag, &v->attr);
     if (v->attr.flags & SNMP_FLAG_VALUE) {
 	if (inet_ntop(AF_INET6, &v->value, buffer, sizeof(buffer))) {
-	    fprintf(stream, "%s", buffer);
+	    snmp_sink_puts(sink, buffer);
 	}
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_octs(FILE *stream, const char *name, snmp_octs_t *v)
+xml_write_octs(snmp_sink_t *sink, const xml_tag_t *tag, snmp_octs_t *v)
 {
-    int i;
-
-    xml_write_open(stream, name, &v->attr);
+    xml_write_open(sink, tag, &v->attr);
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	for (i = 0; i < v->len; i++) {
-	    fprintf(stream, "%.2x", v->value[i]);
-	}
+	snmp_sink_hex(sink, v->value, v->len);
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_oid(FILE *stream, const char *name, snmp_oid_t *v)
+xml_write_oid(snmp_sink_t *sink, const xml_tag_t *tag, snmp_oid_t *v)
 {
-    int i;
-
-    xml_write_open(stream, name, &v->attr);
+    xml_write_open(sink, tag, &v->attr);
     if (v->attr.flags & SNMP_FLAG_VALUE) {
-	for (i = 0; i < v->len; i++) {
-	    fprintf(stream, "%s%"PRIu32, (i == 0) ? "" : ".", v->value[i]);
-	}
+	snmp_sink_oid(sink, SNMP_OID_VALUE(v), v->len);
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_varbind(FILE *stream, snmp_varbind_t *varbind)
+xml_write_varbind(snmp_sink_t *sink, snmp_varbind_t *varbind)
 {
-    char *name = "varbind";
+    const xml_tag_t *tag = &xml_tag_varbind;
     
-    xml_write_open(stream, name, &varbind->attr);
+    xml_write_open(sink, tag, &varbind->attr);
     
     if (varbind->name.attr.flags) { /* don't write an empty name tag */
-	xml_write_oid(stream, "name", &varbind->name);
+	xml_write_oid(sink, &xml_tag_name, &varbind->name);
     }
 
     if (varbind->attr.flags & SNMP_FLAG_VALUE) {
 	switch (varbind->type) {
 	case SNMP_TYPE_NULL:
-	    xml_write_null(stream, "null", &varbind->value.null);
+	    xml_write_null(sink, &xml_tag_null, &varbind->value.null);
 	    break;
 	case SNMP_TYPE_INT32:
-	    xml_write_int32(stream, "integer32", &varbind->value.i32);
+	    xml_write_int32(sink, &xml_tag_integer32, &varbind->value.i32);
 	    break;
 	case SNMP_TYPE_UINT32:
-	    xml_write_uint32(stream, "unsigned32", &varbind->value.u32);
+	    xml_write_uint32(sink, &xml_tag_unsigned32, &varbind->value.u32);
 	    break;
 	case SNMP_TYPE_COUNTER32:
-	    xml_write_uint32(stream, "counter32", &varbind->value.u32);
+	    xml_write_uint32(sink, &xml_tag_counter32, &varbind->value.u32);
 	    break;
 	case SNMP_TYPE_TIMETICKS:
-	    xml_write_uint32(stream, "timeticks", &varbind->value.u32);
+	    xml_write_uint32(sink, &xml_tag_timeticks, &varbind->value.u32);
 	    break;
 	case SNMP_TYPE_COUNTER64:
-	    xml_write_uint64(stream, "counter64", &varbind->value.u64);
+	    xml_write_uint64(sink, &xml_tag_counter64, &varbind->value.u64);
 	    break;
 	case SNMP_TYPE_IPADDR:
-	    xml_write_ipaddr(stream, "ipaddress", &varbind->value.ip);
+	    xml_write_ipaddr(sink, &xml_tag_ipaddress, &varbind->value.ip);
 	    break;
 	case SNMP_TYPE_OCTS:
-	    xml_write_octs(stream, "octet-string", &varbind->value.octs);
+	    xml_write_octs(sink, &xml_tag_octet_string, &varbind->value.octs);
 	    break;
 	case SNMP_TYPE_OID:
-	    xml_write_oid(stream, "object-identifier", &varbind->value.oid);
+	    xml_write_oid(sink, &xml_tag_object_identifier, &varbind->value.oid);
 	    break;
 	case SNMP_TYPE_OPAQUE:
-	    xml_write_octs(stream, "opaque", &varbind->value.octs);
+	    xml_write_octs(sink, &xml_tag_opaque, &varbind->value.octs);
 	    break;
 	case SNMP_TYPE_NO_SUCH_OBJ:
-	    xml_write_null(stream, "no-such-object", &varbind->value.null);
+	    xml_write_null(sink, &xml_tag_no_such_object, &varbind->value.null);
 	    break;
 	case SNMP_TYPE_NO_SUCH_INST:
-	    xml_write_null(stream, "no-such-instance", &varbind->value.null);
+	    xml_write_null(sink, &xml_tag_no_such_instance, &varbind->value.null);
 	    break;
 	case SNMP_TYPE_END_MIB_VIEW:
-	    xml_write_null(stream, "end-of-mib-view", &varbind->value.null);
+	    xml_write_null(sink, &xml_tag_end_of_mib_view, &varbind->value.null);
 	    break;
 	}
     }
     
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_varbindlist(FILE *stream, snmp_var_bindings_t *varbindlist)
+xml_write_varbindlist(snmp_sink_t *sink, snmp_var_bindings_t *varbindlist)
 {
-    const char *name = "variable-bindings";
+    const xml_tag_t *tag = &xml_tag_variable_bindings;
     snmp_varbind_t *vb;
 
-    xml_write_open(stream, name, &varbindlist->attr);
+    xml_write_open(sink, tag, &varbindlist->attr);
     if (varbindlist->attr.flags & SNMP_FLAG_VALUE) {
-	for (vb = varbindlist->varbind; vb; vb = vb->next) {
-	    xml_write_varbind(stream, vb);
+	SNMP_VBL_FOREACH(varbindlist, vb) {
+	    xml_write_varbind(sink, vb);
 	}
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_pdu(FILE *stream, snmp_pdu_t *pdu)
+xml_write_pdu(snmp_sink_t *sink, snmp_pdu_t *pdu)
 {
-    char *name = NULL;
+    const xml_tag_t *tag = NULL;
     
     if (pdu->attr.flags & SNMP_FLAG_VALUE) {
 	switch (pdu->type) {
 	case SNMP_PDU_GET:
-	    name = "get-request";
+	    tag = &xml_tag_get_request;
 	    break;
 	case SNMP_PDU_GETNEXT:
-	    name = "get-next-request";
+	    tag = &xml_tag_get_next_request;
 	    break;
 	case SNMP_PDU_GETBULK:
-	    name = "get-bulk-request";
+	    tag = &xml_tag_get_bulk_request;
 	    break;
 	case SNMP_PDU_SET:
-	    name = "set-request";
+	    tag = &xml_tag_set_request;
 	    break;
 	case SNMP_PDU_RESPONSE:
-	    name = "response";
+	    tag = &xml_tag_response;
 	    break;
 	case SNMP_PDU_TRAP1:
-	    name = "trap";
+	    tag = &xml_tag_trap;
 	    break;
 	case SNMP_PDU_TRAP2:
-	    name = "snmpV2-trap";
+	    tag = &xml_tag_snmpV2_trap;
 	    break;
 	case SNMP_PDU_INFORM:
-	    name = "inform-request";
+	    tag = &xml_tag_inform_request;
 	    break;
 	case SNMP_PDU_REPORT:
-	    name = "report";
+	    tag = &xml_tag_report;
 	    break;
 	}
     }
+
+    /* Unknown PDU types used to come out as "(null)" elements. */
+
+    if (! tag) {
+	tag = &xml_tag_null_pdu;
+    }
     
-    xml_write_open(stream, name, &pdu->attr);
+    xml_write_open(sink, tag, &pdu->attr);
 
-    xml_write_int32(stream, "request-id", &pdu->req_id);
-    xml_write_int32(stream, "error-status", &pdu->err_status);
-    xml_write_int32(stream, "error-index", &pdu->err_index);
-    xml_write_varbindlist(stream, &pdu->varbindings);
+    xml_write_int32(sink, &xml_tag_request_id, &pdu->req_id);
+    xml_write_int32(sink, &xml_tag_error_status, &pdu->err_status);
+    xml_write_int32(sink, &xml_tag_error_index, &pdu->err_index);
+    xml_write_varbindlist(sink, &pdu->varbindings);
 
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_trap(FILE *stream, snmp_pdu_t *pdu)
+xml_write_trap(snmp_sink_t *sink, snmp_pdu_t *pdu)
 {
-    const char *name = "trap";
+    const xml_tag_t *tag = &xml_tag_trap;
     
-    xml_write_open(stream, name, &pdu->attr);
-    xml_write_oid(stream, "enterprise", &pdu->enterprise);
-    xml_write_ipaddr(stream, "agent-addr", &pdu->agent_addr);
-    xml_write_int32(stream, "generic-trap", &pdu->generic_trap);
-    xml_write_int32(stream, "specific-trap", &pdu->specific_trap);
-    xml_write_int32(stream, "time-stamp", &pdu->time_stamp);
-    xml_write_varbindlist(stream, &pdu->varbindings);
-    xml_write_close(stream, name);
+    xml_write_open(sink, tag, &pdu->attr);
+    xml_write_oid(sink, &xml_tag_enterprise, &pdu->enterprise);
+    xml_write_ipaddr(sink, &xml_tag_agent_addr, &pdu->agent_addr);
+    xml_write_int32(sink, &xml_tag_generic_trap, &pdu->generic_trap);
+    xml_write_int32(sink, &xml_tag_specific_trap, &pdu->specific_trap);
+    xml_write_int32(sink, &xml_tag_time_stamp, &pdu->time_stamp);
+    xml_write_varbindlist(sink, &pdu->varbindings);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_scoped_pdu(FILE *stream, snmp_scoped_pdu_t *scoped_pdu)
+xml_write_scoped_pdu(snmp_sink_t *sink, snmp_scoped_pdu_t *scoped_pdu)
 {
-    const char *name = "scoped-pdu";
+    const xml_tag_t *tag = &xml_tag_scoped_pdu;
     
-    xml_write_open(stream, name, &scoped_pdu->attr);
+    xml_write_open(sink, tag, &scoped_pdu->attr);
     if (scoped_pdu->attr.flags & SNMP_FLAG_VALUE) {
-	xml_write_octs(stream, "context-engine-id",
+	xml_write_octs(sink, &xml_tag_context_engine_id,
 		       &scoped_pdu->context_engine_id);
-	xml_write_octs(stream, "context-name",
+	xml_write_octs(sink, &xml_tag_context_name,
 		       &scoped_pdu->context_name);
-	xml_write_pdu(stream, &scoped_pdu->pdu);
+	xml_write_pdu(sink, &scoped_pdu->pdu);
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_usm(FILE *stream, snmp_usm_t *usm)
+xml_write_usm(snmp_sink_t *sink, snmp_usm_t *usm)
 {
-    const char *name = "usm";
+    const xml_tag_t *tag = &xml_tag_usm;
 
-    xml_write_open(stream, name, &usm->attr);
+    xml_write_open(sink, tag, &usm->attr);
     if (usm->attr.flags & SNMP_FLAG_VALUE) {
-	xml_write_octs(stream, "auth-engine-id", &usm->auth_engine_id);
-	xml_write_uint32(stream, "auth-engine-boots", &usm->auth_engine_boots);
-	xml_write_uint32(stream, "auth-engine-time", &usm->auth_engine_time);
-	xml_write_octs(stream, "user", &usm->user);
-	xml_write_octs(stream, "auth-params", &usm->auth_params);
-	xml_write_octs(stream, "priv-params", &usm->priv_params);
+	xml_write_octs(sink, &xml_tag_auth_engine_id, &usm->auth_engine_id);
+	xml_write_uint32(sink, &xml_tag_auth_engine_boots, &usm->auth_engine_boots);
+	xml_write_uint32(sink, &xml_tag_auth_engine_time, &usm->auth_engine_time);
+	xml_write_octs(sink, &xml_tag_user, &usm->user);
+	xml_write_octs(sink, &xml_tag_auth_params, &usm->auth_params);
+	xml_write_octs(sink, &xml_tag_priv_params, &usm->priv_params);
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_message(FILE *stream, snmp_msg_t *msg)
+xml_write_message(snmp_sink_t *sink, snmp_msg_t *msg)
 {
-    const char *name = "message";
+    const xml_tag_t *tag = &xml_tag_message;
 
-    xml_write_open(stream, name, &msg->attr);
+    xml_write_open(sink, tag, &msg->attr);
     if (msg->attr.flags & SNMP_FLAG_VALUE) {
-	xml_write_uint32(stream, "msg-id", &msg->msg_id);
-	xml_write_uint32(stream, "max-size", &msg->msg_max_size);
-	xml_write_octs(stream, "flags", &msg->msg_flags);
-	xml_write_uint32(stream, "security-model", &msg->msg_sec_model);
+	xml_write_uint32(sink, &xml_tag_msg_id, &msg->msg_id);
+	xml_write_uint32(sink, &xml_tag_max_size, &msg->msg_max_size);
+	xml_write_octs(sink, &xml_tag_flags, &msg->msg_flags);
+	xml_write_uint32(sink, &xml_tag_security_model, &msg->msg_sec_model);
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 static void
-xml_write_snmp(FILE *stream, snmp_snmp_t *snmp)
+xml_write_snmp(snmp_sink_t *sink, snmp_snmp_t *snmp)
 {
-    const char *name = "snmp";
+    const xml_tag_t *tag = &xml_tag_snmp;
     
-    xml_write_open(stream, name, &snmp->attr);
+    xml_write_open(sink, tag, &snmp->attr);
     if (snmp->attr.flags & SNMP_FLAG_VALUE) {
-	xml_write_int32(stream, "version", &snmp->version);
+	xml_write_int32(sink, &xml_tag_version, &snmp->version);
 	switch (snmp->version.value) {
 	case 0:
 	case 1:
-	    xml_write_octs(stream, "community", &snmp->community);
+	    xml_write_octs(sink, &xml_tag_community, &snmp->community);
 	    if (snmp->scoped_pdu.pdu.type == SNMP_PDU_TRAP1) {
-		xml_write_trap(stream, &snmp->scoped_pdu.pdu);
+		xml_write_trap(sink, &snmp->scoped_pdu.pdu);
 	    } else {
-		xml_write_pdu(stream, &snmp->scoped_pdu.pdu);
+		xml_write_pdu(sink, &snmp->scoped_pdu.pdu);
 	    }
 	    break;
 	case 3:
-	    xml_write_message(stream, &snmp->message);
-	    xml_write_usm(stream, &snmp->usm);
-	    xml_write_scoped_pdu(stream, &snmp->scoped_pdu);
+	    xml_write_message(sink, &snmp->message);
+	    xml_write_usm(sink, &snmp->usm);
+	    xml_write_scoped_pdu(sink, &snmp->scoped_pdu);
 	    break;
 	default:
 	    break;
 	}
     }
-    xml_write_close(stream, name);
+    xml_write_close(sink, tag);
 }
 
 
 void
-snmp_xml_write_stream_pkt(FILE *stream, snmp_packet_t *pkt)
+snmp_xml_write_stream_pkt(snmp_sink_t *sink, snmp_packet_t *pkt)
 {
     if (! pkt) return;
     
-    fprintf(stream, "<packet>");
+    snmp_sink_write(sink, "<packet>", 8);
 
-    xml_write_uint32(stream, "time-sec", &pkt->time_sec);
-    xml_write_uint32(stream, "time-usec", &pkt->time_usec);
+    xml_write_uint32(sink, &xml_tag_time_sec, &pkt->time_sec);
+    xml_write_uint32(sink, &xml_tag_time_usec, &pkt->time_usec);
 
     if (pkt->src_addr.attr.flags & SNMP_FLAG_VALUE) {
-	xml_write_ipaddr(stream, "src-ip", &pkt->src_addr);
+	xml_write_ipaddr(sink, &xml_tag_src_ip, &pkt->src_addr);
     } else {
-	xml_write_ip6addr(stream, "src-ip", &pkt->src_addr6);
+	xml_write_ip6addr(sink, &xml_tag_src_ip, &pkt->src_addr6);
     }
-    xml_write_uint32(stream, "src-port", &pkt->src_port);
+    xml_write_uint32(sink, &xml_tag_src_port, &pkt->src_port);
     if (pkt->dst_addr.attr.flags & SNMP_FLAG_VALUE) {
-	xml_write_ipaddr(stream, "dst-ip", &pkt->dst_addr);
+	xml_write_ipaddr(sink, &xml_tag_dst_ip, &pkt->dst_addr);
     } else {
-	xml_write_ip6addr(stream, "dst-ip", &pkt->dst_addr6);
+	xml_write_ip6addr(sink, &xml_tag_dst_ip, &pkt->dst_addr6);
     }
-    xml_write_uint32(stream, "dst-port", &pkt->dst_port);
+    xml_write_uint32(sink, &xml_tag_dst_port, &pkt->dst_port);
 
     if (pkt->attr.flags & SNMP_FLAG_VALUE) {
-	xml_write_snmp(stream, &pkt->snmp);
+	xml_write_snmp(sink, &pkt->snmp);
     }
 
-    fprintf(stream, "</packet>\n");
+    snmp_sink_write(sink, "</packet>\n", 10);
 }
 
 
 void
-snmp_xml_write_stream_new(FILE *stream)
+snmp_xml_write_stream_new(snmp_sink_t *sink)
 {
-    fprintf(stream,
-	    "<?xml version=\"1.0\"?>\n<snmptrace xmlns='%s'>\n",
-	    "http://www.nosuchname.net/nmrg/snmptrace");
+    snmp_sink_puts(sink,
+		   "<?xml version=\"1.0\"?>\n<snmptrace xmlns='"
+		   "http://www.nosuchname.net/nmrg/snmptrace'>\n");
 }
 
 
 void
-snmp_xml_write_stream_end(FILE *stream)
+snmp_xml_write_stream_end(snmp_sink_t *sink)
 {
-    fprintf(stream, "</snmptrace>\n");
+    snmp_sink_puts(sink, "</snmptrace>\n");
 }
@@ -0,0 +1,351 @@
+/*
+ * zip.c --
+ *
+ * Compression of output sinks. The data written to a compressing sink
+ * is collected into blocks of SNMP_ZIP_BLOCK bytes, and each block is
+ * compressed into a gzip member of its own by a pool of worker threads.
+ * The members are written in order as they complete. A sequence of
+ * gzip members is a valid gzip file, so files can also be reopened and
+ * appended to later.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+#include "snmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define ZIP_INFLIGHT	4	/* blocks per thread not yet compressed */
+
+typedef struct _zip_job {
+    struct _zip_job	*next;		/* next block of the same sink */
+    struct _zip_job	*qnext;		/* next block in the work queue */
+    int			level;
+    u_char		*in;
+    size_t		in_len;
+    u_char		*out;
+    size_t		out_len;
+    int			done;
+} zip_job_t;
+
+struct _snmp_zip {
+    int			level;
+    u_char		*buf;		/* block being collected */
+    size_t		len;
+    zip_job_t		*head;		/* oldest block not yet written */
+    zip_job_t		*tail;
+    uint64_t		members;	/* gzip members written */
+};
+
+/*
+ * The worker threads are shared by all compressing sinks and started
+ * when the first one is created.
+ */
+
+static struct {
+    pthread_mutex_t	lock;
+    pthread_cond_t	work;		/* the queue is not empty */
+    pthread_cond_t	done;		/* a block has been compressed */
+    zip_job_t		*qhead;
+    zip_job_t		*qtail;
+    unsigned		busy;		/* blocks not yet compressed */
+    pthread_t		*threads;
+    unsigned		nthreads;
+    int			shutdown;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static inline void*
+xmalloc(size_t size)
+{
+    void *p;
+
+    p = malloc(size);
+    if (! p) {
+	abort();
+    }
+    return p;
+}
+
+/*
+ * Compress a block into a complete gzip member.
+ */
+
+static void
+zip_deflate(zip_job_t *job)
+{
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, job->level, Z_DEFLATED, 15 + 16, 8,
+		     Z_DEFAULT_STRATEGY) != Z_OK) {
+	abort();
+    }
+    job->out_len = deflateBound(&zs, job->in_len);
+    job->out = xmalloc(job->out_len);
+    zs.next_in = job->in;
+    zs.avail_in = job->in_len;
+    zs.next_out = job->out;
+    zs.avail_out = job->out_len;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+	abort();
+    }
+    job->out_len = zs.total_out;
+    deflateEnd(&zs);
+    free(job->in);
+    job->in = NULL;
+}
+
+static void*
+zip_main(void *arg)
+{
+    zip_job_t *job;
+
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+	while (! pool.qhead && ! pool.shutdown) {
+	    pthread_cond_wait(&pool.work, &pool.lock);
+	}
+	if (! pool.qhead) {
+	    break;
+	}
+	job = pool.qhead;
+	pool.qhead = job->qnext;
+	if (! pool.qhead) {
+	    pool.qtail = NULL;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	zip_deflate(job);
+
+	pthread_mutex_lock(&pool.lock);
+	job->done = 1;
+	pool.busy--;
+	pthread_cond_broadcast(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void
+zip_start(void)
+{
+    long n;
+    unsigned i;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.nthreads = (n > 0) ? n : 1;
+    pool.threads = xmalloc(pool.nthreads * sizeof(pthread_t));
+    for (i = 0; i < pool.nthreads; i++) {
+	if (pthread_create(&pool.threads[i], NULL, zip_main, NULL)) {
+	    fprintf(stderr, "%s: creating compression thread failed\n",
+		    progname);
+	    exit(1);
+	}
+    }
+}
+
+snmp_zip_t*
+snmp_zip_new(int level)
+{
+    snmp_zip_t *zip;
+
+    pthread_mutex_lock(&pool.lock);
+    if (! pool.threads) {
+	zip_start();
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    zip = xmalloc(sizeof(snmp_zip_t));
+    memset(zip, 0, sizeof(snmp_zip_t));
+    zip->level = level;
+    return zip;
+}
+
+/*
+ * Write the compressed blocks at the head of the sink's list. If wait
+ * is set, we wait until all blocks of the sink have been written.
+ */
+
+static void
+zip_drain(snmp_zip_t *zip, int wait, snmp_zip_out out, void *ctx)
+{
+    zip_job_t *job;
+
+    pthread_mutex_lock(&pool.lock);
+    while ((job = zip->head)) {
+	if (! job->done) {
+	    if (! wait) {
+		break;
+	    }
+	    pthread_cond_wait(&pool.done, &pool.lock);
+	    continue;
+	}
+	zip->head = job->next;
+	if (! zip->head) {
+	    zip->tail = NULL;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	out(ctx, job->out, job->out_len);
+	zip->members++;
+	free(job->out);
+	free(job);
+
+	pthread_mutex_lock(&pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Hand the collected block to the worker threads. The number of blocks
+ * waiting for compression is limited for all sinks together, so that
+ * the memory used does not depend on the number of sinks.
+ */
+
+static void
+zip_submit(snmp_zip_t *zip)
+{
+    zip_job_t *job;
+
+    job = xmalloc(sizeof(zip_job_t));
+    memset(job, 0, sizeof(zip_job_t));
+    job->level = zip->level;
+    job->in = zip->buf;
+    job->in_len = zip->len;
+    zip->buf = NULL;
+    zip->len = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    if (zip->tail) {
+	zip->tail->next = job;
+    } else {
+	zip->head = job;
+    }
+    zip->tail = job;
+    if (pool.qtail) {
+	pool.qtail->qnext = job;
+    } else {
+	pool.qhead = job;
+    }
+    pool.qtail = job;
+    pool.busy++;
+    pthread_cond_signal(&pool.work);
+    while (pool.busy > ZIP_INFLIGHT * pool.nthreads) {
+	pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Append the data of an I/O vector to the block being collected. Full
+ * blocks are queued for compression, and the compressed blocks are
+ * passed to the output function in order.
+ */
+
+void
+snmp_zip_write(snmp_zip_t *zip, const struct iovec *iov, int cnt,
+	       snmp_zip_out out, void *ctx)
+{
+    const u_char *p;
+    size_t len, n;
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+	p = iov[i].iov_base;
+	len = iov[i].iov_len;
+	while (len) {
+	    if (! zip->buf) {
+		zip->buf = xmalloc(SNMP_ZIP_BLOCK);
+	    }
+	    n = SNMP_ZIP_BLOCK - zip->len;
+	    if (n > len) {
+		n = len;
+	    }
+	    memcpy(zip->buf + zip->len, p, n);
+	    zip->len += n;
+	    p += n, len -= n;
+	    if (zip->len == SNMP_ZIP_BLOCK) {
+		zip_submit(zip);
+	    }
+	}
+    }
+
+    zip_drain(zip, 0, out, ctx);
+}
+
+/*
+ * Wait for all blocks of a sink and write them. If empty is set and
+ * nothing has been written at all, an empty gzip member is written so
+ * that the output is a valid gzip file.
+ */
+
+void
+snmp_zip_flush(snmp_zip_t *zip, int empty, snmp_zip_out out, void *ctx)
+{
+    zip_job_t job;
+
+    if (zip->len) {
+	zip_submit(zip);
+    }
+    zip_drain(zip, 1, out, ctx);
+
+    if (empty && ! zip->members) {
+	memset(&job, 0, sizeof(job));
+	job.level = zip->level;
+	zip_deflate(&job);
+	out(ctx, job.out, job.out_len);
+	zip->members++;
+	free(job.out);
+    }
+}
+
+void
+snmp_zip_delete(snmp_zip_t *zip)
+{
+    zip_job_t *job, *next;
+
+    for (job = zip->head; job; job = next) {
+	next = job->next;
+	pthread_mutex_lock(&pool.lock);
+	while (! job->done) {
+	    pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	free(job->out);
+	free(job);
+    }
+    free(zip->buf);
+    free(zip);
+}
+
+/*
+ * Stop the worker threads once all sinks have been closed.
+ */
+
+void
+snmp_zip_done(void)
+{
+    unsigned i;
+
+    if (! pool.threads) {
+	return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.nthreads; i++) {
+	pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+}
@@ -92,6 +92,168 @@ test_csv_reader_csv_writer()
     done
 }
 
+# frags-whole.pcap holds the datagrams of frags.pcap reassembled, and
+# in frags-late.pcap the last fragment of the first datagram arrives
+# a minute after the first one.
+
+test_frag_reassembly()
+{
+    for format in csv xml; do
+	diff <($SNMPDUMP -i pcap -o $format frags.pcap) \
+	     <($SNMPDUMP -i pcap -o $format frags-whole.pcap) \
+	    && diff <($SNMPDUMP -i pcap -o $format -T 120 frags-late.pcap \
+		      | grep -c get-next-request) <(echo 1) \
+	    && diff <($SNMPDUMP -i pcap -o $format -T 30 frags-late.pcap \
+		      2> /dev/null | grep -c get-next-request) <(echo 0) \
+	    && [ -z "`$SNMPDUMP -i pcap -o csv -M 256 frags.pcap 2> /dev/null`" ]
+	if [ $? == 0 ]; then
+	    echo "$FUNCNAME: $format: PASSED"
+	else
+	    echo "$FUNCNAME: $format: FAILED"
+	fi
+    done
+}
+
+# The filter and the anonymization modify the messages, which must not
+# touch the memory mapped pcap file. Reading the pcap file directly
+# must give the same result as modifying the XML read back in.
+
+test_pcap_reader_modify()
+{
+    for file in *.pcap; do
+	diff <($SNMPDUMP -i pcap -o xml -z 'community|value' $file) \
+	     <($SNMPDUMP -i pcap -o xml $file \
+	       | $SNMPDUMP -i xml -o xml -z 'community|value') \
+	    && diff <($SNMPDUMP -i pcap -o xml -a -p secret $file) \
+		    <($SNMPDUMP -i pcap -o xml $file \
+		      | $SNMPDUMP -i xml -o xml -a -p secret)
+	if [ $? == 0 ]; then
+	    echo "$FUNCNAME: $file: PASSED"
+	else
+	    echo "$FUNCNAME: $file: FAILED"
+	fi
+    done
+}
+
+test_pcap_reader_stdin()
+{
+    for file in *.pcap; do
+	diff <(cat $file | $SNMPDUMP -i pcap -o xml) \
+	     <($SNMPDUMP -i pcap -o xml $file) \
+	    && diff <(cat $file | $SNMPDUMP -i pcap -o csv) \
+		    <($SNMPDUMP -i pcap -o csv $file)
+	if [ $? == 0 ]; then
+	    echo "$FUNCNAME: $file: PASSED"
+	else
+	    echo "$FUNCNAME: $file: FAILED"
+	fi
+    done
+}
+
+# Decoding with several threads must not change the output.
+
+test_pcap_reader_threads()
+{
+    for file in *.pcap; do
+	cmp -s <($SNMPDUMP -i pcap -o xml -j 4 $file) \
+	       <($SNMPDUMP -i pcap -o xml -j 1 $file) \
+	    && cmp -s <($SNMPDUMP -i pcap -o csv -j 4 $file) \
+		      <($SNMPDUMP -i pcap -o csv -j 1 $file)
+	if [ $? == 0 ]; then
+	    echo "$FUNCNAME: $file: PASSED"
+	else
+	    echo "$FUNCNAME: $file: FAILED"
+	fi
+    done
+}
+
+test_flow_shards()
+{
+    for file in *.pcap; do
+	for mode in F S; do
+	    one=`mktemp -d`
+	    four=`mktemp -d`
+	    $SNMPDUMP -i pcap -o csv -$mode -J 1 -C $one $file > /dev/null
+	    $SNMPDUMP -i pcap -o csv -$mode -J 4 -C $four $file > /dev/null
+	    diff -r $one $four
+	    if [ $? == 0 ]; then
+		echo "$FUNCNAME: $file -$mode: PASSED"
+	    else
+		echo "$FUNCNAME: $file -$mode: FAILED"
+	    fi
+	    rm -rf $one $four
+	done
+    done
+}
+
+test_flow_batch()
+{
+    for file in *.pcap; do
+	for mode in F S; do
+	    plain=`mktemp -d`
+	    batch=`mktemp -d`
+	    lru=`mktemp -d`
+	    $SNMPDUMP -i pcap -o csv -$mode -C $plain $file > /dev/null
+	    $SNMPDUMP -i pcap -o csv -$mode -B 16 -C $batch $file > /dev/null
+	    # few descriptors force files to be closed and reopened
+	    (ulimit -n 16; \
+	     $SNMPDUMP -i pcap -o csv -$mode -B 16 -C $lru $file > /dev/null)
+	    diff -r $plain $batch && diff -r $plain $lru
+	    if [ $? == 0 ]; then
+		echo "$FUNCNAME: $file -$mode: PASSED"
+	    else
+		echo "$FUNCNAME: $file -$mode: FAILED"
+	    fi
+	    rm -rf $plain $batch $lru
+	done
+    done
+}
+
+test_gzip_writer()
+{
+    for file in *.pcap; do
+	plain=`mktemp -d`
+	gzip=`mktemp -d`
+	$SNMPDUMP -i pcap -o csv -F -C $plain $file > $plain/stdout
+	$SNMPDUMP -i pcap -o csv -F -Z gzip -C $gzip $file > $gzip/stdout.gz
+	gunzip $gzip/*.gz && diff -r $plain $gzip \
+	    && $SNMPDUMP -i pcap -o xml -Z gzip:9 $file | zcat \
+	    | diff - <($SNMPDUMP -i pcap -o xml $file)
+	if [ $? == 0 ]; then
+	    echo "$FUNCNAME: $file: PASSED"
+	else
+	    echo "$FUNCNAME: $file: FAILED"
+	fi
+	rm -rf $plain $gzip
+    done
+}
+
+# slices.csv has a gap of almost 10 seconds in the middle of the flow
+# cg-153.137.72.29-cr-153.137.64.13, so -I 5 must close the flow and
+# start a new file for it. Every file must be complete and together
+# they must hold the messages of the flow written without -I.
+
+test_flow_idle()
+{
+    file=slices.csv
+    flow=cg-153.137.72.29-cr-153.137.64.13
+    plain=`mktemp -d`
+    idle=`mktemp -d`
+    xml=`mktemp -d`
+    $SNMPDUMP -i csv -o csv -F -C $plain $file > /dev/null
+    $SNMPDUMP -i csv -o csv -F -I 5 -C $idle $file > /dev/null
+    $SNMPDUMP -i csv -o xml -F -I 5 -C $xml $file > /dev/null
+    [ `ls $idle/$flow-*.csv | wc -l` -ge 2 ] \
+	&& cat $idle/$flow-*.csv | diff $plain/$flow.csv - \
+	&& xmllint --noout $xml/$flow-*.xml
+    if [ $? == 0 ]; then
+	echo "$FUNCNAME: $file: PASSED"
+    else
+	echo "$FUNCNAME: $file: FAILED"
+    fi
+    rm -rf $plain $idle $xml
+}
+
 test_pcap_reader_xml_writer
 echo ""
 test_pcap_reader_csv_writer
@@ -104,4 +266,20 @@ echo ""
 #echo ""
 test_csv_reader_csv_writer
 echo ""
+test_frag_reassembly
+echo ""
+test_pcap_reader_modify
+echo ""
+test_pcap_reader_stdin
+echo ""
+test_pcap_reader_threads
+echo ""
+test_flow_shards
+echo ""
+test_flow_batch
+echo ""
+test_gzip_writer
+echo ""
+test_flow_idle
+echo ""
 